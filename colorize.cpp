@@ -1,4 +1,6 @@
-#include <ctype.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <FL/Fl.H>
 #include <FL/Fl_Text_Buffer.H>
 #include <FL/Fl_Text_Display.H>
@@ -6,30 +8,8 @@
 
 #include "fledit.hpp"
 
-const char *const s_keywords[] = {
-    "asm",
-    "break",
-    "case",
-    "const",
-    "continue",
-    "default",
-    "do",
-    "else",
-    "extern",
-    "false",
-    "for",
-    "goto",
-    "if",
-    "return",
-    "static",
-    "struct",
-    "switch",
-    "true",
-    "typedef",
-    "union",
-    "volatile",
-    "while",
-};
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 Fl_Text_Display::Style_Table_Entry s_styleTable[] = {
     {FL_BLACK,       FL_COURIER, 14},  // plain
@@ -37,180 +17,730 @@ Fl_Text_Display::Style_Table_Entry s_styleTable[] = {
     {FL_DARK_YELLOW, FL_COURIER, 14},  // string
     {FL_BLUE,        FL_COURIER, 14},  // keyword
     {FL_RED,         FL_COURIER, 14},  // preprocessor
+    {FL_BLACK,       FL_COURIER, 14},  // not highlighted yet
+};
+
+// Style of text that hasn't been lexed yet. The display asks for it to be
+// highlighted when it is about to draw it.
+#define STYLE_UNFINISHED 'F'
+
+// How many lines past the requested position to highlight at once
+#define LAZY_LOOKAHEAD_LINES 100
+
+// How far an edit may re-highlight before leaving the rest to the display
+#define SYNC_LEX_LIMIT (64 * 1024)
+
+// How far ahead of what has been lexed the display may ask for before it is left
+// to the background thread instead of being lexed on the spot
+#define SYNC_LAZY_LIMIT (1024 * 1024)
+
+// How much text the background thread highlights at a time
+#define BACKGROUND_CHUNK_SIZE (1024 * 1024)
+
+// How much text must be left to highlight for it to be split across processors
+#define PARALLEL_HIGHLIGHT_SIZE (8 * 1024 * 1024)
+
+// How much text is copied at a time for the processors to split
+#define PARALLEL_WINDOW_SIZE (32 * 1024 * 1024)
+
+// Lines are kept in a gap array. Entries before the gap store their start
+// offset, and entries after it store their distance from the end of the text,
+// so an edit only touches the entries near it.
+struct LineState
+{
+    int start;
+    unsigned char state;
 };
 
-Fl_Text_Buffer *colorize_init(Fl_Text_Buffer *textbuf)
+// Background highlighting works through the text a chunk at a time, starting
+// from the last known line. Each chunk is lexed from a copy of the text. If the
+// text is edited in the meantime, only the lines before the edit are kept.
+struct HighlightJob
 {
-    size_t length = textbuf->length();
-    Fl_Text_Buffer *stylebuf = new Fl_Text_Buffer(length);
-    char *style = new char[length + 1];
-    unsigned int i;
+    struct Colorizer *colorizer;  // NULL if the file was closed
+    const struct Grammar *grammar;
+    unsigned int generation;
+    int start;
+    int end;
+    unsigned char state;  // the lexer state at 'start', then at 'end'
+    char *text;
+    char *style;
+    struct LineState *lines;  // lines found after 'start'
+    int numLines;
+};
+
+static int line_count(const struct Colorizer *c)
+{
+    return c->linesCapacity - (c->gapEnd - c->gapStart);
+}
+
+static int line_start_at(struct Colorizer *c, int i, int length)
+{
+    if (i < c->gapStart)
+        return c->lines[i].start;
+    else
+        return length - c->lines[i + c->gapEnd - c->gapStart].start;
+}
+
+static void move_gap(struct Colorizer *c, int index, int length)
+{
+    while (c->gapStart > index)
+    {
+        c->gapStart--;
+        c->gapEnd--;
+        c->lines[c->gapEnd].state = c->lines[c->gapStart].state;
+        c->lines[c->gapEnd].start = length - c->lines[c->gapStart].start;
+    }
+    while (c->gapStart < index)
+    {
+        c->lines[c->gapStart].state = c->lines[c->gapEnd].state;
+        c->lines[c->gapStart].start = length - c->lines[c->gapEnd].start;
+        c->gapStart++;
+        c->gapEnd++;
+    }
+}
+
+// Inserts a line at the gap.
+static void insert_line(struct Colorizer *c, int start, unsigned char state)
+{
+    if (c->gapStart == c->gapEnd)
+    {
+        int newCapacity = MAX(c->linesCapacity * 2, 256);
+        int afterGap = c->linesCapacity - c->gapEnd;
+
+        c->lines = (struct LineState *)realloc(c->lines, newCapacity * sizeof(*c->lines));
+        memmove(c->lines + newCapacity - afterGap, c->lines + c->gapEnd, afterGap * sizeof(*c->lines));
+        c->gapEnd = newCapacity - afterGap;
+        c->linesCapacity = newCapacity;
+    }
+    c->lines[c->gapStart].start = start;
+    c->lines[c->gapStart].state = state;
+    c->gapStart++;
+}
+
+// Returns the index of the line containing 'pos'.
+static int find_line(struct Colorizer *c, int pos, int length)
+{
+    int lo = 0;
+    int hi = line_count(c) - 1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+
+        if (line_start_at(c, mid, length) <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Replaces the styles from 'start' to 'end' with 'count' bytes that have not
+// been highlighted yet.
+static void replace_unfinished(Fl_Text_Buffer *stylebuf, int start, int end, int count)
+{
+    char *style;
 
-    memset(style, 'A', length);
-    style[length] = 0;
-    stylebuf->text(style);
+    if (start == end && count == 0)
+        return;
+    style = new char[count + 1];
+    memset(style, STYLE_UNFINISHED, count);
+    style[count] = 0;
+    stylebuf->replace(start, end, style);
     delete[] style;
-    return stylebuf;
 }
 
-static bool is_word_char(int c)
+void colorize_init(struct Colorizer *c, Fl_Text_Buffer *textbuf, const char *filename)
 {
-    return (isalnum(c) || c == '_');
+    int length = textbuf->length();
+
+    memset(c, 0, sizeof(*c));
+    c->textbuf = textbuf;
+    c->grammar = grammar_for_file(filename);
+    c->stylebuf = new Fl_Text_Buffer(length);
+    replace_unfinished(c->stylebuf, 0, 0, length);
 }
 
-static void highlight_c(Fl_Text_Buffer *textbuf, char *style, int length)
+void colorize_free(struct Colorizer *c)
 {
-    enum
+    // A background job may still be running. It cleans up after itself.
+    if (c->pendingJob != NULL)
+        c->pendingJob->colorizer = NULL;
+    delete c->stylebuf;
+    free(c->lines);
+}
+
+void colorize_invalidate(struct Colorizer *c)
+{
+    c->upToDate = false;
+    c->generation++;
+}
+
+// Picks the grammar for a file's new name. Highlighting starts over if it is
+// different.
+void colorize_set_filename(struct Colorizer *c, const char *filename)
+{
+    const struct Grammar *grammar = grammar_for_file(filename);
+
+    if (grammar != c->grammar)
     {
-        NORMAL,
-        MULTI_COMMENT,
-        SINGLE_COMMENT,
-        DOUBLE_QUOTE_STRING,
-        SINGLE_QUOTE_STRING,
-        PREPROC_DIRECTIVE,
-    };
-    int state = NORMAL;
-    int pos;
-    int prevChar = 0;
-    int currChar;
-    bool backslashEscape = false;  // whether the current char is escaped by a backslash
-    bool isCleanLine = true;  // whether the current line contains only comments or whitespace
-    int wordStart = -1;
+        c->grammar = grammar;
+        colorize_invalidate(c);
+    }
+}
 
-    for (pos = 0; pos < length; pos++)
+// Returns the position of the line after the one at 'pos', or the end of the
+// text if there is none.
+static int next_line_start(Fl_Text_Buffer *textbuf, int pos)
+{
+    int length = textbuf->length();
+    struct RegexText runs;
+    int gap;
+
+    textbuf_runs(textbuf, &runs);
+    gap = runs.lengths[0];
+    while (pos < length)
+    {
+        int runEnd = (pos < gap) ? gap : length;
+        const char *text = textbuf->address(pos);
+        const char *newline = (const char *)memchr(text, '\n', runEnd - pos);
+
+        if (newline != NULL)
+            return pos + (newline - text) + 1;
+        pos = runEnd;
+    }
+    return length;
+}
+
+// Highlights the line starting at 'pos' in the text buffer and returns the
+// position of the next line.
+static int highlight_buffer_line(const struct Grammar *grammar, Fl_Text_Buffer *textbuf,
+    char *style, int pos, unsigned char *lineState)
+{
+    int length = textbuf->length();
+    struct RegexText runs;
+    int runEnd;
+    const char *text = textbuf->address(pos);
+
+    textbuf_runs(textbuf, &runs);
+    runEnd = (pos < runs.lengths[0]) ? runs.lengths[0] : length;
+
+    // Lines split by the gap are rare, since it only moves on edits. Copy those.
+    if (runEnd < length && memchr(text, '\n', runEnd - pos) == NULL)
+    {
+        int end = MIN(textbuf->line_end(pos) + 1, length);
+        char *line = textbuf->text_range(pos, end);
+
+        pos += grammar_highlight_line(grammar, line, end - pos, style, lineState);
+        free(line);
+        return pos;
+    }
+    return pos + grammar_highlight_line(grammar, text, runEnd - pos, style, lineState);
+}
+
+static void cb_unfinished_style(int pos, void *data);
+
+static void set_highlight_data(struct Colorizer *c, Fl_Text_Editor *editor)
+{
+    c->editor = editor;
+    editor->highlight_data(c->stylebuf, s_styleTable, ARRAY_LENGTH(s_styleTable),
+        STYLE_UNFINISHED, cb_unfinished_style, c);
+}
+
+// Returns the start of the last line in the table, where lexing picks up from.
+static int frontier_line(struct Colorizer *c, int length)
+{
+    move_gap(c, line_count(c), length);
+    return c->gapStart - 1;
+}
+
+// Highlights from the last known line until at least LAZY_LOOKAHEAD_LINES lines
+// past 'pos'.
+static void highlight_lazily(struct Colorizer *c, int pos)
+{
+    Fl_Text_Buffer *textbuf = c->textbuf;
+    int length = textbuf->length();
+    int line;
+    int start;
+    int end;
+    unsigned char state;
+    char *style;
+
+    if (pos < c->lexedEnd)
+        return;
+
+    line = frontier_line(c, length);
+    start = c->lines[line].start;
+    state = c->lines[line].state;
+    end = textbuf->skip_lines(pos, LAZY_LOOKAHEAD_LINES);
+    style = new char[end - start + 1];
+
+    c->lexedEnd = start;
+    while (c->lexedEnd < end)
     {
-        currChar = *textbuf->address(pos);
-        style[pos] = 'A';
-        backslashEscape = backslashEscape ? false : (prevChar == '\\');
-        if (state != NORMAL)
-            wordStart = -1;
+        int next = highlight_buffer_line(c->grammar, textbuf, style + c->lexedEnd - start, c->lexedEnd, &state);
 
-        switch (state)
+        c->lexedEnd = next;
+        if (textbuf->byte_at(next - 1) == '\n')
+            insert_line(c, next, state);
+    }
+    style[end - start] = 0;
+    c->stylebuf->replace(start, end, style);
+    delete[] style;
+}
+
+static void cb_unfinished_style(int pos, void *data)
+{
+    struct Colorizer *c = (struct Colorizer *)data;
+
+    // Don't hold up drawing for text far ahead of what has been lexed. It stays
+    // plain until the background thread gets to it.
+    if (c->pendingJob != NULL && pos - c->lexedEnd > SYNC_LAZY_LIMIT)
+        return;
+    highlight_lazily(c, pos);
+}
+
+static void schedule_background_highlight(struct Colorizer *c);
+
+// One pass of the lexer over part of a background job's text
+struct LexRun
+{
+    unsigned char entryState;
+    unsigned char exitState;
+    int end;  // where the run stopped
+    struct LineState *lines;  // lines found after the start
+    int numLines;
+    int capacity;
+};
+
+// Lexes 'text' from 'start' to 'end', with 'style' receiving the styles from
+// 'start'. Line starts are recorded offset by 'base'. If 'reference' is a run
+// over the same text from another state, this stops as soon as a line starts
+// in the same state as it does there, since the rest would come out the same.
+static void lex_run(const struct Grammar *grammar, const char *text, char *style,
+    int start, int end, int base, struct LexRun *run, const struct LexRun *reference)
+{
+    unsigned char state = run->entryState;
+    int pos = start;
+
+    while (pos < end)
+    {
+        pos += grammar_highlight_line(grammar, text + pos, end - pos, style + pos - start, &state);
+        if (text[pos - 1] != '\n')
+            break;
+        if (run->numLines == run->capacity)
         {
-        case NORMAL:
-            style[pos] = 'A';
-            if (prevChar == '/' && currChar == '*')
-            {
-                state = MULTI_COMMENT;
-                style[pos - 1] = 'B';
-                style[pos] = 'B';
-            }
-            else if (prevChar == '/' && currChar == '/')
-            {
-                state = SINGLE_COMMENT;
-                style[pos - 1] = 'B';
-                style[pos] = 'B';
-            }
-            else if (currChar == '"')
+            run->capacity = MAX(run->capacity * 2, 256);
+            run->lines = (struct LineState *)realloc(run->lines, run->capacity * sizeof(*run->lines));
+        }
+        run->lines[run->numLines].start = base + pos;
+        run->lines[run->numLines].state = state;
+        run->numLines++;
+        if (reference != NULL && reference->lines[run->numLines - 1].state == state)
+        {
+            run->end = pos;
+            run->exitState = reference->exitState;
+            return;
+        }
+    }
+    run->end = end;
+    run->exitState = state;
+}
+
+static void highlight_job_work(void *data)
+{
+    struct HighlightJob *job = (struct HighlightJob *)data;
+    int length = job->end - job->start;
+    struct LexRun run = {job->state};
+
+    lex_run(job->grammar, job->text, job->style, 0, length, job->start, &run, NULL);
+    job->style[length] = 0;
+    job->state = run.exitState;
+    job->lines = run.lines;
+    job->numLines = run.numLines;
+}
+
+// Large files are highlighted in parallel. The text is split into chunks at line
+// boundaries, and each chunk is lexed on its own as if it started in normal
+// code, and again as if it started in the grammar's block state, such as inside
+// a block comment. A quick pass then
+// walks the chunks in order, keeping whichever result matches the state the
+// previous chunk actually ended in, and lexing the chunk again in the rare case
+// that it is neither.
+struct ParallelHighlight
+{
+    struct HighlightJob *job;
+    int numChunks;
+    int *chunkStarts;
+    struct LexRun *normalRuns;
+    struct LexRun *blockRuns;
+    char **blockStyles;
+};
+
+static void highlight_chunk(void *data, int i)
+{
+    struct ParallelHighlight *ph = (struct ParallelHighlight *)data;
+    struct HighlightJob *job = ph->job;
+    int start = ph->chunkStarts[i];
+    int end = ph->chunkStarts[i + 1];
+
+    unsigned char blockState = grammar_block_state(job->grammar);
+
+    ph->normalRuns[i].entryState = (i == 0) ? job->state : GRAMMAR_INITIAL_STATE;
+    lex_run(job->grammar, job->text, job->style + start, start, end, job->start, &ph->normalRuns[i], NULL);
+    if (i > 0 && blockState != GRAMMAR_INITIAL_STATE)
+    {
+        ph->blockStyles[i] = new char[end - start];
+        ph->blockRuns[i].entryState = blockState;
+        lex_run(job->grammar, job->text, ph->blockStyles[i], start, end, job->start,
+            &ph->blockRuns[i], &ph->normalRuns[i]);
+    }
+}
+
+static void highlight_job_work_parallel(void *data)
+{
+    struct HighlightJob *job = (struct HighlightJob *)data;
+    struct ParallelHighlight ph;
+    int length = job->end - job->start;
+    unsigned char state = job->state;
+    int i;
+
+    ph.job = job;
+    ph.numChunks = worker_cpu_count() * 4;
+    ph.chunkStarts = new int[ph.numChunks + 1];
+    ph.normalRuns = new LexRun[ph.numChunks];
+    ph.blockRuns = new LexRun[ph.numChunks];
+    ph.blockStyles = new char *[ph.numChunks];
+    memset(ph.normalRuns, 0, ph.numChunks * sizeof(*ph.normalRuns));
+    memset(ph.blockRuns, 0, ph.numChunks * sizeof(*ph.blockRuns));
+    memset(ph.blockStyles, 0, ph.numChunks * sizeof(*ph.blockStyles));
+
+    ph.chunkStarts[0] = 0;
+    for (i = 1; i < ph.numChunks; i++)
+    {
+        int pos = MAX((int)((long long)length * i / ph.numChunks), ph.chunkStarts[i - 1]);
+        const char *newline = (const char *)memchr(job->text + pos, '\n', length - pos);
+
+        ph.chunkStarts[i] = (newline != NULL) ? newline + 1 - job->text : length;
+    }
+    ph.chunkStarts[ph.numChunks] = length;
+
+    worker_parallel_for(ph.numChunks, highlight_chunk, &ph);
+
+    // Stitch the chunks together.
+    for (i = 0; i < ph.numChunks; i++)
+    {
+        struct LexRun *run = &ph.normalRuns[i];
+        int start = ph.chunkStarts[i];
+
+        if (state != run->entryState)
+        {
+            struct LexRun redo = {state};
+            struct LexRun *fix = &redo;
+            char *fixStyle;
+            int j;
+
+            if (state == ph.blockRuns[i].entryState)
             {
-                state = DOUBLE_QUOTE_STRING;
-                style[pos] = 'C';
+                fix = &ph.blockRuns[i];
+                fixStyle = ph.blockStyles[i];
             }
-            else if (currChar == '\'')
+            else
             {
-                state = SINGLE_QUOTE_STRING;
-                style[pos] = 'C';
+                fixStyle = new char[ph.chunkStarts[i + 1] - start];
+                lex_run(job->grammar, job->text, fixStyle, start, ph.chunkStarts[i + 1], job->start, fix, run);
             }
-            else if (currChar == '#' && isCleanLine)
+            memcpy(job->style + start, fixStyle, fix->end - start);
+            for (j = 0; j < fix->numLines; j++)
+                run->lines[j].state = fix->lines[j].state;
+            state = fix->exitState;
+            if (fix == &redo)
             {
-                state = PREPROC_DIRECTIVE;
-                style[pos] = 'E';
+                delete[] fixStyle;
+                free(redo.lines);
             }
-            else
+        }
+        else
+        {
+            state = run->exitState;
+        }
+
+        job->lines = (struct LineState *)realloc(job->lines, (job->numLines + run->numLines) * sizeof(*job->lines));
+        memcpy(job->lines + job->numLines, run->lines, run->numLines * sizeof(*run->lines));
+        job->numLines += run->numLines;
+    }
+    job->style[length] = 0;
+    job->state = state;
+
+    for (i = 0; i < ph.numChunks; i++)
+    {
+        free(ph.normalRuns[i].lines);
+        free(ph.blockRuns[i].lines);
+        delete[] ph.blockStyles[i];
+    }
+    delete[] ph.chunkStarts;
+    delete[] ph.normalRuns;
+    delete[] ph.blockRuns;
+    delete[] ph.blockStyles;
+}
+
+static void highlight_job_done(void *data)
+{
+    struct HighlightJob *job = (struct HighlightJob *)data;
+    struct Colorizer *c = job->colorizer;
+
+    if (c != NULL)
+    {
+        Fl_Text_Buffer *textbuf = c->textbuf;
+        int start = c->lines[frontier_line(c, textbuf->length())].start;
+        int end = job->end;
+        int i;
+
+        // The text before the first edit since the copy was taken is the same,
+        // so the lines that start there are still right.
+        if (c->editedFrom < job->end)
+        {
+            end = start;
+            for (i = 0; i < job->numLines && job->lines[i].start <= c->editedFrom; i++)
+                end = MAX(end, job->lines[i].start);
+        }
+
+        // The display may have had some of the chunk lexed in the meantime. As
+        // long as highlighting hasn't started over, pick up from there.
+        c->pendingJob = NULL;
+        if (job->generation == c->generation && start >= job->start && start < end)
+        {
+            for (i = 0; i < job->numLines && job->lines[i].start <= end; i++)
             {
-                if (wordStart == -1)  // last character was not a letter
-                {
-                    if (is_word_char(currChar))  // start of word
-                        wordStart = pos;
-                }
-                else
-                {
-                    if (!is_word_char(currChar))  // end of word
-                    {
-                        // find keyword
-                        unsigned int i, j;
-                        int wordLen = pos - wordStart;
-
-                        for (i = 0; i < ARRAY_LENGTH(s_keywords); i++)
-                        {
-                            const char *keyword = s_keywords[i];
-
-                            for (j = 0; j < wordLen && keyword[j] != 0; j++)
-                            {
-                                if (*textbuf->address(wordStart + j) != keyword[j])
-                                    break;
-                            }
-                            if (j == wordLen && keyword[j] == 0)  // found keyword
-                            {
-                                for (j = wordStart; j < pos; j++)
-                                    style[j] = 'D';
-                                break;
-                            }
-                        }
-                        wordStart = -1;
-                    }
-                }
-
-                if (!isspace(currChar))
-                    isCleanLine = false;
-                else if (currChar == '\n')
-                    isCleanLine = true;
+                if (job->lines[i].start > start)
+                    insert_line(c, job->lines[i].start, job->lines[i].state);
             }
+            c->stylebuf->replace(start, end, job->style + start - job->start);
+            c->lexedEnd = end;
+            if (c->editor != NULL && c->editor->buffer() == textbuf)
+                c->editor->redisplay_range(start, end);
+        }
+        schedule_background_highlight(c);
+    }
+
+    free(job->text);
+    delete[] job->style;
+    free(job->lines);
+    delete job;
+}
+
+static void schedule_background_highlight(struct Colorizer *c)
+{
+    Fl_Text_Buffer *textbuf = c->textbuf;
+    int length = textbuf->length();
+    struct HighlightJob *job;
+    WorkerFunc work;
+    int line;
+
+    // Only the file being shown is worth highlighting ahead of the display.
+    if (c->pendingJob != NULL || !c->upToDate || c->lexedEnd >= length
+     || c->editor == NULL || c->editor->buffer() != textbuf)
+        return;
+
+    line = frontier_line(c, length);
+    job = new HighlightJob;
+    job->colorizer = c;
+    job->grammar = c->grammar;
+    job->generation = c->generation;
+    job->start = c->lines[line].start;
+    job->state = c->lines[line].state;
+    job->lines = NULL;
+    job->numLines = 0;
+
+    // Only a window of the text is copied at a time, so the copy doesn't hold
+    // up the display for long, and an edit doesn't waste much.
+    if (length - job->start >= PARALLEL_HIGHLIGHT_SIZE)
+    {
+        job->end = MIN(job->start + PARALLEL_WINDOW_SIZE, length);
+        work = highlight_job_work_parallel;
+    }
+    else
+    {
+        job->end = MIN(job->start + BACKGROUND_CHUNK_SIZE, length);
+        work = highlight_job_work;
+    }
+    if (job->end < length)
+        job->end = MIN(textbuf->line_end(job->end) + 1, length);
+    job->text = textbuf->text_range(job->start, job->end);
+    job->style = new char[job->end - job->start + 1];
+
+    c->pendingJob = job;
+    c->editedFrom = job->end;
+    worker_submit(work, highlight_job_done, job);
+}
+
+// Starts highlighting over. Nothing is lexed until the display asks for it or
+// the background thread gets to it.
+void colorize_update(struct Colorizer *c, Fl_Text_Editor *editor)
+{
+    if (!c->upToDate)
+    {
+        int length = c->textbuf->length();
+        int styleLength = c->stylebuf->length();
+
+        // Everything past what was lexed is still unfinished, unless the text
+        // was edited without the styles following along.
+        if (styleLength == length)
+            replace_unfinished(c->stylebuf, 0, MIN(c->lexedEnd, length), MIN(c->lexedEnd, length));
+        else
+            replace_unfinished(c->stylebuf, 0, styleLength, length);
+        c->gapStart = 0;
+        c->gapEnd = c->linesCapacity;
+        insert_line(c, 0, GRAMMAR_INITIAL_STATE);
+        c->lexedEnd = 0;
+        c->upToDate = true;
+        c->generation++;
+    }
+    set_highlight_data(c, editor);
+    schedule_background_highlight(c);
+}
+
+// Re-highlights the lines affected by an edit of 'nDeleted' characters replaced
+// with 'nInserted' characters at 'pos'. The style buffer and line table must
+// still describe the text as it was before the edit. Lexing stops early once a
+// line past the edit starts in the same state it did before, or once it has
+// gone SYNC_LEX_LIMIT bytes, leaving the rest for the display to ask for.
+void colorize_update_range(struct Colorizer *c, Fl_Text_Editor *editor,
+    int pos, int nInserted, int nDeleted)
+{
+    Fl_Text_Buffer *textbuf = c->textbuf;
+    int length = textbuf->length();
+    int oldLength = length - nInserted + nDeleted;
+    int editEnd = pos + nInserted;
+    int staleEnd;
+    int line;
+    int start;
+    int relexStart;
+    int restyledEnd;
+    unsigned char state;
+    char *style = NULL;
+    int styleCapacity = 0;
+
+    if (!c->upToDate || c->stylebuf->length() != oldLength)
+    {
+        c->upToDate = false;
+        colorize_update(c, editor);
+        return;
+    }
+    c->editedFrom = MIN(c->editedFrom, pos);
+
+    // Line the old styles up with the new text.
+    replace_unfinished(c->stylebuf, pos, pos + nDeleted, nInserted);
+
+    // Nothing to redo if the edit is past what has been lexed so far, though
+    // every line is before it, so none may be stored relative to the end.
+    if (pos >= c->lexedEnd)
+    {
+        move_gap(c, line_count(c), oldLength);
+        goto done;
+    }
+
+    // Drop the lines whose newlines were deleted. Lines after the edit are
+    // stored relative to the end of the text, so they need no adjusting.
+    line = find_line(c, pos, oldLength);
+    move_gap(c, line + 1, oldLength);
+    while (c->gapEnd < c->linesCapacity && oldLength - c->lines[c->gapEnd].start <= pos + nDeleted)
+        c->gapEnd++;
+
+    // Whatever was lexed before the edit and isn't re-lexed now goes stale.
+    if (c->lexedEnd >= pos + nDeleted)
+        staleEnd = c->lexedEnd - nDeleted + nInserted;
+    else
+        staleEnd = editEnd;
+
+    // Only the lines re-lexed and the ones gone stale get restyled.
+    start = c->lines[line].start;
+    state = c->lines[line].state;
+    relexStart = start;
+    for (;;)
+    {
+        int next;
+
+        if (start >= length)
+        {
+            c->lexedEnd = length;
             break;
-        case MULTI_COMMENT:
-            style[pos] = 'B';
-            if (prevChar == '*' && currChar == '/')
-                state = NORMAL;
+        }
+        next = next_line_start(textbuf, start);
+        if (next - relexStart >= styleCapacity)
+        {
+            styleCapacity = MAX(styleCapacity * 2, next - relexStart + 1);
+            style = (char *)realloc(style, styleCapacity);
+        }
+        next = highlight_buffer_line(c->grammar, textbuf, style + start - relexStart, start, &state);
+        start = next;
+        if (textbuf->byte_at(next - 1) != '\n')
+        {
+            c->lexedEnd = length;
             break;
-        case SINGLE_COMMENT:
-            style[pos] = 'B';
-            if (currChar == '\n')
+        }
+        if (next <= editEnd)
+        {
+            insert_line(c, next, state);
+        }
+        else if (c->gapEnd < c->linesCapacity)
+        {
+            struct LineState *old = &c->lines[c->gapEnd];
+            bool converged = (old->state == state);
+            bool wasLast = (c->gapEnd == c->linesCapacity - 1);
+
+            assert(length - old->start == next);
+            old->state = state;
+            move_gap(c, c->gapStart + 1, length);
+            if (converged)
             {
-                state = NORMAL;
-                isCleanLine = true;
+                c->lexedEnd = staleEnd;
+                break;
             }
-            break;
-        case DOUBLE_QUOTE_STRING:
-            style[pos] = 'C';
-            if (currChar == '"' && !backslashEscape)
-                state = NORMAL;
-            break;
-        case SINGLE_QUOTE_STRING:
-            style[pos] = 'C';
-            if (currChar == '\'' && !backslashEscape)
-                state = NORMAL;
-            break;
-        case PREPROC_DIRECTIVE:
-            style[pos] = 'E';
-            if (currChar == '\n')
+            if (wasLast)
             {
-                state = NORMAL;
-                isCleanLine = true;
+                c->lexedEnd = next;
+                break;
             }
+        }
+        else
+        {
+            insert_line(c, next, state);
+            c->lexedEnd = next;
             break;
         }
 
-        prevChar = currChar;
+        if (next - relexStart > SYNC_LEX_LIMIT)
+        {
+            c->gapEnd = c->linesCapacity;
+            c->lexedEnd = next;
+            break;
+        }
     }
-}
 
-void colorize_update(Fl_Text_Editor *editor, Fl_Text_Buffer *textbuf, Fl_Text_Buffer *stylebuf)
-{
-    int length = textbuf->length();
-    char *style = new char[length + 1];
-    int i;
+    // Lexing stopped at 'start'. If that's short of where it had got to
+    // before, the rest goes back to unfinished.
+    restyledEnd = (staleEnd > c->lexedEnd) ? staleEnd : start;
+    if (restyledEnd - relexStart >= styleCapacity)
+        style = (char *)realloc(style, restyledEnd - relexStart + 1);
+    memset(style + start - relexStart, STYLE_UNFINISHED, restyledEnd - start);
+    style[restyledEnd - relexStart] = 0;
+    c->stylebuf->replace(relexStart, restyledEnd, style);
+    free(style);
+    if (c->editor == editor)
+        editor->redisplay_range(relexStart, restyledEnd);
 
-    highlight_c(textbuf, style, length);
-    style[length] = 0;
-    stylebuf->text(style);
-    delete[] style;
-    editor->highlight_data(stylebuf, s_styleTable, ARRAY_LENGTH(s_styleTable),
-        'A', NULL, NULL);
+done:
+    if (c->editor != editor)
+        set_highlight_data(c, editor);
+    schedule_background_highlight(c);
 }
 
-void colorize_clear(Fl_Text_Editor *editor, Fl_Text_Buffer *stylebuf)
+void colorize_clear(struct Colorizer *c, Fl_Text_Editor *editor)
 {
-    editor->highlight_data(stylebuf, s_styleTable, 1, 'A', NULL, NULL);
+    c->editor = NULL;
+    editor->highlight_data(c->stylebuf, s_styleTable, 1, 'A', NULL, NULL);
 }
 
 void colorize_update_font(Fl_Font font, int size)
@@ -1,6 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <FL/Fl.H>
 #include <FL/Fl_Window.H>
+#include <FL/Fl_Box.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Check_Button.H>
 #include <FL/Fl_Input.H>
 #include <FL/Fl_Text_Buffer.H>
 #include <FL/fl_ask.H>
@@ -9,70 +17,1367 @@
 
 static Fl_Window *s_findDialog;
 static Fl_Input *s_findInput;
+static Fl_Input *s_replaceInput;
+static Fl_Check_Button *s_regexButton;
 static Fl_Text_Buffer *s_textBuf;
+static struct History *s_history;  // of the text being searched
+static struct ViewedFile *s_viewed;  // searched instead of the text buffer if set
 static int s_currPos;
 
+// The last regular expression compiled, kept along with the DFA it has built
+static struct Regex *s_regex;
+static char *s_regexPattern;
+static bool s_regexMatchCase;
+
+// Searching as the text is typed starts from here
+static int s_typeOrigin;
+static char *s_lastQuery;  // the text last searched for as it was typed
+static int s_lastFound;  // where it was found, or -1
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// A string set up to be searched for quickly
+struct SearchPattern
+{
+    unsigned char *text;  // in lowercase unless matching case
+    int length;
+    bool matchCase;
+    int skip[256];  // how far to move on, by the last byte compared
+    int backSkip[256];  // the same for searching backwards, by the first byte
+};
+
+// Text must be at least this long for Find All to split it across processors
+#define PARALLEL_SCAN_SIZE (8 * 1024 * 1024)
+
+// Matches in order, none overlapping
+struct MatchList
+{
+    struct MatchRange *ranges;
+    int count;
+    int capacity;
+};
+
+// Something to search for: a string, or a regular expression
+struct Matcher
+{
+    struct SearchPattern literal;
+    struct Regex *re;  // NULL for a string
+    int maxLength;  // the longest a match can be, or -1 for no limit
+    bool crossesLines;  // a match may have a newline in it
+};
+
+// Find All searches a copy of the text on the worker thread. The results are
+// thrown away if the text or what's being looked for has changed meanwhile.
+struct FindAllJob
+{
+    char *text;
+    int length;
+    char *query;
+    bool regex;
+    int matchCase;
+    unsigned int generation;
+    struct MatchList matches;
+};
+
+// An open file as it was when searching them all started
+struct TabSnapshot
+{
+    unsigned int fileId;
+    char *title;
+    char *text;
+    int length;
+};
+
+// Searching every open file at once, each on whichever processor is free
+struct TabSearch
+{
+    struct TabSnapshot *tabs;
+    int count;
+    char *query;
+    bool regex;
+    int matchCase;
+    int canceled;  // a newer search has started
+    int filesMatched;
+    int totalMatches;
+    unsigned int resultsGeneration;  // from results_clear()
+};
+
+// One file's matches, sent to the UI thread as soon as it's been searched
+struct TabResults
+{
+    struct TabSearch *search;
+    int index;
+    struct MatchList matches;
+    int *lineNumbers;  // of the first RESULTS_MAX_PER_FILE matches
+};
+
+// Text being built up a piece at a time
+struct OutputText
+{
+    char *text;
+    size_t length;
+    size_t capacity;
+};
+
+// Big texts are split into chunks searched in parallel, each as if no match
+// ran into it from the one before.
+struct ParallelScan
+{
+    struct FindAllJob *job;
+    int numChunks;
+    int *chunkStarts;
+    int *chunkEnds;  // where searching each chunk stopped
+    struct MatchList *chunkMatches;
+};
+
+// Every match of the last Find All, kept up to date as the text is edited
+static struct MatchList s_matches;
+static bool s_matchesValid;  // false while they're being searched for
+static Fl_Text_Buffer *s_matchBuf;  // the text they're in, or NULL
+static char *s_matchQuery;
+static bool s_matchRegex;
+static int s_matchCase;
+static struct Matcher s_matcher;  // for searching again after an edit
+static struct FindAllJob *s_findAllJob;
+static unsigned int s_matchGeneration;
+static void (*s_matchesCallback)(void);
+static Fl_Box *s_countBox;
+static char s_countText[32];
+
+// The open files, as of when the dialog was shown
+static struct OpenFile *s_openFiles;
+static int s_openCount;
+static struct TabSearch *s_tabSearch;  // the newest search of them all
+
+static unsigned char s_foldTable[256];  // ASCII lowercase, filled in by find_dialog_init()
+
+static inline unsigned char fold(const struct SearchPattern *p, unsigned char c)
+{
+    return p->matchCase ? c : s_foldTable[c];
+}
+
+// Returns whether ignoring case in 'text' needs more than ASCII case folding,
+// which is all that's done here.
+static bool needs_unicode_folding(const char *text, bool matchCase)
+{
+    if (matchCase)
+        return false;
+    for (; *text != 0; text++)
+    {
+        if ((unsigned char)*text >= 0x80)
+            return true;
+    }
+    return false;
+}
+
+static void pattern_init(struct SearchPattern *p, const char *text, bool matchCase)
+{
+    int i;
+
+    p->length = strlen(text);
+    p->matchCase = matchCase;
+    p->text = (unsigned char *)malloc(p->length);
+    for (i = 0; i < p->length; i++)
+        p->text[i] = fold(p, text[i]);
+
+    // Horspool's tables, keyed by the folded byte
+    for (i = 0; i < 256; i++)
+        p->skip[i] = p->backSkip[i] = p->length;
+    for (i = 0; i < p->length - 1; i++)
+        p->skip[p->text[i]] = p->length - 1 - i;
+    for (i = p->length - 1; i > 0; i--)
+        p->backSkip[p->text[i]] = i;
+}
+
+static bool pattern_matches(const struct SearchPattern *p, const unsigned char *s)
+{
+    int i;
+
+    if (p->matchCase)
+        return memcmp(s, p->text, p->length) == 0;
+    for (i = 0; i < p->length; i++)
+    {
+        if (s_foldTable[s[i]] != p->text[i])
+            return false;
+    }
+    return true;
+}
+
+static int horspool_forward(const struct SearchPattern *p, const unsigned char *s, int start, int length)
+{
+    int last = p->text[p->length - 1];
+    int i = start;
+
+    while (i + p->length <= length)
+    {
+        unsigned char c = fold(p, s[i + p->length - 1]);
+
+        if (c == last && pattern_matches(p, s + i))
+            return i;
+        i += p->skip[c];
+    }
+    return -1;
+}
+
+static int horspool_backward(const struct SearchPattern *p, const unsigned char *s, int length)
+{
+    int first = p->text[0];
+    int i = length - p->length;
+
+    while (i >= 0)
+    {
+        unsigned char c = fold(p, s[i]);
+
+        if (c == first && pattern_matches(p, s + i))
+            return i;
+        i -= p->backSkip[c];
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+// Returns a mask of which of the 16 bytes at 's' are 'c', in either case if
+// case is being ignored.
+static inline int byte_mask(const struct SearchPattern *p, const unsigned char *s, unsigned char c)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)s);
+    __m128i eq = _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+
+    if (!p->matchCase && c >= 'a' && c <= 'z')
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8(c - 'a' + 'A')));
+    return _mm_movemask_epi8(eq);
+}
+
+// Only places where both the first and last bytes match, 16 at a time, are
+// compared in full.
+static int find_forward(const struct SearchPattern *p, const unsigned char *s, int length)
+{
+    unsigned char first = p->text[0];
+    unsigned char last = p->text[p->length - 1];
+    int i;
+
+    for (i = 0; i + p->length - 1 + 16 <= length; i += 16)
+    {
+        int mask = byte_mask(p, s + i, first) & byte_mask(p, s + i + p->length - 1, last);
+
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+
+            if (pattern_matches(p, s + i + bit))
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return horspool_forward(p, s, i, length);
+}
+
+static int find_backward(const struct SearchPattern *p, const unsigned char *s, int length)
+{
+    unsigned char first = p->text[0];
+    unsigned char last = p->text[p->length - 1];
+    int i;
+
+    for (i = length - p->length - 15; i >= 0; i -= 16)
+    {
+        int mask = byte_mask(p, s + i, first) & byte_mask(p, s + i + p->length - 1, last);
+
+        while (mask != 0)
+        {
+            int bit = 31 - __builtin_clz(mask);
+
+            if (pattern_matches(p, s + i + bit))
+                return i + bit;
+            mask &= ~(1 << bit);
+        }
+    }
+    // Whatever's left is before the blocks that were checked.
+    return horspool_backward(p, s, MIN(length, i + 16 + p->length - 1));
+}
+#else
+static int find_forward(const struct SearchPattern *p, const unsigned char *s, int length)
+{
+    return horspool_forward(p, s, 0, length);
+}
+
+static int find_backward(const struct SearchPattern *p, const unsigned char *s, int length)
+{
+    return horspool_backward(p, s, length);
+}
+#endif
+
+// Searches the text from 'start' to 'end' for the first or last match that
+// lies wholly inside it. Returns where the match is, or -1.
+static int find_in_range(const struct SearchPattern *p, const struct RegexText *text,
+    int start, int end, bool forward)
+{
+    int gap = text->lengths[0];
+    int found;
+
+    if (end - start < p->length)
+        return -1;
+    if (start >= gap || end <= gap)
+    {
+        const unsigned char *s = (const unsigned char *)((start >= gap) ? text->runs[1] + start - gap
+                                                                       : text->runs[0] + start);
+
+        found = forward ? find_forward(p, s, end - start) : find_backward(p, s, end - start);
+        return (found >= 0) ? start + found : -1;
+    }
+    else
+    {
+        // Matches straddling the gap are found in a copy of the bytes around it.
+        int nearStart = MAX(start, gap - p->length + 1);
+        int nearEnd = MIN(end, gap + p->length - 1);
+        char *near = (char *)malloc(nearEnd - nearStart);
+        int spans[3][2] = {{start, gap}, {nearStart, nearEnd}, {gap, end}};
+        int i;
+
+        memcpy(near, text->runs[0] + nearStart, gap - nearStart);
+        memcpy(near + gap - nearStart, text->runs[1], nearEnd - gap);
+        for (i = 0; i < 3; i++)
+        {
+            int span = forward ? i : 2 - i;
+
+            if (span == 1)
+            {
+                found = forward ? find_forward(p, (const unsigned char *)near, nearEnd - nearStart)
+                                : find_backward(p, (const unsigned char *)near, nearEnd - nearStart);
+                found = (found >= 0) ? nearStart + found : -1;
+            }
+            else
+            {
+                found = find_in_range(p, text, spans[span][0], spans[span][1], forward);
+            }
+            if (found >= 0)
+                break;
+        }
+        free(near);
+        return found;
+    }
+}
+
+// Looks for the first match at or after 'pos', or the last one at or before
+// it, straight in the buffer's memory.
+static bool search_buffer(Fl_Text_Buffer *textBuf, int pos, const char *text, bool forward,
+    bool matchCase, int *foundPos)
+{
+    struct SearchPattern p;
+    struct RegexText bufText;
+    int length = textBuf->length();
+    int found;
+
+    if (needs_unicode_folding(text, matchCase))
+    {
+        if (forward)
+            return textBuf->search_forward(pos, text, foundPos, matchCase);
+        else
+            return textBuf->search_backward(pos, text, foundPos, matchCase);
+    }
+
+    pattern_init(&p, text, matchCase);
+    textbuf_runs(textBuf, &bufText);
+    if (forward)
+        found = find_in_range(&p, &bufText, MAX(pos, 0), length, true);
+    else
+        found = find_in_range(&p, &bufText, 0, MIN(pos + p.length, length), false);
+    free(p.text);
+    if (found < 0)
+        return false;
+    *foundPos = found;
+    return true;
+}
+
+static struct Regex *get_regex(const char *pattern, bool matchCase, const char **error)
+{
+    if (s_regex == NULL || strcmp(pattern, s_regexPattern) != 0 || matchCase != s_regexMatchCase)
+    {
+        regex_free(s_regex);
+        free(s_regexPattern);
+        s_regex = regex_compile(pattern, matchCase, error);
+        s_regexPattern = strdup(pattern);
+        s_regexMatchCase = matchCase;
+    }
+    return s_regex;
+}
+
+static bool search_regex(Fl_Text_Buffer *textBuf, int pos, struct Regex *re, bool forward,
+    int *start, int *end)
+{
+    struct RegexText text;
+
+    if (pos > textBuf->length())
+        return false;
+    textbuf_runs(textBuf, &text);
+    if (forward)
+        return regex_search(re, &text, MAX(pos, 0), textBuf->length(), start, end);
+    else
+        return regex_search_backward(re, &text, pos, start, end);
+}
+
+static void cb_tab_results(void *data);
+
+// Sets up a search for 'query'. Returns false if it's a regular expression
+// that isn't valid, leaving why in '*error' if it isn't NULL.
+static bool matcher_init(struct Matcher *m, const char *query, bool regex, int matchCase, const char **error)
+{
+    m->re = NULL;
+    m->literal.text = NULL;
+    if (regex)
+    {
+        const char *message;
+
+        m->re = regex_compile(query, matchCase, &message);
+        if (m->re == NULL)
+        {
+            if (error != NULL)
+                *error = message;
+            return false;
+        }
+        m->maxLength = regex_max_length(m->re);
+        m->crossesLines = regex_matches_newline(m->re);
+    }
+    else
+    {
+        // Beyond ASCII, case has to match here.
+        pattern_init(&m->literal, query, matchCase);
+        m->maxLength = m->literal.length;
+        m->crossesLines = (strchr(query, '\n') != NULL);
+    }
+    return true;
+}
+
+static void matcher_free(struct Matcher *m)
+{
+    regex_free(m->re);
+    free(m->literal.text);
+    m->re = NULL;
+    m->literal.text = NULL;
+}
+
+// Finds the first match starting from 'pos' to 'lastStart'.
+static bool matcher_find(struct Matcher *m, const struct RegexText *text, int pos, int lastStart,
+    int *start, int *end)
+{
+    int length = text->lengths[0] + text->lengths[1];
+    int found;
+
+    if (m->re != NULL)
+        return regex_search(m->re, text, pos, lastStart, start, end);
+    found = find_in_range(&m->literal, text, pos, MIN(length, lastStart + m->literal.length), true);
+    if (found < 0)
+        return false;
+    *start = found;
+    *end = found + m->literal.length;
+    return true;
+}
+
+static void list_append(struct MatchList *l, const struct MatchRange *ranges, int count)
+{
+    if (count == 0)
+        return;
+    if (l->count + count > l->capacity)
+    {
+        l->capacity = MAX(l->capacity * 2, l->count + count);
+        l->capacity = MAX(l->capacity, 64);
+        l->ranges = (struct MatchRange *)realloc(l->ranges, l->capacity * sizeof(*l->ranges));
+    }
+    memcpy(l->ranges + l->count, ranges, count * sizeof(*ranges));
+    l->count += count;
+}
+
+// Returns the first match from 'first' on that starts at or after 'pos'.
+static int first_starting_at(const struct MatchList *l, int first, int pos)
+{
+    int lo = first;
+    int hi = l->count;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (l->ranges[mid].start < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Searches on from 'p', adding matches to 'out', until it gets somewhere at or
+// past 'syncPos' that isn't inside one of the matches in 'old' from 'first'
+// on. Searching on from there would find those same matches again, as long as
+// the text from 'syncPos' on is what they were found in. Returns the index of
+// the first of them to keep, and leaves 'p' where it stopped.
+static int search_until_sync(struct Matcher *m, const struct RegexText *text, int *p, int syncPos,
+    const struct MatchList *old, int first, struct MatchList *out)
+{
+    while (1)
+    {
+        struct MatchRange r;
+        int lastStart;
+
+        if (*p >= syncPos)
+        {
+            int i = (old != NULL) ? first_starting_at(old, first, *p) : first;
+
+            if (i == first || old->ranges[i - 1].end <= *p)
+                return i;
+            lastStart = old->ranges[i - 1].end - 1;
+        }
+        else
+        {
+            lastStart = syncPos - 1;
+        }
+
+        if (matcher_find(m, text, *p, lastStart, &r.start, &r.end))
+        {
+            list_append(out, &r, 1);
+            *p = (r.end > r.start) ? r.end : r.start + 1;
+        }
+        else
+        {
+            *p = lastStart + 1;
+        }
+    }
+}
+
+static void find_all_work(void *data)
+{
+    struct FindAllJob *job = (struct FindAllJob *)data;
+    struct RegexText text = {{job->text, job->text}, {job->length, 0}};
+    struct Matcher m;
+    int p = 0;
+
+    matcher_init(&m, job->query, job->regex, job->matchCase, NULL);
+    search_until_sync(&m, &text, &p, job->length + 1, NULL, 0, &job->matches);
+    matcher_free(&m);
+}
+
+static void scan_chunk(void *data, int i)
+{
+    struct ParallelScan *ps = (struct ParallelScan *)data;
+    struct FindAllJob *job = ps->job;
+    struct RegexText text = {{job->text, job->text}, {job->length, 0}};
+    struct Matcher m;
+    int p = ps->chunkStarts[i];
+
+    matcher_init(&m, job->query, job->regex, job->matchCase, NULL);
+    search_until_sync(&m, &text, &p, ps->chunkStarts[i + 1], NULL, 0, &ps->chunkMatches[i]);
+    ps->chunkEnds[i] = p;
+    matcher_free(&m);
+}
+
+static void find_all_work_parallel(void *data)
+{
+    struct FindAllJob *job = (struct FindAllJob *)data;
+    struct RegexText text = {{job->text, job->text}, {job->length, 0}};
+    struct ParallelScan ps;
+    struct Matcher m;
+    int p = 0;
+    int i;
+
+    ps.job = job;
+    ps.numChunks = worker_cpu_count() * 4;
+    ps.chunkStarts = new int[ps.numChunks + 1];
+    ps.chunkEnds = new int[ps.numChunks];
+    ps.chunkMatches = new MatchList[ps.numChunks];
+    memset(ps.chunkMatches, 0, ps.numChunks * sizeof(*ps.chunkMatches));
+    for (i = 0; i < ps.numChunks; i++)
+        ps.chunkStarts[i] = (int)((long long)job->length * i / ps.numChunks);
+    ps.chunkStarts[ps.numChunks] = job->length + 1;
+
+    worker_parallel_for(ps.numChunks, scan_chunk, &ps);
+
+    // Stitch the chunks together. Where a match ran on into a chunk, search
+    // on from the end of it until falling in step with the chunk's results.
+    matcher_init(&m, job->query, job->regex, job->matchCase, NULL);
+    for (i = 0; i < ps.numChunks; i++)
+    {
+        struct MatchList *cm = &ps.chunkMatches[i];
+        int keep = 0;
+
+        if (p > ps.chunkStarts[i])
+        {
+            int q = p;
+
+            keep = search_until_sync(&m, &text, &q, p, cm, 0, &job->matches);
+            p = MAX(q, ps.chunkEnds[i]);
+        }
+        else
+        {
+            p = ps.chunkEnds[i];
+        }
+        list_append(&job->matches, cm->ranges + keep, cm->count - keep);
+        free(cm->ranges);
+    }
+    matcher_free(&m);
+
+    delete[] ps.chunkStarts;
+    delete[] ps.chunkEnds;
+    delete[] ps.chunkMatches;
+}
+
+static void update_count(void)
+{
+    if (s_matchBuf == NULL)
+        s_countText[0] = 0;
+    else if (!s_matchesValid)
+        strcpy(s_countText, "Counting...");
+    else if (s_matches.count == 1)
+        strcpy(s_countText, "1 match");
+    else
+        sprintf(s_countText, "%i matches", s_matches.count);
+    s_countBox->label(s_countText);
+    s_countBox->redraw();
+}
+
+static void matches_changed(void)
+{
+    update_count();
+    if (s_matchesCallback != NULL)
+        s_matchesCallback();
+}
+
+static void schedule_find_all(void);
+
+static void find_all_done(void *data)
+{
+    struct FindAllJob *job = (struct FindAllJob *)data;
+
+    s_findAllJob = NULL;
+    if (job->generation == s_matchGeneration)
+    {
+        free(s_matches.ranges);
+        s_matches = job->matches;
+        s_matchesValid = true;
+        matches_changed();
+    }
+    else
+    {
+        free(job->matches.ranges);
+        schedule_find_all();
+    }
+    free(job->text);
+    free(job->query);
+    delete job;
+}
+
+// Searches the whole text in the background, unless a search is already
+// under way, in which case this is started again when it's done.
+static void schedule_find_all(void)
+{
+    struct FindAllJob *job;
+
+    if (s_findAllJob != NULL || s_matchBuf == NULL || s_matchesValid)
+        return;
+
+    job = new FindAllJob;
+    job->length = s_matchBuf->length();
+    job->text = s_matchBuf->text();
+    job->query = strdup(s_matchQuery);
+    job->regex = s_matchRegex;
+    job->matchCase = s_matchCase;
+    job->generation = s_matchGeneration;
+    memset(&job->matches, 0, sizeof(job->matches));
+
+    s_findAllJob = job;
+    worker_submit((job->length >= PARALLEL_SCAN_SIZE) ? find_all_work_parallel : find_all_work,
+        find_all_done, job);
+}
+
+static void clear_matches(void)
+{
+    free(s_matches.ranges);
+    memset(&s_matches, 0, sizeof(s_matches));
+    s_matchesValid = false;
+    s_matchBuf = NULL;
+    free(s_matchQuery);
+    s_matchQuery = NULL;
+    matcher_free(&s_matcher);
+    s_matchGeneration++;
+    matches_changed();
+}
+
+// Searches again just around an edit, and moves the matches after it along.
+static void update_matches(int pos, int nInserted, int nDeleted)
+{
+    struct MatchList *l = &s_matches;
+    struct MatchList found = {NULL, 0, 0};
+    struct RegexText text;
+    int delta = nInserted - nDeleted;
+    int syncPos = pos + nInserted + 1;  // ^ looks back a byte
+    int first;  // the first match that may have changed
+    int after;  // the first match that's wholly after the edit
+    int keep;
+    int p;
+    int i;
+
+    // Matches that ended far enough before the edit, or on an earlier line if
+    // they can't cross lines, were found without looking at it. Searching
+    // picks up again from the end of the last of them.
+    if (s_matcher.maxLength >= 0)
+        first = first_starting_at(l, 0, pos - s_matcher.maxLength - 1);
+    else
+        first = first_starting_at(l, 0, s_matchBuf->line_start(pos));
+    p = 0;
+    if (first > 0)
+    {
+        struct MatchRange *r = &l->ranges[first - 1];
+
+        p = (r->end > r->start) ? r->end : r->start + 1;
+    }
+
+    after = first_starting_at(l, first, pos + nDeleted);
+    if (after > first && l->ranges[after - 1].end > pos + nDeleted)
+        syncPos = MAX(syncPos, l->ranges[after - 1].end + delta);
+    for (i = after; i < l->count; i++)
+    {
+        l->ranges[i].start += delta;
+        l->ranges[i].end += delta;
+    }
+
+    textbuf_runs(s_matchBuf, &text);
+    keep = search_until_sync(&s_matcher, &text, &p, syncPos, l, after, &found);
+
+    // Put what was found in place of the matches from 'first' to 'keep'.
+    if (found.count != keep - first)
+    {
+        int newCount = l->count - (keep - first) + found.count;
+
+        if (newCount > l->capacity)
+        {
+            l->capacity = MAX(l->capacity * 2, newCount);
+            l->ranges = (struct MatchRange *)realloc(l->ranges, l->capacity * sizeof(*l->ranges));
+        }
+        memmove(l->ranges + first + found.count, l->ranges + keep, (l->count - keep) * sizeof(*l->ranges));
+        l->count = newCount;
+    }
+    if (found.count > 0)
+        memcpy(l->ranges + first, found.ranges, found.count * sizeof(*found.ranges));
+    free(found.ranges);
+}
+
+// Uses the Find All results to go to the next or previous match, if they're
+// for the same search.
+static bool find_in_matches(const char *text, int pos, bool forward, int *start, int *end)
+{
+    int i;
+
+    if (!s_matchesValid || s_matchBuf != s_textBuf || s_matchRegex != (bool)s_regexButton->value()
+     || strcmp(text, s_matchQuery) != 0)
+        return false;
+    // Find All only folds ASCII case, so go the long way round to match the
+    // other letters the way searching always has.
+    if (!s_matchRegex && needs_unicode_folding(text, s_matchCase))
+        return false;
+    i = first_starting_at(&s_matches, 0, forward ? pos : pos + 1);
+    if (!forward)
+        i--;
+    if (i >= 0 && i < s_matches.count)
+    {
+        *start = s_matches.ranges[i].start;
+        *end = s_matches.ranges[i].end;
+    }
+    else
+    {
+        *start = -1;
+    }
+    return true;
+}
+
+// Looks for what's in the find box from 'pos', as a regular expression if
+// that's checked. Returns false if it isn't found, setting 'error' if the
+// regular expression isn't valid.
+static bool find_match(const char *text, int pos, bool forward, int *start, int *end, const char **error)
+{
+    int matchCase = 0;
+
+    *error = NULL;
+    if (find_in_matches(text, pos, forward, start, end))
+        return *start >= 0;
+    if (s_regexButton->value())
+    {
+        struct Regex *re = get_regex(text, matchCase, error);
+
+        return re != NULL && search_regex(s_textBuf, pos, re, forward, start, end);
+    }
+    if (!search_buffer(s_textBuf, pos, text, forward, matchCase, start))
+        return false;
+    *end = *start + strlen(text);
+    return true;
+}
+
+static void set_last_query(const char *text, int found)
+{
+    free(s_lastQuery);
+    s_lastQuery = (text != NULL) ? strdup(text) : NULL;
+    s_lastFound = found;
+}
+
 static void cb_on_find(Fl_Widget *, void *data)
 {
     const char *text = s_findInput->value();
     int length = strlen(text);
     int foundPos;
+    int foundEnd;
     int matchCase = 0;
 
     if (length != 0)
     {
         bool forward = (bool)data;
         bool found;
+        const char *error = NULL;
 
-        if ((bool)forward)
-            found = s_textBuf->search_forward(s_currPos, text, &foundPos, matchCase);
-        else
-            found = s_textBuf->search_backward(s_currPos, text, &foundPos, matchCase);
-
-        if (found)
+        if (s_viewed != NULL)
         {
-            s_textBuf->highlight(foundPos, foundPos + length);
-            s_currPos = foundPos + (forward ? length : -1);
+            if (s_regexButton->value())
+            {
+                fl_alert("Regular expressions can't be used in files opened read-only.");
+                return;
+            }
+            // The viewer highlights and scrolls to the match itself.
+            found = viewer_find(s_viewed, text, forward, matchCase);
         }
         else
+        {
+            found = find_match(text, s_currPos, forward, &foundPos, &foundEnd, &error);
+
+            if (found)
+            {
+                s_textBuf->highlight(foundPos, foundEnd);
+                if (forward)
+                    s_currPos = (foundEnd > foundPos) ? foundEnd : foundPos + 1;  // don't stick on empty matches
+                else
+                    s_currPos = foundPos - 1;
+                // Typing more carries on from this match.
+                s_typeOrigin = foundPos;
+                set_last_query(text, foundPos);
+            }
+        }
+
+        if (error != NULL)
+            fl_alert("The regular expression isn't valid: %s.", error);
+        else if (!found)
             fl_alert("'%s' was not found.", text);
     }
 }
 
+// Searches as the text is typed, highlighting the first match from where
+// searching started.
+static void cb_on_type(Fl_Widget *, void *)
+{
+    const char *text = s_findInput->value();
+    const char *error;
+    int from = s_typeOrigin;
+    int start;
+    int end;
+    bool found;
+
+    if (s_viewed != NULL)
+        return;
+    if (text[0] == 0)
+    {
+        s_textBuf->unhighlight();
+        s_currPos = s_typeOrigin;
+        set_last_query(NULL, -1);
+        return;
+    }
+
+    // A string can only be found where the start of it was, or later. So if
+    // this just adds to the last one, carry on from where that was found, or
+    // give up now if it wasn't.
+    if (!s_regexButton->value() && s_lastQuery != NULL
+     && strncmp(text, s_lastQuery, strlen(s_lastQuery)) == 0)
+    {
+        from = s_lastFound;
+    }
+
+    found = (from >= 0) && find_match(text, from, true, &start, &end, &error);
+    if (found)
+    {
+        s_textBuf->highlight(start, end);
+        s_currPos = (end > start) ? end : start + 1;
+    }
+    else
+    {
+        s_textBuf->unhighlight();
+        s_currPos = s_typeOrigin;
+    }
+    set_last_query(text, found ? start : -1);
+}
+
+static void cb_on_regex(Fl_Widget *, void *)
+{
+    // The last result means something else now.
+    set_last_query(NULL, -1);
+    cb_on_type(NULL, NULL);
+}
+
+// Finds every match in the background and highlights them all.
+static void cb_on_find_all(Fl_Widget *, void *)
+{
+    const char *text = s_findInput->value();
+    const char *error;
+    bool regex = s_regexButton->value();
+    int matchCase = 0;
+
+    if (text[0] == 0)
+        return;
+    if (s_viewed != NULL)
+    {
+        fl_alert("Find All can't be used in files opened read-only.");
+        return;
+    }
+    if (regex && get_regex(text, matchCase, &error) == NULL)
+    {
+        fl_alert("The regular expression isn't valid: %s.", error);
+        return;
+    }
+
+    clear_matches();
+    matcher_init(&s_matcher, text, regex, matchCase, NULL);
+    s_matchBuf = s_textBuf;
+    s_matchQuery = strdup(text);
+    s_matchRegex = regex;
+    s_matchCase = matchCase;
+    schedule_find_all();
+    matches_changed();
+}
+
+static void output_append(struct OutputText *out, const char *s, size_t length)
+{
+    if (out->length + length > out->capacity)
+    {
+        out->capacity = MAX(out->capacity * 2, out->length + length);
+        out->text = (char *)realloc(out->text, out->capacity);
+    }
+    memcpy(out->text + out->length, s, length);
+    out->length += length;
+}
+
+// Appends the text from 'start' to 'end', from either side of the gap.
+static void output_append_range(struct OutputText *out, const struct RegexText *text, int start, int end)
+{
+    int gap = text->lengths[0];
+
+    if (start < gap)
+        output_append(out, text->runs[0] + start, MIN(end, gap) - start);
+    if (end > gap)
+        output_append(out, text->runs[1] + MAX(start, gap) - gap, end - MAX(start, gap));
+}
+
+// Replaces every match. The new text from the first match to the end of the
+// last is built in one pass and goes in as a single edit, so the undo history,
+// highlighting and everything else watching the buffer only see one change.
+// Returns how many were replaced.
+static int replace_all(Fl_Text_Buffer *textBuf, struct Matcher *m, const char *replacement)
+{
+    struct OutputText out = {NULL, 0, 0};
+    struct RegexText text;
+    int replacementLength = strlen(replacement);
+    int length = textBuf->length();
+    int first = -1;  // where the first match starts
+    int last = 0;  // where the last one ends
+    int count = 0;
+    int p = 0;
+    int start;
+    int end;
+
+    textbuf_runs(textBuf, &text);
+    while (p <= length && matcher_find(m, &text, p, length, &start, &end))
+    {
+        if (first < 0)
+            first = start;
+        else
+            output_append_range(&out, &text, last, start);
+        output_append(&out, replacement, replacementLength);
+        last = end;
+        count++;
+        p = (end > start) ? end : start + 1;
+    }
+    if (count == 0)
+        return 0;
+    output_append(&out, "", 1);
+
+    // FLTK's own undo isn't used, so don't let it keep a copy of all this.
+    history_begin_group(s_history);
+    textBuf->canUndo(0);
+    textBuf->replace(first, last, out.text);
+    textBuf->canUndo(1);
+    history_end_group(s_history);
+    free(out.text);
+    return count;
+}
+
+static void cb_on_replace_all(Fl_Widget *, void *)
+{
+    const char *text = s_findInput->value();
+    const char *error;
+    bool regex = s_regexButton->value();
+    int matchCase = 0;
+    struct Matcher m;
+    int count;
+
+    if (text[0] == 0)
+        return;
+    if (s_viewed != NULL)
+    {
+        fl_alert("Files opened read-only can't be changed.");
+        return;
+    }
+    if (regex && get_regex(text, matchCase, &error) == NULL)
+    {
+        fl_alert("The regular expression isn't valid: %s.", error);
+        return;
+    }
+
+    matcher_init(&m, text, regex, matchCase, NULL);
+    count = replace_all(s_textBuf, &m, s_replaceInput->value());
+    matcher_free(&m);
+    if (count == 0)
+    {
+        fl_alert("'%s' was not found.", text);
+        return;
+    }
+    s_textBuf->unhighlight();
+    sprintf(s_countText, "%i replaced", count);
+    s_countBox->label(s_countText);
+    s_countBox->redraw();
+}
+
+static int count_newlines(const char *s, int length)
+{
+    const char *end = s + length;
+    int count = 0;
+
+    while ((s = (const char *)memchr(s, '\n', end - s)) != NULL)
+    {
+        count++;
+        s++;
+    }
+    return count;
+}
+
+static void search_tab(void *data, int i)
+{
+    struct TabSearch *search = (struct TabSearch *)data;
+    struct TabSnapshot *tab = &search->tabs[i];
+    struct RegexText text = {{tab->text, tab->text}, {tab->length, 0}};
+    struct TabResults *msg;
+    struct Matcher m;
+    int line = 1;
+    int counted = 0;  // newlines before here have been counted
+    int p = 0;
+    int j;
+
+    if (__sync_fetch_and_add(&search->canceled, 0))
+        return;
+
+    msg = new TabResults;
+    msg->search = search;
+    msg->index = i;
+    memset(&msg->matches, 0, sizeof(msg->matches));
+    matcher_init(&m, search->query, search->regex, search->matchCase, NULL);
+    search_until_sync(&m, &text, &p, tab->length + 1, NULL, 0, &msg->matches);
+    matcher_free(&m);
+    if (msg->matches.count == 0)
+    {
+        delete msg;
+        return;
+    }
+
+    msg->lineNumbers = (int *)malloc(MIN(msg->matches.count, RESULTS_MAX_PER_FILE) * sizeof(int));
+    for (j = 0; j < msg->matches.count && j < RESULTS_MAX_PER_FILE; j++)
+    {
+        int start = msg->matches.ranges[j].start;
+
+        line += count_newlines(tab->text + counted, start - counted);
+        counted = start;
+        msg->lineNumbers[j] = line;
+    }
+
+    worker_awake(cb_tab_results, msg);
+}
+
+static void update_tab_status(struct TabSearch *search, bool finished)
+{
+    char status[64];
+
+    if (search->totalMatches == 0)
+    {
+        results_status(search->resultsGeneration, finished ? "Not found" : "Searching...");
+        return;
+    }
+    snprintf(status, sizeof(status), "%s%i matches in %i files", finished ? "" : "Searching... ",
+        search->totalMatches, search->filesMatched);
+    results_status(search->resultsGeneration, status);
+}
+
+// Lists the matches in a file that has just been searched.
+static void cb_tab_results(void *data)
+{
+    struct TabResults *msg = (struct TabResults *)data;
+    struct TabSearch *search = msg->search;
+    struct TabSnapshot *tab = &search->tabs[msg->index];
+    char label[RESULTS_LABEL_SIZE];
+    int j;
+
+    if (search == s_tabSearch)
+    {
+        for (j = 0; j < msg->matches.count && j < RESULTS_MAX_PER_FILE; j++)
+        {
+            struct MatchRange *r = &msg->matches.ranges[j];
+
+            results_format(label, sizeof(label), tab->title, tab->text, tab->length, msg->lineNumbers[j], r->start);
+            results_add(search->resultsGeneration, label, tab->fileId, NULL, msg->lineNumbers[j], r->start, r->end);
+        }
+        search->filesMatched++;
+        search->totalMatches += msg->matches.count;
+        update_tab_status(search, false);
+    }
+    free(msg->matches.ranges);
+    free(msg->lineNumbers);
+    delete msg;
+}
+
+static void tab_search_work(void *data)
+{
+    struct TabSearch *search = (struct TabSearch *)data;
+
+    worker_parallel_for(search->count, search_tab, search);
+}
+
+// Every file's results are in by now, as they were sent first.
+static void tab_search_done(void *data)
+{
+    struct TabSearch *search = (struct TabSearch *)data;
+    int i;
+
+    if (search == s_tabSearch)
+    {
+        update_tab_status(search, true);
+        s_tabSearch = NULL;
+    }
+    for (i = 0; i < search->count; i++)
+    {
+        free(search->tabs[i].title);
+        free(search->tabs[i].text);
+    }
+    free(search->tabs);
+    free(search->query);
+    delete search;
+}
+
+// Searches a copy of every open file in the background, listing the matches
+// as each one is done.
+static void cb_on_find_in_tabs(Fl_Widget *, void *)
+{
+    const char *text = s_findInput->value();
+    const char *error;
+    bool regex = s_regexButton->value();
+    int matchCase = 0;
+    struct TabSearch *search;
+    int i;
+
+    if (text[0] == 0)
+        return;
+    if (regex && get_regex(text, matchCase, &error) == NULL)
+    {
+        fl_alert("The regular expression isn't valid: %s.", error);
+        return;
+    }
+
+    if (s_tabSearch != NULL)
+        __sync_fetch_and_add(&s_tabSearch->canceled, 1);
+    search = new TabSearch;
+    search->tabs = (struct TabSnapshot *)malloc(s_openCount * sizeof(*search->tabs));
+    search->count = s_openCount;
+    for (i = 0; i < s_openCount; i++)
+    {
+        search->tabs[i].fileId = s_openFiles[i].id;
+        search->tabs[i].title = strdup(s_openFiles[i].title);
+        search->tabs[i].text = s_openFiles[i].textbuf->text();
+        search->tabs[i].length = s_openFiles[i].textbuf->length();
+    }
+    search->query = strdup(text);
+    search->regex = regex;
+    search->matchCase = matchCase;
+    search->canceled = 0;
+    search->filesMatched = 0;
+    search->totalMatches = 0;
+    s_tabSearch = search;
+
+    // The results can't be clicked while this is up.
+    s_findDialog->hide();
+    search->resultsGeneration = results_clear();
+    worker_submit(tab_search_work, tab_search_done, search);
+}
+
 static void cb_on_cancel(Fl_Widget *, void *)
 {
     s_findDialog->hide();
 }
 
-void find_dialog_init(void)
+// 'matchesCallback' is called whenever the Find All results change.
+void find_dialog_init(void (*matchesCallback)(void))
 {
-    s_findDialog = new Fl_Window(300, 100, "Find/Replace");
+    int i;
+
+    // Searches run on other threads, so the table has to be ready before the
+    // first one starts.
+    for (i = 0; i < 256; i++)
+        s_foldTable[i] = (i >= 'A' && i <= 'Z') ? i - 'A' + 'a' : i;
+
+    s_matchesCallback = matchesCallback;
+    s_findDialog = new Fl_Window(360, 155, "Find/Replace");
     {
-        s_findInput = new Fl_Input(80, 10, 210, 25, "Find:");
+        s_findInput = new Fl_Input(80, 10, 270, 25, "Find:");
         s_findInput->align(FL_ALIGN_LEFT);
+        s_findInput->when(FL_WHEN_CHANGED);
+        s_findInput->callback(cb_on_type);
 
-        Fl_Input *replaceInput = new Fl_Input(80, 40, 210, 25, "Replace:");
-        replaceInput->align(FL_ALIGN_LEFT);
+        s_replaceInput = new Fl_Input(80, 40, 270, 25, "Replace:");
+        s_replaceInput->align(FL_ALIGN_LEFT);
 
-        Fl_Button *findPrev = new Fl_Button(10, 70, 100, 25, "@<- Previous");
+        s_regexButton = new Fl_Check_Button(80, 70, 150, 20, "Regular expression");
+        s_regexButton->callback(cb_on_regex);
+
+        Fl_Button *findPrev = new Fl_Button(10, 95, 100, 25, "@<- Previous");
         findPrev->callback(cb_on_find, (void *)false);
 
-        Fl_Button *findNext = new Fl_Button(115, 70, 100, 25, "@-> Next");
+        Fl_Button *findNext = new Fl_Button(115, 95, 100, 25, "@-> Next");
         findNext->callback(cb_on_find, (void *)true);
 
-        //Fl_Button *replaceAllBtn = new Fl_Button(105, 70, 120, 25, "Replace All");
-
-        Fl_Button *cancelBtn = new Fl_Button(230, 70, 60, 25, "Cancel");
+        Fl_Button *cancelBtn = new Fl_Button(290, 95, 60, 25, "Cancel");
         cancelBtn->callback(cb_on_cancel);
+
+        Fl_Button *findAll = new Fl_Button(10, 125, 100, 25, "Find All");
+        findAll->callback(cb_on_find_all);
+
+        Fl_Button *replaceAllBtn = new Fl_Button(115, 125, 100, 25, "Replace All");
+        replaceAllBtn->callback(cb_on_replace_all);
+
+        s_countBox = new Fl_Box(230, 70, 120, 20);
+        s_countBox->align(FL_ALIGN_RIGHT | FL_ALIGN_INSIDE);
+
+        Fl_Button *findInTabs = new Fl_Button(220, 125, 130, 25, "Find in All Tabs");
+        findInTabs->callback(cb_on_find_in_tabs);
     }
     s_findDialog->end();
     s_findDialog->set_modal();
 
 }
 
-void find_dialog_show(Fl_Text_Buffer *textBuf)
+// 'openFiles' are the files that Find in All Tabs searches.
+void find_dialog_show(Fl_Text_Buffer *textBuf, struct History *history, struct ViewedFile *viewed,
+    const struct OpenFile *openFiles, int openCount)
 {
+    free(s_openFiles);
+    s_openFiles = (struct OpenFile *)malloc(openCount * sizeof(*s_openFiles));
+    memcpy(s_openFiles, openFiles, openCount * sizeof(*s_openFiles));
+    s_openCount = openCount;
+
     s_currPos = 0;
+    s_typeOrigin = 0;
+    set_last_query(NULL, -1);
     s_textBuf = textBuf;
+    s_history = history;
+    s_viewed = viewed;
     s_findDialog->show();
 }
+
+// Where 'p' ends up after 'nDeleted' bytes at 'pos' are replaced with
+// 'nInserted' more.
+static int shift_position(int p, int pos, int nInserted, int nDeleted)
+{
+    if (p <= pos)
+        return p;
+    if (p >= pos + nDeleted)
+        return p + nInserted - nDeleted;
+    return pos;
+}
+
+// Keeps searching and the Find All results in step with edits to the text.
+void find_dialog_text_modified(Fl_Text_Buffer *textBuf, int pos, int nInserted, int nDeleted)
+{
+    if (textBuf == s_textBuf)
+    {
+        s_currPos = shift_position(s_currPos, pos, nInserted, nDeleted);
+        s_typeOrigin = shift_position(s_typeOrigin, pos, nInserted, nDeleted);
+        set_last_query(NULL, -1);
+    }
+    if (textBuf != s_matchBuf)
+        return;
+
+    // A match that can be any length and run over lines could reach the edit
+    // from anywhere, so those have to be searched for all over again.
+    if (!s_matchesValid || (s_matcher.maxLength < 0 && s_matcher.crossesLines))
+    {
+        s_matchesValid = false;
+        s_matchGeneration++;
+        schedule_find_all();
+    }
+    else
+    {
+        update_matches(pos, nInserted, nDeleted);
+    }
+    matches_changed();
+}
+
+// Forgets about a text buffer that's going away.
+void find_dialog_forget(Fl_Text_Buffer *textBuf)
+{
+    if (textBuf == s_matchBuf)
+        clear_matches();
+    if (textBuf == s_textBuf)
+        s_textBuf = NULL;
+}
+
+// Returns the Find All results in the text from 'start' to 'end', storing how
+// many there are in 'count'.
+const struct MatchRange *find_dialog_matches(Fl_Text_Buffer *textBuf, int start, int end, int *count)
+{
+    int first;
+
+    if (textBuf != s_matchBuf || !s_matchesValid)
+    {
+        *count = 0;
+        return NULL;
+    }
+    first = first_starting_at(&s_matches, 0, start);
+    if (first > 0 && s_matches.ranges[first - 1].end > start)
+        first--;
+    *count = first_starting_at(&s_matches, first, end) - first;
+    return s_matches.ranges + first;
+}
+
+// Makes something to search blocks of text for 'query' with, on any thread,
+// though only one at a time. Returns NULL if it's a regular expression that
+// isn't valid, leaving why in '*error' if it isn't NULL.
+struct Matcher *find_dialog_new_matcher(const char *query, bool regex, int matchCase, const char **error)
+{
+    struct Matcher *m = new Matcher;
+
+    if (!matcher_init(m, query, regex, matchCase, error))
+    {
+        delete m;
+        return NULL;
+    }
+    return m;
+}
+
+// Finds the first match in 'text' starting at or after 'pos'.
+bool find_dialog_match(struct Matcher *m, const char *text, int length, int pos, int *start, int *end)
+{
+    struct RegexText runs = {{text, text}, {length, 0}};
+
+    return matcher_find(m, &runs, pos, length, start, end);
+}
+
+void find_dialog_free_matcher(struct Matcher *m)
+{
+    matcher_free(m);
+    delete m;
+}
@@ -0,0 +1,475 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <FL/Fl.H>
+#include <FL/Fl_Window.H>
+#include <FL/Fl_Button.H>
+#include <FL/Fl_Return_Button.H>
+#include <FL/Fl_Check_Button.H>
+#include <FL/Fl_Input.H>
+#include <FL/Fl_Native_File_Chooser.H>
+#include <FL/fl_ask.H>
+#include <FL/filename.H>
+
+#include "fledit.hpp"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Files with a nul byte this near the start are taken to be binary, as grep does
+#define BINARY_CHECK_SIZE 8192
+
+#define DEFAULT_SKIP ".git;.hg;.svn;*.o;*.a;*.so;*.obj;*.exe"
+
+// A search of every file under a folder. The files are searched on a pool of
+// threads, started from one of its own so the worker thread isn't held up.
+struct FileSearch
+{
+    char *root;
+    char **skip;  // patterns for names to leave out
+    int skipCount;
+    char *query;
+    bool regex;
+    int matchCase;
+    char **paths;  // every file found
+    int pathCount;
+    int pathCapacity;
+    int next;  // the next file to search, claimed atomically
+    int canceled;
+    int filesMatched;  // these three are only touched on the UI thread
+    int totalMatches;
+    unsigned int resultsGeneration;  // from results_clear()
+};
+
+// Where a match is, by line and the bytes into it
+struct FileHit
+{
+    int lineNumber;
+    int column;
+    int length;
+};
+
+// One file's matches, sent to the UI thread as soon as it's been searched
+struct FileResults
+{
+    struct FileSearch *search;
+    const char *path;
+    int count;
+    int shown;  // how many have a hit and a label
+    struct FileHit *hits;
+    char *labels;  // one after another, each nul terminated
+    size_t labelsLength;
+    size_t labelsCapacity;
+};
+
+static Fl_Window *s_findFilesDialog;
+static Fl_Input *s_queryInput;
+static Fl_Input *s_folderInput;
+static Fl_Input *s_skipInput;
+static Fl_Check_Button *s_regexButton;
+static struct FileSearch *s_fileSearch;  // the newest search
+
+static bool is_canceled(struct FileSearch *fs)
+{
+    return __sync_fetch_and_add(&fs->canceled, 0) != 0;
+}
+
+static bool is_skipped(struct FileSearch *fs, const char *name)
+{
+    int i;
+
+    for (i = 0; i < fs->skipCount; i++)
+    {
+        if (fnmatch(fs->skip[i], name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void add_path(struct FileSearch *fs, char *path)
+{
+    if (fs->pathCount == fs->pathCapacity)
+    {
+        fs->pathCapacity = (fs->pathCapacity == 0) ? 1024 : fs->pathCapacity * 2;
+        fs->paths = (char **)realloc(fs->paths, fs->pathCapacity * sizeof(*fs->paths));
+    }
+    fs->paths[fs->pathCount++] = path;
+}
+
+// Finds every file under the root folder, leaving out what's skipped. Symbolic
+// links aren't followed, so there's no going round in circles.
+static void walk_tree(struct FileSearch *fs)
+{
+    char **dirs = (char **)malloc(sizeof(*dirs));
+    int dirCount = 1;
+    int dirCapacity = 1;
+
+    dirs[0] = strdup(fs->root);
+    while (dirCount > 0)
+    {
+        char *dirPath = dirs[--dirCount];
+        DIR *dir = is_canceled(fs) ? NULL : opendir(dirPath);
+        struct dirent *ent;
+
+        while (dir != NULL && (ent = readdir(dir)) != NULL)
+        {
+            unsigned char type = ent->d_type;
+            size_t length = strlen(dirPath) + strlen(ent->d_name) + 1;
+            char *path;
+
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_skipped(fs, ent->d_name))
+                continue;
+            // Files are opened by name, which has to fit in a TextFile.
+            if (length >= FL_PATH_MAX)
+                continue;
+            path = (char *)malloc(length + 1);
+            sprintf(path, "%s/%s", dirPath, ent->d_name);
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+
+                if (lstat(path, &st) == 0)
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_REG)
+            {
+                add_path(fs, path);
+            }
+            else if (type == DT_DIR)
+            {
+                if (dirCount == dirCapacity)
+                {
+                    dirCapacity *= 2;
+                    dirs = (char **)realloc(dirs, dirCapacity * sizeof(*dirs));
+                }
+                dirs[dirCount++] = path;
+            }
+            else
+            {
+                free(path);
+            }
+        }
+        if (dir != NULL)
+            closedir(dir);
+        free(dirPath);
+    }
+    free(dirs);
+}
+
+static void add_label(struct FileResults *msg, const char *label)
+{
+    size_t length = strlen(label) + 1;
+
+    if (msg->labelsLength + length > msg->labelsCapacity)
+    {
+        msg->labelsCapacity = (msg->labelsCapacity + length) * 2;
+        msg->labels = (char *)realloc(msg->labels, msg->labelsCapacity);
+    }
+    memcpy(msg->labels + msg->labelsLength, label, length);
+    msg->labelsLength += length;
+}
+
+static void cb_file_results(void *data);
+
+// Searches one file's text, sending its matches to the UI thread.
+static void search_text(struct FileSearch *fs, struct Matcher *m, const char *path, const char *text, int length)
+{
+    struct FileResults *msg = NULL;
+    const char *name = path + strlen(fs->root) + 1;  // the path within the folder
+    char label[RESULTS_LABEL_SIZE];
+    int lineNumber = 1;
+    int lineStart = 0;
+    int counted = 0;  // newlines before here have been counted
+    int p = 0;
+    int start;
+    int end;
+
+    while (p <= length && find_dialog_match(m, text, length, p, &start, &end))
+    {
+        if (msg == NULL)
+        {
+            msg = new FileResults;
+            memset(msg, 0, sizeof(*msg));
+            msg->search = fs;
+            msg->path = path;
+            msg->hits = (struct FileHit *)malloc(RESULTS_MAX_PER_FILE * sizeof(*msg->hits));
+        }
+        if (msg->shown < RESULTS_MAX_PER_FILE)
+        {
+            const char *newline;
+
+            while ((newline = (const char *)memchr(text + counted, '\n', start - counted)) != NULL)
+            {
+                lineNumber++;
+                counted = newline - text + 1;
+                lineStart = counted;
+            }
+            counted = start;
+            msg->hits[msg->shown].lineNumber = lineNumber;
+            msg->hits[msg->shown].column = start - lineStart;
+            msg->hits[msg->shown].length = end - start;
+            msg->shown++;
+            results_format(label, sizeof(label), name, text, length, lineNumber, start);
+            add_label(msg, label);
+        }
+        msg->count++;
+        p = (end > start) ? end : start + 1;
+    }
+    if (msg != NULL)
+        worker_awake(cb_file_results, msg);
+}
+
+// Maps the file into memory and searches it, unless it looks binary.
+static void search_file(struct FileSearch *fs, struct Matcher *m, const char *path)
+{
+    struct stat st;
+    const char *text;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size >= INT_MAX)
+    {
+        close(fd);
+        return;
+    }
+    text = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+        return;
+    if (memchr(text, 0, MIN(st.st_size, BINARY_CHECK_SIZE)) == NULL)
+        search_text(fs, m, path, text, st.st_size);
+    munmap((void *)text, st.st_size);
+}
+
+// Each processor takes the next file to search until there are none left, so
+// a big file doesn't leave the others waiting.
+static void search_files(void *data, int)
+{
+    struct FileSearch *fs = (struct FileSearch *)data;
+    struct Matcher *m = find_dialog_new_matcher(fs->query, fs->regex, fs->matchCase, NULL);
+    int i;
+
+    while (!is_canceled(fs) && (i = __sync_fetch_and_add(&fs->next, 1)) < fs->pathCount)
+        search_file(fs, m, fs->paths[i]);
+    find_dialog_free_matcher(m);
+}
+
+static void update_status(struct FileSearch *fs, bool finished)
+{
+    char status[96];
+    const char *state = "";
+
+    if (!finished)
+        state = "Searching... ";
+    else if (fs->canceled)
+        state = "Stopped: ";
+
+    if (fs->totalMatches == 0)
+        snprintf(status, sizeof(status), "%s%s", state, finished ? "Not found" : "");
+    else
+        snprintf(status, sizeof(status), "%s%i matches in %i files", state, fs->totalMatches, fs->filesMatched);
+    results_status(fs->resultsGeneration, status);
+}
+
+static void cb_file_results(void *data)
+{
+    struct FileResults *msg = (struct FileResults *)data;
+    struct FileSearch *fs = msg->search;
+    const char *label = msg->labels;
+    int i;
+
+    if (fs == s_fileSearch)
+    {
+        for (i = 0; i < msg->shown; i++)
+        {
+            struct FileHit *hit = &msg->hits[i];
+
+            results_add(fs->resultsGeneration, label, 0, msg->path, hit->lineNumber, hit->column,
+                hit->column + hit->length);
+            label += strlen(label) + 1;
+        }
+        fs->filesMatched++;
+        fs->totalMatches += msg->count;
+        update_status(fs, false);
+    }
+    free(msg->hits);
+    free(msg->labels);
+    delete msg;
+}
+
+// The search thread sends this last and is done with the search by then.
+static void cb_search_done(void *data)
+{
+    struct FileSearch *fs = (struct FileSearch *)data;
+    int i;
+
+    if (fs == s_fileSearch)
+    {
+        update_status(fs, true);
+        s_fileSearch = NULL;
+    }
+    for (i = 0; i < fs->skipCount; i++)
+        free(fs->skip[i]);
+    for (i = 0; i < fs->pathCount; i++)
+        free(fs->paths[i]);
+    free(fs->skip);
+    free(fs->paths);
+    free(fs->root);
+    free(fs->query);
+    delete fs;
+}
+
+static void *search_main(void *arg)
+{
+    struct FileSearch *fs = (struct FileSearch *)arg;
+
+    walk_tree(fs);
+    worker_parallel_for(worker_cpu_count(), search_files, fs);
+    worker_awake(cb_search_done, fs);
+    return NULL;
+}
+
+// Splits the semicolon separated patterns in 'text' up.
+static void parse_skip(struct FileSearch *fs, const char *text)
+{
+    fs->skip = NULL;
+    fs->skipCount = 0;
+    while (*text != 0)
+    {
+        const char *end = strchr(text, ';');
+        size_t length = (end != NULL) ? (size_t)(end - text) : strlen(text);
+
+        if (length > 0)
+        {
+            fs->skip = (char **)realloc(fs->skip, (fs->skipCount + 1) * sizeof(*fs->skip));
+            fs->skip[fs->skipCount++] = strndup(text, length);
+        }
+        text += length;
+        if (*text == ';')
+            text++;
+    }
+}
+
+static void cb_on_search(Fl_Widget *, void *)
+{
+    const char *query = s_queryInput->value();
+    const char *folder = s_folderInput->value();
+    bool regex = s_regexButton->value();
+    int matchCase = 0;
+    struct FileSearch *fs;
+    struct Matcher *m;
+    const char *error;
+    struct stat st;
+    pthread_t thread;
+    size_t rootLength;
+
+    if (query[0] == 0)
+        return;
+    if (stat(folder, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        fl_alert("'%s' isn't a folder.", folder);
+        return;
+    }
+    m = find_dialog_new_matcher(query, regex, matchCase, &error);
+    if (m == NULL)
+    {
+        fl_alert("The regular expression isn't valid: %s.", error);
+        return;
+    }
+    find_dialog_free_matcher(m);
+
+    if (s_fileSearch != NULL)
+        __sync_fetch_and_add(&s_fileSearch->canceled, 1);
+    fs = new FileSearch;
+    memset(fs, 0, sizeof(*fs));
+    fs->root = strdup(folder);
+    rootLength = strlen(fs->root);
+    while (rootLength > 1 && fs->root[rootLength - 1] == '/')
+        fs->root[--rootLength] = 0;
+    parse_skip(fs, s_skipInput->value());
+    fs->query = strdup(query);
+    fs->regex = regex;
+    fs->matchCase = matchCase;
+    fs->resultsGeneration = results_clear();
+    s_fileSearch = fs;
+
+    if (pthread_create(&thread, NULL, search_main, fs) != 0)
+    {
+        perror("could not start search thread");
+        cb_search_done(fs);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static void cb_on_stop(Fl_Widget *, void *)
+{
+    if (s_fileSearch != NULL)
+        __sync_fetch_and_add(&s_fileSearch->canceled, 1);
+}
+
+static void cb_on_browse(Fl_Widget *, void *)
+{
+    Fl_Native_File_Chooser chooser;
+
+    chooser.title("Find in Files");
+    chooser.type(Fl_Native_File_Chooser::BROWSE_DIRECTORY);
+    if (chooser.show() == 0)
+        s_folderInput->value(chooser.filename());
+}
+
+static void cb_on_close(Fl_Widget *, void *)
+{
+    s_findFilesDialog->hide();
+}
+
+void find_files_init(void)
+{
+    char cwd[PATH_MAX];
+
+    s_findFilesDialog = new Fl_Window(360, 160, "Find in Files");
+    {
+        s_queryInput = new Fl_Input(80, 10, 270, 25, "Find:");
+        s_queryInput->align(FL_ALIGN_LEFT);
+
+        s_folderInput = new Fl_Input(80, 40, 185, 25, "In folder:");
+        s_folderInput->align(FL_ALIGN_LEFT);
+        if (getcwd(cwd, sizeof(cwd)) != NULL)
+            s_folderInput->value(cwd);
+
+        Fl_Button *browseBtn = new Fl_Button(270, 40, 80, 25, "Browse...");
+        browseBtn->callback(cb_on_browse);
+
+        s_skipInput = new Fl_Input(80, 70, 270, 25, "Skip:");
+        s_skipInput->align(FL_ALIGN_LEFT);
+        s_skipInput->value(DEFAULT_SKIP);
+        s_skipInput->tooltip("Names of files and folders to leave out, separated by semicolons");
+
+        s_regexButton = new Fl_Check_Button(80, 100, 270, 20, "Regular expression");
+
+        Fl_Button *searchBtn = new Fl_Return_Button(80, 125, 100, 25, "Search");
+        searchBtn->callback(cb_on_search);
+
+        Fl_Button *stopBtn = new Fl_Button(185, 125, 80, 25, "Stop");
+        stopBtn->callback(cb_on_stop);
+
+        Fl_Button *closeBtn = new Fl_Button(270, 125, 80, 25, "Close");
+        closeBtn->callback(cb_on_close);
+    }
+    s_findFilesDialog->end();
+}
+
+void find_files_show(void)
+{
+    s_findFilesDialog->show();
+}
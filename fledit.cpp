@@ -1,8 +1,13 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <FL/Fl.H>
 #include <FL/Fl_Double_Window.H>
@@ -15,7 +20,9 @@
 #include <FL/Fl_Text_Editor.H>
 #include <FL/Fl_Box.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Progress.H>
 #include <FL/fl_ask.H>
+#include <FL/fl_draw.H>
 #include <FL/filename.H>
 
 #include "fledit.hpp"
@@ -27,33 +34,86 @@
 
 #define TOOLBAR_HEIGHT 32
 
+// Files at least this big are read in the background
+#define ASYNC_LOAD_SIZE (1024 * 1024)
+
 enum
 {
     FILE_ACTION_ERROR = -1,
     FILE_ACTION_OK = 0,
     FILE_ACTION_CANCELED = 1,
+    FILE_ACTION_PENDING = 2,  // it finishes once the file's saves are written
+};
+
+// How a file is opened. Normally, files too big to edit comfortably are shown
+// straight from disk instead.
+enum OpenMode
+{
+    OPEN_NORMAL,
+    OPEN_READ_ONLY,
+    OPEN_EDITABLE,
 };
 
 struct TextFile
 {
     struct TextFile *next;
+    unsigned int id;  // never reused, unlike the struct's address
     bool modified;
     char filename[FL_PATH_MAX];
     char title[FL_PATH_MAX];
     Fl_Text_Buffer *textbuf;
-    Fl_Text_Buffer *stylebuf;
     Fl_Group *tab;
     struct History history;
+    struct Colorizer colorizer;
+    struct RecoveryLog *recovery;
+    struct ViewedFile *viewed;  // set if the file is open read-only
+    struct FileLoader *loader;  // set while the file is still being read
+    double loadProgress;
+    char *pendingText;  // replaces the text once it has loaded
+    unsigned int editCount;  // goes up with every change to the text
+    int savesPending;  // saves still being written out
+    bool closing;  // the tab closes once its saves are written
+    int resultLine;  // line of a search result to go to once loaded, or 0
+    int resultStart;  // where the result is in that line
+    int resultEnd;
+};
+
+// A snapshot of a file being written out on the worker thread
+struct SaveJob
+{
+    struct TextFile *f;
+    char filename[FL_PATH_MAX];
+    char *text;
+    int length;
+    unsigned int editCount;  // of the file when the snapshot was taken
+    unsigned int hash;  // of the text, for the undo journal
+    mode_t newFileMode;
+    int error;
+};
+
+// The text editor, with every match from Find All outlined
+class EditorWidget : public Fl_Text_Editor
+{
+public:
+    EditorWidget(int x, int y, int w, int h);
+    void draw();
 };
 
 static void set_current_tab(struct TextFile *f);
+static void update_load_bar(void);
+static int do_close(struct TextFile *f);
+static void show_result(struct TextFile *f, int lineNumber, int start, int end);
 
 static Fl_Window *s_mainWindow;
 static Fl_Menu_Bar *s_menuBar;
 static Fl_Text_Editor *s_textEditor;
+static Fl_Widget *s_fileViewer;  // shown in place of the editor for read-only files
 static Fl_Tabs *s_tabBar;
+static Fl_Progress *s_loadProgress;
+static Fl_Button *s_loadCancel;
 static struct TextFile *s_textFiles = NULL;
 static struct TextFile *s_currTextFile = NULL;
+static unsigned int s_nextFileId = 1;
 static const char *const s_themeNames[] = {"none", "plastic", "gtk+", "gleam"};
 static bool s_updateHistoryOnModify = true;
 
@@ -73,8 +133,12 @@ static void update_file_title(struct TextFile *f)
         strcpy(f->title, "(untitled)");
     else
         strcpy(f->title, get_base_filename(f->filename));
-    if (f->modified)
-        f->title[MIN(strlen(f->title), sizeof(f->title) - 1)] = '*';
+    if (f->modified && strlen(f->title) + 1 < sizeof(f->title))
+        strcat(f->title, "*");
+    if (f->viewed != NULL && strlen(f->title) + 12 < sizeof(f->title))
+        strcat(f->title, " (read-only)");
+    if (f->loader != NULL && strlen(f->title) + 7 < sizeof(f->title))
+        sprintf(f->title + strlen(f->title), " (%i%%)", (int)(100 * f->loadProgress));
 }
 
 static void cb_tab_change(Fl_Widget *, void *)
@@ -85,11 +149,48 @@ static void cb_tab_change(Fl_Widget *, void *)
     set_current_tab(f);
 }
 
+EditorWidget::EditorWidget(int x, int y, int w, int h) : Fl_Text_Editor(x, y, w, h)
+{
+}
+
+void EditorWidget::draw()
+{
+    const struct MatchRange *matches;
+    int count;
+    int i;
+
+    Fl_Text_Editor::draw();
+    if (buffer() == NULL)
+        return;
+    matches = find_dialog_matches(buffer(), mFirstChar, mLastChar + 1, &count);
+    if (count == 0)
+        return;
+
+    // FLTK only highlights one range, so these get drawn around instead.
+    fl_push_clip(text_area.x, text_area.y, text_area.w, text_area.h);
+    fl_color(selection_color());
+    for (i = 0; i < count; i++)
+    {
+        int start = MAX(matches[i].start, mFirstChar);
+        int end = MIN(matches[i].end, buffer()->line_end(start));  // the rest of it is on later lines
+        int x1, y1, x2, y2;
+
+        if (matches[i].end == matches[i].start || !position_to_xy(start, &x1, &y1))
+            continue;
+        if (end == start || !position_to_xy(end, &x2, &y2) || y2 != y1)
+            x2 = text_area.x + text_area.w;
+        fl_rect(x1, y1, MAX(x2 - x1, 2), mMaxsize);
+    }
+    fl_pop_clip();
+}
+
 static bool s_ignoreRecursion = false;
 
 static void cb_modified(int pos, int nInserted, int nDeleted, int nRestyled,
     const char *deletedText, void *p)
 {
+    struct TextFile *f = (struct TextFile *)p;
+
     /*
     static bool ignoreRecursion;
 
@@ -130,25 +231,36 @@ static void cb_modified(int pos, int nInserted, int nDeleted, int nRestyled,
 
     if (nInserted == 0 && nDeleted == 0)
         return;
+    find_dialog_text_modified(f->textbuf, pos, nInserted, nDeleted);
 
-    if (g_settings.syntaxHighlighting)
-        colorize_update(s_textEditor, s_currTextFile->textbuf, s_currTextFile->stylebuf);
+    // Text coming in from the file isn't an edit. It gets highlighted once
+    // it's all there.
+    if (f->loader != NULL)
+    {
+        colorize_invalidate(&f->colorizer);
+        return;
+    }
+    f->editCount++;
+
+    if (g_settings.syntaxHighlighting && f == s_currTextFile)
+        colorize_update_range(&f->colorizer, s_textEditor, pos, nInserted, nDeleted);
+    else
+        colorize_invalidate(&f->colorizer);
+
+    // Undoing and redoing changes the text too, so log this before anything else.
+    recovery_log_edit(&f->recovery, f->textbuf, f->filename, pos, nInserted, nDeleted);
 
     if (!s_updateHistoryOnModify)
         return;
 
-    struct TextFile *f = (struct TextFile *)p;
-
     //printf("modified: pos=%i, nInserted=%i, nDeleted=%i, nRestyled=%i\n",
     //    pos, nInserted, nDeleted, nRestyled);
 
     if (s_updateHistoryOnModify)
     {
+        // What a replace deleted was recorded before it was deleted.
         if (nInserted != 0)
-        {
-            assert(nDeleted == 0);
-            history_record_text_insert(&s_currTextFile->history, pos, nInserted);
-        }
+            history_record_text_insert(&f->history, pos, nInserted);
     }
 
     if (!f->modified)
@@ -163,12 +275,14 @@ static void cb_modified(int pos, int nInserted, int nDeleted, int nRestyled,
 
 static void cb_predelete(int pos, int nDeleted, void *data)
 {
-    if (s_updateHistoryOnModify)
+    struct TextFile *f = (struct TextFile *)data;
+
+    if (s_updateHistoryOnModify && f->loader == NULL)
     {
         if (nDeleted != 0)
         {
             printf("deleting: pos=%i, nDeleted=%i\n", pos, nDeleted);
-            history_record_text_delete(&s_currTextFile->history, pos, nDeleted);
+            history_record_text_delete(&f->history, pos, nDeleted);
         }
     }
 }
@@ -191,6 +305,7 @@ static void file_list_append(struct TextFile *f)
 
 static void file_list_remove(struct TextFile *f)
 {
+    assert(f->savesPending == 0);
     if (f == s_textFiles)
     {
         s_textFiles = s_textFiles->next;
@@ -211,31 +326,83 @@ static void file_list_remove(struct TextFile *f)
     // use it after it's been freed.
     if (s_textEditor->buffer() == f->textbuf)
         s_textEditor->buffer(NULL);
+    find_dialog_forget(f->textbuf);
     delete f->textbuf;
-    delete f->stylebuf;
+    colorize_free(&f->colorizer);
+    recovery_close(&f->recovery);
+    if (f->loader != NULL)
+        loader_cancel(f->loader);
+    free(f->pendingText);
+    if (f->viewed != NULL)
+    {
+        viewer_close(f->viewed);
+        delete f->viewed;
+    }
     Fl::delete_widget(f->tab);
     history_free(&f->history);
     delete f;
 }
 
-static struct TextFile *open_text_file(const char *filename)
+// Adds a piece of a file being loaded in the background to its buffer.
+static void cb_load_chunk(void *data, const char *text, double progress)
 {
-    struct TextFile *f = new TextFile;
+    struct TextFile *f = (struct TextFile *)data;
 
-    memset(f, 0, sizeof(*f));
-    f->textbuf = f->history.textbuf = new Fl_Text_Buffer;
-    strcpy(f->title, "");
+    f->textbuf->append(text);
+    f->loadProgress = progress;
+    update_file_title(f);
+    s_tabBar->redraw();
+    if (f == s_currTextFile)
+    {
+        s_mainWindow->label(f->title);
+        update_load_bar();
+    }
+}
 
-    if (filename != NULL)
+static void cb_load_done(void *data, int error)
+{
+    struct TextFile *f = (struct TextFile *)data;
+
+    if (error != 0)
     {
-        if (f->textbuf->loadfile(filename) == 0)  // succeeded
-            strcpy(f->filename, filename);
-        else
-            fl_alert("Could not open file");
+        fl_alert("Could not open file: %s", strerror(error));
+        f->textbuf->text("");
+        f->filename[0] = 0;
+        colorize_set_filename(&f->colorizer, f->filename);
+    }
+    f->loader = NULL;
+    if (error == 0)
+        history_open_journal(&f->history, f->filename);
+    if (f->pendingText != NULL)
+    {
+        history_begin_group(&f->history);
+        f->textbuf->text(f->pendingText);
+        history_end_group(&f->history);
+        free(f->pendingText);
+        f->pendingText = NULL;
     }
+
+    update_file_title(f);
+    s_tabBar->redraw();
+    if (f == s_currTextFile)
+    {
+        s_mainWindow->label(f->title);
+        update_load_bar();
+        if (g_settings.syntaxHighlighting)
+            colorize_update(&f->colorizer, s_textEditor);
+        if (error == 0 && f->resultLine > 0)
+            show_result(f, f->resultLine, f->resultStart, f->resultEnd);
+    }
+    f->resultLine = 0;
+}
+
+// Gives a newly opened file its highlighting, callbacks and tab.
+static void add_text_file(struct TextFile *f)
+{
+    f->id = s_nextFileId++;
     update_file_title(f);
 
-    f->stylebuf = colorize_init(f->textbuf);
+    colorize_init(&f->colorizer, f->textbuf, f->filename);
 
     f->textbuf->add_modify_callback(cb_modified, f);
     f->textbuf->add_predelete_callback(cb_predelete, f);
@@ -247,21 +414,254 @@ static struct TextFile *open_text_file(const char *filename)
     s_mainWindow->redraw();  // Force everything to redraw, because it doesn't happen automatically.
 
     file_list_append(f);
+}
+
+static struct TextFile *open_text_file(const char *filename, enum OpenMode mode)
+{
+    struct TextFile *f = new TextFile;
+    struct stat st;
+    bool exists = (filename != NULL && stat(filename, &st) == 0);
+    bool readOnly = (mode == OPEN_READ_ONLY);
+
+    // Loading all of a big file to edit it takes a while and a lot of memory,
+    // so ask first.
+    if (mode == OPEN_NORMAL && exists && g_settings.viewerThresholdMB != 0
+     && (unsigned long long)st.st_size >= (unsigned long long)g_settings.viewerThresholdMB << 20)
+    {
+        readOnly = (fl_choice("The file '%s' is %llu MB.\n"
+                              "Do you want to view it read-only, or load all of it to edit?",
+                              "View Read-Only", "Edit", NULL,
+                              fl_filename_name(filename), (unsigned long long)st.st_size >> 20) != 1);
+    }
+
+    memset(f, 0, sizeof(*f));
+    // Make room for the whole file up front, so the buffer isn't grown over
+    // and over as it's read.
+    if (exists && !readOnly && st.st_size < INT_MAX / 2)
+        f->textbuf = f->history.textbuf = new Fl_Text_Buffer(st.st_size);
+    else
+        f->textbuf = f->history.textbuf = new Fl_Text_Buffer;
+    strcpy(f->title, "");
+
+    if (filename != NULL)
+    {
+        if (readOnly)
+        {
+            f->viewed = new ViewedFile;
+            if (viewer_open(f->viewed, filename))
+            {
+                strcpy(f->filename, filename);
+            }
+            else
+            {
+                viewer_close(f->viewed);
+                delete f->viewed;
+                f->viewed = NULL;
+                fl_alert("Could not open file");
+            }
+        }
+        else if (exists && st.st_size >= ASYNC_LOAD_SIZE
+         && (f->loader = loader_start(filename, cb_load_chunk, cb_load_done, f)) != NULL)
+        {
+            // The text is filled in as it's read.
+            strcpy(f->filename, filename);
+        }
+        else if (f->textbuf->loadfile(filename) == 0)  // succeeded
+        {
+            strcpy(f->filename, filename);
+            history_open_journal(&f->history, f->filename);
+        }
+        else
+            fl_alert("Could not open file");
+    }
+    add_text_file(f);
+    return f;
+}
+
+// Opens a file that has already been read in.
+static struct TextFile *open_read_text_file(const char *filename, const char *text)
+{
+    struct TextFile *f = new TextFile;
+
+    memset(f, 0, sizeof(*f));
+    f->textbuf = f->history.textbuf = new Fl_Text_Buffer;
+    f->textbuf->text(text);
+    strcpy(f->filename, filename);
+    history_open_journal(&f->history, f->filename);
+    add_text_file(f);
     return f;
 }
 
+// Opens each of a batch of files as it's read, and switches to the first.
+static void cb_file_read(void *, int index, const char *filename, const char *text)
+{
+    struct TextFile *f;
+
+    if (text != NULL)
+        f = open_read_text_file(filename, text);
+    else
+        f = open_text_file(filename, OPEN_NORMAL);  // it's big, or it needs an error shown
+    if (index == 0)
+        set_current_tab(f);
+}
+
+// Returns 0, or the errno value of what went wrong.
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        if (n == 0)
+            return EIO;  // write() didn't set errno
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Writes the snapshot to a temporary file next to the real one and renames it
+// over the top, so a crash part way through leaves either the old file or the
+// new one, never half of it.
+static void save_job_work(void *data)
+{
+    struct SaveJob *job = (struct SaveJob *)data;
+    char target[PATH_MAX];
+    char temp[PATH_MAX + 16];
+    char *slash;
+    struct stat st;
+    int fd;
+
+    job->hash = history_hash_text(job->text, job->length);
+
+    // Replace the file a symlink points to rather than the link itself.
+    if (realpath(job->filename, target) == NULL)
+        snprintf(target, sizeof(target), "%s", job->filename);
+    slash = strrchr(target, '/');
+    if (slash != NULL)
+        snprintf(temp, sizeof(temp), "%.*s/.%s.XXXXXX", (int)(slash - target), target, slash + 1);
+    else
+        snprintf(temp, sizeof(temp), ".%s.XXXXXX", target);
+
+    fd = mkstemp(temp);
+    if (fd < 0)
+    {
+        job->error = errno;
+        return;
+    }
+    fchmod(fd, (stat(target, &st) == 0) ? (st.st_mode & 07777) : job->newFileMode);
+    job->error = write_all(fd, job->text, job->length);
+    if (job->error == 0 && fsync(fd) != 0)
+        job->error = errno;
+    if (job->error != 0)
+    {
+        close(fd);
+        unlink(temp);
+        return;
+    }
+    if (close(fd) != 0 || rename(temp, target) != 0)
+    {
+        job->error = errno;
+        unlink(temp);
+        return;
+    }
+
+    // Make sure the rename itself reaches the disk.
+    if (slash != NULL)
+        *slash = 0;
+    fd = open((slash != NULL) ? (target[0] != 0 ? target : "/") : ".", O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void save_job_done(void *data)
+{
+    struct SaveJob *job = (struct SaveJob *)data;
+    struct TextFile *f = job->f;
+    int error = job->error;
+
+    f->savesPending--;
+    if (job->error != 0)
+    {
+        fl_alert("Failed to save file: %s", strerror(job->error));
+    }
+    else
+    {
+        bool renamed = (strcmp(f->filename, job->filename) != 0);
+
+        // Edits made while it was being written still need saving.
+        if (f->editCount == job->editCount)
+        {
+            f->modified = false;
+            recovery_saved(&f->recovery, job->filename, job->text, job->length);
+            job->text = NULL;
+            if (!renamed)
+                history_mark_journal(&f->history, job->hash);
+        }
+        if (renamed)
+        {
+            strcpy(f->filename, job->filename);
+            colorize_set_filename(&f->colorizer, f->filename);
+            if (f == s_currTextFile && g_settings.syntaxHighlighting)
+                colorize_update(&f->colorizer, s_textEditor);
+        }
+        update_file_title(f);
+        s_tabBar->redraw();
+        if (f == s_currTextFile)
+            s_mainWindow->label(f->title);
+    }
+    free(job->text);
+    delete job;
+
+    // A close waiting on the saves goes ahead, unless one failed. It asks
+    // again if there were edits in the meantime.
+    if (f->closing && f->savesPending == 0)
+    {
+        f->closing = false;
+        if (error == 0)
+            do_close(f);
+    }
+}
+
+// Starts writing the file out on the worker thread. It's marked as saved once
+// that finishes. Returns false if it can't be saved.
 static bool save_text_file(struct TextFile *f, const char *filename)
 {
+    struct SaveJob *job;
+    mode_t mask;
+
     printf("save_text_file: filename='%s'\n", filename);
-    if (f->textbuf->savefile(filename) != 0)
+    if (f->loader != NULL)
     {
-        fl_alert("Failed to save file: %s", strerror(errno));
+        fl_alert("'%s' hasn't finished loading yet.", f->filename);
         return false;
     }
-    f->modified = false;
-    if (f->filename != filename)
-        strcpy(f->filename, filename);
-    update_file_title(f);
+    if (f->viewed != NULL)
+    {
+        fl_alert("'%s' is open read-only and can't be saved.", f->filename);
+        return false;
+    }
+
+    job = new SaveJob;
+    job->f = f;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->text = f->textbuf->text();
+    job->length = f->textbuf->length();
+    job->editCount = f->editCount;
+    job->hash = 0;
+    mask = umask(0);
+    umask(mask);
+    job->newFileMode = 0666 & ~mask;
+    job->error = 0;
+    f->savesPending++;
+    worker_submit(save_job_work, save_job_done, job);
     return true;
 }
 
@@ -269,22 +669,40 @@ static bool save_text_file(struct TextFile *f, const char *filename)
 
 static void menu_cb_new(Fl_Widget *, void *)
 {
-    struct TextFile *f = open_text_file(NULL);
+    struct TextFile *f = open_text_file(NULL, OPEN_NORMAL);
     set_current_tab(f);
 }
 
-static void menu_cb_open(Fl_Widget *, void *)
+static void menu_cb_open(Fl_Widget *, void *data)
 {
     Fl_Native_File_Chooser chooser;
-    struct TextFile *f;
+    const char **filenames;
+    bool readOnly = (data != NULL);
+    int i;
 
-    chooser.title("Open");
-    chooser.type(Fl_Native_File_Chooser::BROWSE_FILE);
+    chooser.title(readOnly ? "Open Read-Only" : "Open");
+    chooser.type(Fl_Native_File_Chooser::BROWSE_MULTI_FILE);
     switch (chooser.show())
     {
     case FILE_ACTION_OK:
-        f = open_text_file(chooser.filename());
-        set_current_tab(f);
+        if (readOnly)
+        {
+            for (i = 0; i < chooser.count(); i++)
+            {
+                struct TextFile *f = open_text_file(chooser.filename(i), OPEN_READ_ONLY);
+
+                if (i == 0)
+                    set_current_tab(f);
+            }
+        }
+        else
+        {
+            filenames = new const char *[chooser.count()];
+            for (i = 0; i < chooser.count(); i++)
+                filenames[i] = chooser.filename(i);
+            loader_read_files(filenames, chooser.count(), ASYNC_LOAD_SIZE, cb_file_read, NULL);
+            delete[] filenames;
+        }
         break;
     case FILE_ACTION_ERROR:
         fl_alert("Failed to open file: %s", chooser.errmsg());
@@ -322,7 +740,7 @@ static int do_save_as(struct TextFile *f)
 
 static int do_save(struct TextFile *f)
 {
-    if (s_currTextFile->filename[0] == 0)
+    if (f->filename[0] == 0)
     {
         return do_save_as(f);
     }
@@ -336,34 +754,73 @@ static int do_save(struct TextFile *f)
     }
 }
 
+// Closes the file's tab, asking first if it has unsaved changes. If it still
+// has saves being written, it's marked as closing instead, and save_job_done()
+// closes it once they're done. The window closes along with the last tab.
 static int do_close(struct TextFile *f)
 {
+    bool current = (f == s_currTextFile);
     int result;
 
-    if (s_currTextFile->modified)
+    if (f->closing)
+        return FILE_ACTION_PENDING;
+
+    // A save that's still being written may be about to clear the modified flag.
+    if (f->savesPending > 0)
+    {
+        f->closing = true;
+        return FILE_ACTION_PENDING;
+    }
+
+    if (f->modified)
     {
-        int button = fl_choice(
+        int button;
+
+        // The dialogs handle events while they're up, which mustn't close the
+        // file out from under them.
+        if (!current)
+        {
+            set_current_tab(f);
+            s_mainWindow->redraw();
+            current = true;
+        }
+        f->closing = true;
+        button = fl_choice(
             "The file '%s' is not saved.\n"
             "Do you want to save it before closing?",
             "Cancel", "Save", "Don't save",
-            s_currTextFile->title);
+            f->title);
         switch (button)
         {
         case 0:  // Cancel
+            f->closing = false;
             return FILE_ACTION_CANCELED;
         case 1:  // Save
-            result = do_save(s_currTextFile);
+            result = do_save(f);
             if (result != FILE_ACTION_OK)
+            {
+                f->closing = false;
                 return result;
-            break;
+            }
+            return FILE_ACTION_PENDING;
         case 2:  // Don't save
             break;
         }
+        current = (f == s_currTextFile);
     }
 
     // remove the file from the editor
-    s_tabBar->remove(s_currTextFile->tab);
-    file_list_remove(s_currTextFile);
+    s_tabBar->remove(f->tab);
+    file_list_remove(f);
+    if (s_textFiles == NULL)
+    {
+        s_mainWindow->hide();
+    }
+    else if (current)
+    {
+        set_current_tab(s_textFiles);
+        s_mainWindow->redraw();
+    }
     return FILE_ACTION_OK;
 }
 
@@ -389,16 +846,20 @@ static void menu_cb_save(Fl_Widget *, void *)
 
 static void menu_cb_close(Fl_Widget *, void *)
 {
-    if (do_close(s_currTextFile) == FILE_ACTION_OK)
-    {
-        if (s_textFiles == NULL)
-            s_mainWindow->hide();
-        else
-        {
-            set_current_tab(s_textFiles);
-            s_mainWindow->redraw();
-        }
-    }
+    do_close(s_currTextFile);
+}
+
+// Stops loading the current file and closes its tab.
+static void menu_cb_cancel_load(Fl_Widget *, void *)
+{
+    if (s_currTextFile->loader == NULL)
+        return;
+    s_tabBar->remove(s_currTextFile->tab);
+    file_list_remove(s_currTextFile);
+    if (s_textFiles == NULL)
+        open_text_file(NULL, OPEN_NORMAL);
+    set_current_tab(s_textFiles);
+    s_mainWindow->redraw();
 }
 
 static void dump_files(void)
@@ -415,23 +876,27 @@ static void dump_files(void)
 
 static void menu_cb_exit(Fl_Widget *, void *)
 {
-    struct TextFile *f = s_textFiles;
+    struct TextFile *f;
 
     dump_files();
-    while (f != NULL)
+
+    // Closing a file can handle events, which may close others, so start over
+    // from the first file not already closing each time. Files still being
+    // saved close once they're written, and the window with the last of them.
+    for (;;)
     {
-        struct TextFile *next = f->next;
+        int result;
 
-        set_current_tab(f);
-        s_mainWindow->redraw();
-        do_close(f);
-        printf("maybe closed file %p\n", f);
+        f = s_textFiles;
+        while (f != NULL && f->closing)
+            f = f->next;
+        if (f == NULL)
+            break;
+        result = do_close(f);
+        if (result == FILE_ACTION_CANCELED || result == FILE_ACTION_ERROR)
+            break;
         dump_files();
-        f = next;
     }
-    //s_mainWindow->hide();
-    if (s_textFiles == NULL)
-        s_mainWindow->hide();
 }
 
 static void menu_cb_undo(Fl_Widget *, void *)
@@ -452,6 +917,18 @@ static void menu_cb_redo(Fl_Widget *, void *)
     s_updateHistoryOnModify = true;
 }
 
+// Steps the text back or forward a minute in time, across every branch of the
+// undo history.
+static void menu_cb_time_travel(Fl_Widget *, void *data)
+{
+    struct History *h = &s_currTextFile->history;
+    int seconds = (intptr_t)data;
+
+    s_updateHistoryOnModify = false;
+    history_goto_time(h, history_time(h) + seconds);
+    s_updateHistoryOnModify = true;
+}
+
 static void menu_cb_cut(Fl_Widget *, void *)
 
 static void menu_cb_copy(Fl_Widget *, void *)
@@ -460,7 +937,49 @@ static void menu_cb_paste(Fl_Widget *, void *)
 
 static void menu_cb_find(Fl_Widget *, void *)
 {
-    find_dialog_show(s_currTextFile->textbuf);
+    struct OpenFile *openFiles;
+    struct TextFile *f;
+    int count = 0;
+
+    for (f = s_textFiles; f != NULL; f = f->next)
+        count++;
+    openFiles = (struct OpenFile *)malloc(count * sizeof(*openFiles));
+    count = 0;
+    for (f = s_textFiles; f != NULL; f = f->next)
+    {
+        // Files opened read-only have no text buffer to search.
+        if (f->viewed != NULL)
+            continue;
+        openFiles[count].id = f->id;
+        openFiles[count].title = f->title;
+        openFiles[count].textbuf = f->textbuf;
+        count++;
+    }
+    find_dialog_show(s_currTextFile->textbuf, &s_currTextFile->history, s_currTextFile->viewed, openFiles, count);
+    free(openFiles);
+}
+
+static void menu_cb_find_in_files(Fl_Widget *, void *)
+{
+    find_files_show();
+}
+
+static void menu_cb_goto_line(Fl_Widget *, void *)
+{
+    const char *input = fl_input("Go to line:");
+    unsigned long line;
+
+    if (input == NULL || (line = strtoul(input, NULL, 10)) == 0)
+        return;
+    if (s_currTextFile->viewed != NULL)
+    {
+        viewer_goto_line(s_currTextFile->viewed, line - 1);
+    }
+    else
+    {
+        s_textEditor->insert_position(s_currTextFile->textbuf->skip_lines(0, line - 1));
+        s_textEditor->show_insert_position();
+    }
 }
 
 static void menu_cb_line_numbers(Fl_Widget *, void *data)
@@ -489,9 +1008,9 @@ static void menu_cb_syntax_highlighting(Fl_Widget *, void *)
 {
     g_settings.syntaxHighlighting = !g_settings.syntaxHighlighting;
     if (g_settings.syntaxHighlighting)
-        colorize_update(s_textEditor, s_currTextFile->textbuf, s_currTextFile->stylebuf);
+        colorize_update(&s_currTextFile->colorizer, s_textEditor);
     else
-        colorize_clear(s_textEditor, s_currTextFile->stylebuf);
+        colorize_clear(&s_currTextFile->colorizer, s_textEditor);
 }
 
 static void menu_cb_gui_theme(Fl_Widget *, void *p)
@@ -521,18 +1040,24 @@ static Fl_Menu_Item s_menuItems[] =
     {"&File", 0, NULL, NULL, FL_SUBMENU},
         {"&New",    FL_COMMAND + 'n', menu_cb_new},
         {"&Open",   FL_COMMAND + 'o', menu_cb_open},
+        {"Open Read-Only...", 0,      menu_cb_open, (void *)1},
         {"&Save",   FL_COMMAND + 's', menu_cb_save},
         {"Save As", 0,                menu_cb_save_as},
-        {"Close",   FL_COMMAND + 'w', menu_cb_close, NULL, FL_MENU_DIVIDER},
+        {"Close",   FL_COMMAND + 'w', menu_cb_close},
+        {"Cancel Loading", 0,         menu_cb_cancel_load, NULL, FL_MENU_DIVIDER},
         {"Exit",  0,                menu_cb_exit},
         {0},
     {"&Edit", 0, NULL, NULL, FL_SUBMENU},
         {"Undo",  FL_COMMAND + 'z', menu_cb_undo},
-        {"Redo",  FL_COMMAND + 'y', menu_cb_redo, NULL, FL_MENU_DIVIDER},
+        {"Redo",  FL_COMMAND + 'y', menu_cb_redo},
+        {"Back a Minute",    0, menu_cb_time_travel, (void *)-60},
+        {"Forward a Minute", 0, menu_cb_time_travel, (void *)60, FL_MENU_DIVIDER},
         {"Cut",   FL_COMMAND + 'x', menu_cb_cut},
         {"Copy",  FL_COMMAND + 'c', menu_cb_copy},
         {"Paste", FL_COMMAND + 'v', menu_cb_paste, NULL, FL_MENU_DIVIDER},
         {"&Find", FL_COMMAND + 'f', menu_cb_find},
+        {"Find in Files...", FL_COMMAND + FL_SHIFT + 'f', menu_cb_find_in_files},
+        {"&Go to Line...", FL_COMMAND + 'g', menu_cb_goto_line},
         {0},
     {"&View", 0, NULL, NULL, FL_SUBMENU},
         {"Line Numbers",        0, menu_cb_line_numbers, &s_menuItems[12], FL_MENU_TOGGLE},
@@ -603,6 +1128,92 @@ static void cb_on_font_apply(void)
     s_textEditor->linenumber_size(g_settings.fontSize);
     colorize_update_font(g_settings.fontFace, g_settings.fontSize);
     s_textEditor->redraw();
+    s_fileViewer->redraw();
+}
+
+static void cb_on_find_all_done(void)
+{
+    s_textEditor->redraw();
+}
+
+// Goes to a search result, if its file is still open.
+// Returns the tab that has the file at 'filename' open, if any. Files are
+// compared by device and inode, so links and different spellings of the same
+// path find the same tab.
+static struct TextFile *find_open_file(const char *filename)
+{
+    struct TextFile *f;
+    struct stat st;
+    struct stat fileSt;
+
+    if (stat(filename, &st) != 0)
+        return NULL;
+    for (f = s_textFiles; f != NULL; f = f->next)
+    {
+        if (f->filename[0] != 0 && stat(f->filename, &fileSt) == 0
+         && fileSt.st_dev == st.st_dev && fileSt.st_ino == st.st_ino)
+            return f;
+    }
+    return NULL;
+}
+
+// Selects a search result in the current tab. 'start' and 'end' are offsets
+// into line 'lineNumber', which counts from 1, or into the whole text if it
+// is 0.
+static void show_result(struct TextFile *f, int lineNumber, int start, int end)
+{
+    if (lineNumber > 0)
+    {
+        int lineStart = f->textbuf->skip_lines(0, lineNumber - 1);
+
+        start += lineStart;
+        end += lineStart;
+    }
+
+    // The file may have changed since it was searched.
+    start = MIN(start, f->textbuf->length());
+    end = MIN(end, f->textbuf->length());
+    f->textbuf->highlight(start, end);
+    s_textEditor->insert_position(start);
+    s_textEditor->show_insert_position();
+}
+
+static void cb_on_result(unsigned int fileId, const char *filename, int lineNumber, int start, int end)
+{
+    struct TextFile *f = s_textFiles;
+
+    if (fileId == 0)
+    {
+        // It's in a file found on disk, which may be open already.
+        f = find_open_file(filename);
+        if (f == NULL)
+            f = open_text_file(filename, OPEN_NORMAL);
+        set_current_tab(f);
+        if (f->viewed != NULL)
+        {
+            viewer_goto_line(f->viewed, lineNumber - 1);
+        }
+        else if (f->loader != NULL)
+        {
+            // The line may not have been read yet, so go there once it has.
+            f->resultLine = lineNumber;
+            f->resultStart = start;
+            f->resultEnd = end;
+        }
+        else
+        {
+            show_result(f, lineNumber, start, end);
+        }
+    }
+    else
+    {
+        while (f != NULL && f->id != fileId)
+            f = f->next;
+        if (f == NULL)
+            return;
+        set_current_tab(f);
+        show_result(f, 0, start, end);
+    }
 }
 
 static Fl_Window *create_main_window(void)
@@ -614,11 +1225,20 @@ static Fl_Window *create_main_window(void)
 
         create_toolbar(s_toolbarBtns);
 
+        // Shown in the toolbar while the current file is still loading
+        s_loadProgress = new Fl_Progress(600-215, 20+6, 150, 20);
+        s_loadProgress->minimum(0);
+        s_loadProgress->maximum(100);
+        s_loadProgress->hide();
+        s_loadCancel = new Fl_Button(600-60, 20+4, 55, 24, "Cancel");
+        s_loadCancel->callback(menu_cb_cancel_load);
+        s_loadCancel->hide();
+
         s_tabBar = new Fl_Tabs(0, 20+TOOLBAR_HEIGHT, 600, 380-TOOLBAR_HEIGHT);
         s_tabBar->end();
         s_tabBar->callback(cb_tab_change);
 
-        s_textEditor = new Fl_Text_Editor(0+5, 40+5+TOOLBAR_HEIGHT, 600-10, 360-10-TOOLBAR_HEIGHT);
+        s_textEditor = new EditorWidget(0+5, 40+5+TOOLBAR_HEIGHT, 600-10, 360-10-TOOLBAR_HEIGHT);
         s_textEditor->textfont(g_settings.fontFace);
         s_textEditor->textsize(g_settings.fontSize);
         s_textEditor->linenumber_font(g_settings.fontFace);
@@ -627,7 +1247,11 @@ static Fl_Window *create_main_window(void)
 
         s_textEditor->remove_key_binding('z', FL_COMMAND);
 
-        find_dialog_init();
+        s_fileViewer = viewer_init(0+5, 40+5+TOOLBAR_HEIGHT, 600-10, 360-10-TOOLBAR_HEIGHT);
+
+        find_dialog_init(cb_on_find_all_done);
+        results_init(cb_on_result);
+        find_files_init();
         font_dialog_init(cb_on_font_apply);
     }
     w->end();
@@ -641,10 +1265,35 @@ static void set_current_tab(struct TextFile *f)
 {
     s_currTextFile = f;
     s_textEditor->buffer(f->textbuf);
+    viewer_show(f->viewed);
+    if (f->viewed != NULL)
+        s_textEditor->hide();
+    else
+        s_textEditor->show();
     s_mainWindow->label(f->title);
     s_tabBar->value(f->tab);
+    update_load_bar();
     if (g_settings.syntaxHighlighting)
-        colorize_update(s_textEditor, s_currTextFile->textbuf, s_currTextFile->stylebuf);
+        colorize_update(&s_currTextFile->colorizer, s_textEditor);
+}
+
+// Shows how far the current file has got if it's still loading, and keeps it
+// from being edited until it's all there.
+static void update_load_bar(void)
+{
+    if (s_currTextFile->loader != NULL)
+    {
+        s_loadProgress->value(100 * s_currTextFile->loadProgress);
+        s_loadProgress->show();
+        s_loadCancel->show();
+        s_textEditor->deactivate();
+    }
+    else
+    {
+        s_loadProgress->hide();
+        s_loadCancel->hide();
+        s_textEditor->activate();
+    }
 }
 
 static void apply_initial_settings(void)
@@ -654,7 +1303,7 @@ static void apply_initial_settings(void)
     // Line Numbers
     if (g_settings.lineNumbers)
     {
-        item = &s_menuItems[17];
+        item = &s_menuItems[23];
         assert(strcmp(item->text, "Line Numbers") == 0);
         item->set();
         s_textEditor->linenumber_width(50);
@@ -663,7 +1312,7 @@ static void apply_initial_settings(void)
     // Syntax Highlighting
     if (g_settings.syntaxHighlighting)
     {
-        item = &s_menuItems[19];
+        item = &s_menuItems[25];
         assert(strcmp(item->text, "Syntax Highlighting") == 0);
         item->set();
     }
@@ -671,7 +1320,7 @@ static void apply_initial_settings(void)
     // Theme
     if (g_settings.theme >= ARRAY_LENGTH(s_themeNames))
         g_settings.theme = 0;
-    item = &s_menuItems[20];
+    item = &s_menuItems[26];
     assert(strcmp(item->text, "GUI Theme") == 0);
     item[1 + g_settings.theme].set();
     Fl::scheme(s_themeNames[g_settings.theme]);
@@ -679,32 +1328,72 @@ static void apply_initial_settings(void)
     // Mark occurrences of double clicked word
     if (g_settings.markDoubleClickedWord)
     {
-        item = &s_menuItems[28];
+        item = &s_menuItems[34];
         assert(strcmp(item->text, "Mark occurrences of double clicked word") == 0);
         item->set();
     }
 }
 
+// Offers to bring back the unsaved text of a file from a session that crashed.
+static void cb_recover(const char *filename, const char *text)
+{
+    struct TextFile *f;
+
+    if (fl_choice("fledit did not exit cleanly last time.\n"
+                  "Do you want to recover the unsaved changes to '%s'?",
+                  "Discard", "Recover", NULL,
+                  filename[0] != 0 ? filename : "(untitled)") != 1)
+        return;
+
+    f = open_text_file(filename[0] != 0 ? filename : NULL, OPEN_EDITABLE);
+    set_current_tab(f);
+    // This can be undone in one step to get back what's on disk.
+    if (f->loader != NULL)
+    {
+        f->pendingText = strdup(text);
+    }
+    else
+    {
+        history_begin_group(&f->history);
+        f->textbuf->text(text);
+        history_end_group(&f->history);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    struct TextFile *initFile = NULL;
     int exitCode;
-    int i;
 
     settings_load();
 
+    // Enable Fl::awake() so the worker thread can hand results back.
+    Fl::lock();
+    worker_init();
+    recovery_init();
+
     s_mainWindow = create_main_window();
     s_mainWindow->show();
 
-    for (i = 1; i < argc; i++)
-        initFile = open_text_file(argv[i]);
-    if (initFile == NULL)
-        initFile = open_text_file(NULL);
-    set_current_tab(initFile);
+    if (argc > 1)
+    {
+        // The files are read in parallel and get their tabs as they're ready.
+        // Only the first has to be waited for, so that there's a current tab.
+        loader_read_files(argv + 1, argc - 1, ASYNC_LOAD_SIZE, cb_file_read, NULL);
+        while (s_currTextFile == NULL)
+            Fl::wait();
+    }
+    else
+    {
+        set_current_tab(open_text_file(NULL, OPEN_NORMAL));
+    }
 
     apply_initial_settings();
 
+    recovery_find(cb_recover);
+
     exitCode = Fl::run();
+    worker_shutdown();
+    recovery_shutdown();
     settings_save();
     puts("exited");
     return exitCode;
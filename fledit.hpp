@@ -2,6 +2,7 @@
 
 class Fl_Text_Buffer;
 class Fl_Text_Editor;
+class Fl_Widget;
 
 /* history.cpp */
 
@@ -9,17 +10,123 @@ struct HistoryCommand;
 
 struct History
 {
-    struct HistoryCommand *undoCmd;
-    struct HistoryCommand *redoCmd;
+    struct HistoryCommand *cmds;  // journal of edits, oldest first, with every branch
+    int cmdsBase;  // number of commands before 'cmds'
+    int cmdsStart;  // older commands have been evicted
+    int cmdsEnd;
+    int cmdsCapacity;
+    // State n is the text after the nth command, and state 0 the text before
+    // any. Each command is made in a parent state, so the states form a tree.
+    int current;  // the state the text is in
+    int root;  // the oldest state that can still be got back to
+    int rootRedo;  // the state redo goes to from the root
+    unsigned int rootTime;  // when the root state was made
+    char *text;  // arena holding the commands' text, in the same order
+    size_t textBase;  // arena offset of 'text'
+    size_t textEnd;  // arena offset just past the last command's text
+    size_t textCapacity;
+    int runLength;  // how many of 'runByte' the arena ends with
+    unsigned char runByte;
+    int groupDepth;  // how many groups are open
+    bool groupEmpty;  // nothing has been recorded in the open group yet
+    bool breakNext;  // the next edit may not be merged into the last command
+    char *journalPath;  // where the history is kept between sessions, or NULL
+    int journalFd;  // the journal, open and locked while 'journalPath' is set
+    int journalStates;  // how many states the journal had when the file was opened
+    int journalNext;  // the next state to go in the journal
+    bool journalLoaded;  // the journal's commands have been read back in
+    char *journalBuf;  // records waiting to be written
+    size_t journalLength;
+    size_t journalCapacity;
     Fl_Text_Buffer *textbuf;
 };
 
 void history_record_text_insert(struct History *h, unsigned int pos, unsigned int nInserted);
 void history_record_text_delete(struct History *h, unsigned int pos, unsigned int nDeleted);
+void history_begin_group(struct History *h);
+void history_end_group(struct History *h);
 void history_undo(struct History *h);
 void history_redo(struct History *h);
+unsigned int history_time(struct History *h);
+void history_goto_time(struct History *h, unsigned int when);
+void history_open_journal(struct History *h, const char *filename);
+void history_mark_journal(struct History *h, unsigned int hash);
+unsigned int history_hash_text(const char *text, size_t length);
 void history_free(struct History *h);
 
+/* worker.cpp */
+
+typedef void (*WorkerFunc)(void *data);
+typedef void (*ParallelFunc)(void *data, int i);
+
+void worker_init(void);
+void worker_shutdown(void);
+void worker_awake(WorkerFunc func, void *data);
+void worker_submit(WorkerFunc work, WorkerFunc done, void *data);
+int worker_cpu_count(void);
+void worker_parallel_for(int count, ParallelFunc func, void *data);
+
+/* loader.cpp */
+
+struct FileLoader;
+
+typedef void (*LoaderChunkFunc)(void *data, const char *text, double progress);
+typedef void (*LoaderDoneFunc)(void *data, int error);
+typedef void (*LoaderFileFunc)(void *data, int index, const char *filename, const char *text);
+
+struct FileLoader *loader_start(const char *filename, LoaderChunkFunc chunk, LoaderDoneFunc done, void *data);
+void loader_cancel(struct FileLoader *ld);
+void loader_read_files(const char *const *filenames, int count, size_t maxSize, LoaderFileFunc func, void *data);
+char *loader_read_file(const char *filename, size_t maxSize);
+
+/* viewer.cpp */
+
+// A file mapped read-only, with how many newlines come before each block
+struct MappedText
+{
+    const char *data;
+    size_t length;
+    size_t *lineIndex;  // newlines before each block
+    size_t numBlocks;
+    size_t indexedBlocks;  // how many of those are counted so far
+    size_t lineCount;  // counting a last one with no newline
+};
+
+struct IndexJob;
+
+// A file too big to edit, shown read-only straight from its mapping
+struct ViewedFile
+{
+    struct MappedText text;
+    size_t topLine;
+    size_t matchStart;  // the last match found, which is highlighted
+    size_t matchEnd;
+    size_t shownStart;  // the part of the file that was last drawn
+    size_t shownEnd;
+    struct IndexJob *indexJob;  // counting newlines on the worker, if set
+};
+
+Fl_Widget *viewer_init(int x, int y, int w, int h);
+bool viewer_open(struct ViewedFile *vf, const char *filename);
+void viewer_close(struct ViewedFile *vf);
+void viewer_show(struct ViewedFile *vf);
+void viewer_goto_line(struct ViewedFile *vf, size_t line);
+bool viewer_find(struct ViewedFile *vf, const char *text, bool forward, bool matchCase);
+
+/* recovery.cpp */
+
+struct RecoveryLog;
+
+typedef void (*RecoveryFunc)(const char *filename, const char *text);
+
+void recovery_init(void);
+void recovery_shutdown(void);
+void recovery_log_edit(struct RecoveryLog **logp, Fl_Text_Buffer *textbuf, const char *filename,
+    int pos, int nInserted, int nDeleted);
+void recovery_saved(struct RecoveryLog **logp, const char *filename, char *text, size_t length);
+void recovery_close(struct RecoveryLog **logp);
+void recovery_find(RecoveryFunc func);
+
 /* settings.cpp */
 
 struct Settings
@@ -30,6 +137,10 @@ struct Settings
     unsigned int theme;
     bool syntaxHighlighting;
     bool markDoubleClickedWord;
+    unsigned int undoBudgetKB;
+    bool persistentUndo;
+    bool crashRecovery;
+    unsigned int viewerThresholdMB;  // files this big are offered read-only
 };
 
 extern struct Settings g_settings;
@@ -42,14 +153,118 @@ void settings_save(void);
 void font_dialog_init(void (*applyCallback)(void));
 void font_dialog_open(void);
 
+/* regex.cpp */
+
+struct Regex;
+
+// Text to search, in up to two runs of memory, like the two sides of a text
+// buffer's gap
+struct RegexText
+{
+    const char *runs[2];
+    int lengths[2];
+};
+
+void textbuf_runs(Fl_Text_Buffer *textbuf, struct RegexText *text);
+struct Regex *regex_compile(const char *pattern, bool matchCase, const char **error);
+void regex_free(struct Regex *re);
+bool regex_search(struct Regex *re, const struct RegexText *text, int pos, int lastStart,
+    int *matchStart, int *matchEnd);
+bool regex_search_backward(struct Regex *re, const struct RegexText *text, int pos,
+    int *matchStart, int *matchEnd);
+int regex_max_length(const struct Regex *re);
+bool regex_matches_newline(const struct Regex *re);
+
+/* results.cpp */
+
+// Results' labels fit in this much
+#define RESULTS_LABEL_SIZE 1024
+
+// Files with more matches than this have the rest left out of the results
+#define RESULTS_MAX_PER_FILE 1000
+
+typedef void (*ResultsPickFunc)(unsigned int fileId, const char *filename, int lineNumber, int start, int end);
+
+void results_init(ResultsPickFunc pickCallback);
+unsigned int results_clear(void);
+void results_format(char *label, size_t size, const char *name, const char *text, int length, int lineNumber, int start);
+void results_add(unsigned int generation, const char *label, unsigned int fileId, const char *filename,
+    int lineNumber, int start, int end);
+void results_status(unsigned int generation, const char *text);
+
 /* find_dialog.cpp */
 
-void find_dialog_init(void);
-void find_dialog_show(Fl_Text_Buffer *textBuf);
+// A match found by Find All
+struct MatchRange
+{
+    int start;
+    int end;
+};
+
+struct Matcher;
+
+// An open file, for searching all of them at once
+struct OpenFile
+{
+    unsigned int id;  // handed back when one of its results is picked
+    const char *title;
+    Fl_Text_Buffer *textbuf;
+};
+
+void find_dialog_init(void (*matchesCallback)(void));
+void find_dialog_show(Fl_Text_Buffer *textBuf, struct History *history, struct ViewedFile *viewed,
+    const struct OpenFile *openFiles, int openCount);
+void find_dialog_text_modified(Fl_Text_Buffer *textBuf, int pos, int nInserted, int nDeleted);
+void find_dialog_forget(Fl_Text_Buffer *textBuf);
+const struct MatchRange *find_dialog_matches(Fl_Text_Buffer *textBuf, int start, int end, int *count);
+struct Matcher *find_dialog_new_matcher(const char *query, bool regex, int matchCase, const char **error);
+bool find_dialog_match(struct Matcher *m, const char *text, int length, int pos, int *start, int *end);
+void find_dialog_free_matcher(struct Matcher *m);
+
+/* find_files.cpp */
+
+void find_files_init(void);
+void find_files_show(void);
+
+/* grammar.cpp */
+
+// Every grammar's lexer starts out in this state
+#define GRAMMAR_INITIAL_STATE 0
+
+struct Grammar;
+
+const struct Grammar *grammar_for_file(const char *filename);
+unsigned char grammar_block_state(const struct Grammar *g);
+int grammar_highlight_line(const struct Grammar *g, const char *text, int length, char *style, unsigned char *lineState);
 
 /* colorize.cpp */
 
-Fl_Text_Buffer *colorize_init(Fl_Text_Buffer *textbuf);
-void colorize_update(Fl_Text_Editor *editor, Fl_Text_Buffer *textbuf, Fl_Text_Buffer *stylebuf);
-void colorize_clear(Fl_Text_Editor *editor, Fl_Text_Buffer *stylebuf);
+struct LineState;
+struct HighlightJob;
+
+struct Colorizer
+{
+    Fl_Text_Buffer *textbuf;
+    Fl_Text_Buffer *stylebuf;
+    const struct Grammar *grammar;
+    Fl_Text_Editor *editor;  // the editor showing it, if any
+    struct LineState *lines;  // lexer state at the start of each line, as a gap array
+    int linesCapacity;
+    int gapStart;
+    int gapEnd;
+    int lexedEnd;  // text before this has been highlighted
+    bool upToDate;
+    unsigned int generation;  // changes whenever highlighting starts over
+    int editedFrom;  // lowest position edited since the pending job copied its text
+    struct HighlightJob *pendingJob;
+};
+
+void colorize_init(struct Colorizer *c, Fl_Text_Buffer *textbuf, const char *filename);
+void colorize_free(struct Colorizer *c);
+void colorize_set_filename(struct Colorizer *c, const char *filename);
+void colorize_invalidate(struct Colorizer *c);
+void colorize_update(struct Colorizer *c, Fl_Text_Editor *editor);
+void colorize_update_range(struct Colorizer *c, Fl_Text_Editor *editor,
+    int pos, int nInserted, int nDeleted);
+void colorize_clear(struct Colorizer *c, Fl_Text_Editor *editor);
 void colorize_update_font(Fl_Font font, int size);
@@ -0,0 +1,713 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <FL/filename.H>
+
+#include "fledit.hpp"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// The most bytes find_any() can search for at once
+#define MAX_FIND_SET 8
+
+// Rule flags
+#define RULE_RESTYLE_PREV 1  // the byte before gets the same style, for tokens like "/*"
+#define RULE_LIKE         2  // the bytes behave as they do in state 'next', which must come earlier
+
+// Each language is described by the states its lexer can be in and rules for
+// how each byte moves it between them. These get compiled into a table with
+// an entry for every state and byte.
+struct GrammarStateDef
+{
+    char style;  // the style of bytes with no rule of their own
+    bool code;   // whether keywords are recognized here
+};
+
+struct GrammarRule
+{
+    unsigned char state;
+    const char *bytes;  // the bytes it applies to, or NULL for every byte not already matched
+    unsigned char next;
+    char style;  // the style of the byte, or 0 for the state's style
+    unsigned char flags;
+};
+
+struct GrammarTransition
+{
+    unsigned char next;
+    char style;
+    unsigned char flags;
+};
+
+struct GrammarState
+{
+    char style;
+    bool code;
+    int numStops;  // how many bytes may leave the state, or 0 if too many to search for
+    char stops[MAX_FIND_SET];
+};
+
+// A set of keywords looked up through a perfect hash, so recognizing a word
+// takes one hash of it and at most one comparison.
+struct KeywordSet
+{
+    const char *const *words;
+    unsigned int count;
+    unsigned int maxLength;
+    unsigned int seed;
+    unsigned int bits;
+    short *slots;  // index into 'words', or -1
+};
+
+struct Grammar
+{
+    const char *name;
+    const char *pattern;  // file names it is used for, as an fl_filename_match() pattern
+    const struct GrammarStateDef *stateDefs;
+    int numStates;
+    const struct GrammarRule *rules;
+    int numRules;
+    struct KeywordSet keywords;
+    unsigned char blockState;  // see grammar_block_state()
+
+    // compiled
+    struct GrammarState *states;
+    struct GrammarTransition *transitions;  // indexed by state * 256 + byte
+};
+
+// Classes of each byte
+#define CHAR_WORD 1
+
+static unsigned char s_charClass[256];
+
+/* C and C++ */
+
+static const char *const s_cKeywords[] = {
+    "asm",
+    "break",
+    "case",
+    "const",
+    "continue",
+    "default",
+    "do",
+    "else",
+    "extern",
+    "false",
+    "for",
+    "goto",
+    "if",
+    "return",
+    "static",
+    "struct",
+    "switch",
+    "true",
+    "typedef",
+    "union",
+    "volatile",
+    "while",
+};
+
+// A '#' only starts a preprocessor directive on a line that has had nothing but
+// whitespace, comments, strings and character constants before it, so those
+// states come in two kinds. A block comment keeps the kind through newlines,
+// since the preprocessor sees it as a single space.
+enum
+{
+    C_NORMAL_CLEAN,
+    C_NORMAL,
+    C_SLASH,  // just after a slash, which may start a comment
+    C_SLASH_CLEAN,
+    C_BLOCK_COMMENT,
+    C_BLOCK_COMMENT_STAR,  // just after a '*' in a block comment
+    C_BLOCK_COMMENT_CLEAN,
+    C_BLOCK_COMMENT_CLEAN_STAR,
+    C_LINE_COMMENT,
+    C_STRING,
+    C_STRING_ESCAPE,
+    C_CHAR,
+    C_CHAR_ESCAPE,
+    C_STRING_CLEAN,
+    C_STRING_CLEAN_ESCAPE,
+    C_CHAR_CLEAN,
+    C_CHAR_CLEAN_ESCAPE,
+    C_PREPROC_DIRECTIVE,
+};
+
+static const struct GrammarStateDef s_cStates[] = {
+    {'A', true},   // C_NORMAL_CLEAN
+    {'A', true},   // C_NORMAL
+    {'A', true},   // C_SLASH
+    {'A', true},   // C_SLASH_CLEAN
+    {'B', false},  // C_BLOCK_COMMENT
+    {'B', false},  // C_BLOCK_COMMENT_STAR
+    {'B', false},  // C_BLOCK_COMMENT_CLEAN
+    {'B', false},  // C_BLOCK_COMMENT_CLEAN_STAR
+    {'B', false},  // C_LINE_COMMENT
+    {'C', false},  // C_STRING
+    {'C', false},  // C_STRING_ESCAPE
+    {'C', false},  // C_CHAR
+    {'C', false},  // C_CHAR_ESCAPE
+    {'C', false},  // C_STRING_CLEAN
+    {'C', false},  // C_STRING_CLEAN_ESCAPE
+    {'C', false},  // C_CHAR_CLEAN
+    {'C', false},  // C_CHAR_CLEAN_ESCAPE
+    {'E', false},  // C_PREPROC_DIRECTIVE
+};
+
+static const struct GrammarRule s_cRules[] = {
+    {C_NORMAL_CLEAN,        " \t\n\v\f\r", C_NORMAL_CLEAN},
+    {C_NORMAL_CLEAN,        "#",  C_PREPROC_DIRECTIVE, 'E'},
+    {C_NORMAL_CLEAN,        "\"", C_STRING_CLEAN, 'C'},
+    {C_NORMAL_CLEAN,        "'",  C_CHAR_CLEAN, 'C'},
+    {C_NORMAL_CLEAN,        "/",  C_SLASH_CLEAN},
+    {C_NORMAL_CLEAN,        NULL, C_NORMAL},
+    {C_NORMAL,              "\n", C_NORMAL_CLEAN},
+    {C_NORMAL,              "\"", C_STRING, 'C'},
+    {C_NORMAL,              "'",  C_CHAR, 'C'},
+    {C_NORMAL,              "/",  C_SLASH},
+    {C_SLASH,               "*",  C_BLOCK_COMMENT, 'B', RULE_RESTYLE_PREV},
+    {C_SLASH,               "/",  C_LINE_COMMENT, 'B', RULE_RESTYLE_PREV},
+    {C_SLASH,               NULL, C_NORMAL, 0, RULE_LIKE},
+    {C_SLASH_CLEAN,         "*",  C_BLOCK_COMMENT_CLEAN, 'B', RULE_RESTYLE_PREV},
+    {C_SLASH_CLEAN,         "/",  C_LINE_COMMENT, 'B', RULE_RESTYLE_PREV},
+    {C_SLASH_CLEAN,         NULL, C_NORMAL, 0, RULE_LIKE},
+    {C_BLOCK_COMMENT,       "*",  C_BLOCK_COMMENT_STAR},
+    {C_BLOCK_COMMENT_STAR,  "/",  C_NORMAL, 'B'},
+    {C_BLOCK_COMMENT_STAR,  "*",  C_BLOCK_COMMENT_STAR},
+    {C_BLOCK_COMMENT_STAR,  NULL, C_BLOCK_COMMENT},
+    {C_BLOCK_COMMENT_CLEAN, "*",  C_BLOCK_COMMENT_CLEAN_STAR},
+    {C_BLOCK_COMMENT_CLEAN_STAR, "/", C_NORMAL_CLEAN, 'B'},
+    {C_BLOCK_COMMENT_CLEAN_STAR, "*", C_BLOCK_COMMENT_CLEAN_STAR},
+    {C_BLOCK_COMMENT_CLEAN_STAR, NULL, C_BLOCK_COMMENT_CLEAN},
+    {C_LINE_COMMENT,        "\n", C_NORMAL_CLEAN},
+    {C_STRING,              "\"", C_NORMAL},
+    {C_STRING,              "\\", C_STRING_ESCAPE},
+    {C_STRING_ESCAPE,       NULL, C_STRING},
+    {C_CHAR,                "'",  C_NORMAL},
+    {C_CHAR,                "\\", C_CHAR_ESCAPE},
+    {C_CHAR_ESCAPE,         NULL, C_CHAR},
+    {C_STRING_CLEAN,        "\"", C_NORMAL_CLEAN},
+    {C_STRING_CLEAN,        "\\", C_STRING_CLEAN_ESCAPE},
+    {C_STRING_CLEAN_ESCAPE, NULL, C_STRING_CLEAN},
+    {C_CHAR_CLEAN,          "'",  C_NORMAL_CLEAN},
+    {C_CHAR_CLEAN,          "\\", C_CHAR_CLEAN_ESCAPE},
+    {C_CHAR_CLEAN_ESCAPE,   NULL, C_CHAR_CLEAN},
+    {C_PREPROC_DIRECTIVE,   "\n", C_NORMAL_CLEAN},
+};
+
+/* Python */
+
+static const char *const s_pythonKeywords[] = {
+    "False",
+    "None",
+    "True",
+    "and",
+    "as",
+    "assert",
+    "async",
+    "await",
+    "break",
+    "class",
+    "continue",
+    "def",
+    "del",
+    "elif",
+    "else",
+    "except",
+    "finally",
+    "for",
+    "from",
+    "global",
+    "if",
+    "import",
+    "in",
+    "is",
+    "lambda",
+    "nonlocal",
+    "not",
+    "or",
+    "pass",
+    "raise",
+    "return",
+    "try",
+    "while",
+    "with",
+    "yield",
+};
+
+// Opening quotes are counted to tell "", which is an empty string, from """,
+// which starts a string that may span lines. Closing quotes are counted the
+// same way.
+enum
+{
+    PY_NORMAL,
+    PY_COMMENT,
+    PY_DQ_OPEN1,
+    PY_DQ_OPEN2,
+    PY_DQ_STRING,
+    PY_DQ_ESCAPE,
+    PY_DQ_LONG,
+    PY_DQ_LONG_CLOSE1,
+    PY_DQ_LONG_CLOSE2,
+    PY_DQ_LONG_ESCAPE,
+    PY_SQ_OPEN1,
+    PY_SQ_OPEN2,
+    PY_SQ_STRING,
+    PY_SQ_ESCAPE,
+    PY_SQ_LONG,
+    PY_SQ_LONG_CLOSE1,
+    PY_SQ_LONG_CLOSE2,
+    PY_SQ_LONG_ESCAPE,
+};
+
+static const struct GrammarStateDef s_pythonStates[] = {
+    {'A', true},   // PY_NORMAL
+    {'B', false},  // PY_COMMENT
+    {'C', false},  // PY_DQ_OPEN1
+    {'A', false},  // PY_DQ_OPEN2
+    {'C', false},  // PY_DQ_STRING
+    {'C', false},  // PY_DQ_ESCAPE
+    {'C', false},  // PY_DQ_LONG
+    {'C', false},  // PY_DQ_LONG_CLOSE1
+    {'C', false},  // PY_DQ_LONG_CLOSE2
+    {'C', false},  // PY_DQ_LONG_ESCAPE
+    {'C', false},  // PY_SQ_OPEN1
+    {'A', false},  // PY_SQ_OPEN2
+    {'C', false},  // PY_SQ_STRING
+    {'C', false},  // PY_SQ_ESCAPE
+    {'C', false},  // PY_SQ_LONG
+    {'C', false},  // PY_SQ_LONG_CLOSE1
+    {'C', false},  // PY_SQ_LONG_CLOSE2
+    {'C', false},  // PY_SQ_LONG_ESCAPE
+};
+
+static const struct GrammarRule s_pythonRules[] = {
+    {PY_NORMAL,         "#",  PY_COMMENT, 'B'},
+    {PY_NORMAL,         "\"", PY_DQ_OPEN1, 'C'},
+    {PY_NORMAL,         "'",  PY_SQ_OPEN1, 'C'},
+    {PY_COMMENT,        "\n", PY_NORMAL},
+    {PY_DQ_OPEN1,       "\"", PY_DQ_OPEN2},
+    {PY_DQ_OPEN1,       "\\", PY_DQ_ESCAPE},
+    {PY_DQ_OPEN1,       "\n", PY_NORMAL},
+    {PY_DQ_OPEN1,       NULL, PY_DQ_STRING},
+    {PY_DQ_OPEN2,       "\"", PY_DQ_LONG, 'C'},
+    {PY_DQ_OPEN2,       NULL, PY_NORMAL, 0, RULE_LIKE},
+    {PY_DQ_STRING,      "\"", PY_NORMAL},
+    {PY_DQ_STRING,      "\\", PY_DQ_ESCAPE},
+    {PY_DQ_STRING,      "\n", PY_NORMAL},
+    {PY_DQ_ESCAPE,      NULL, PY_DQ_STRING},
+    {PY_DQ_LONG,        "\"", PY_DQ_LONG_CLOSE1},
+    {PY_DQ_LONG,        "\\", PY_DQ_LONG_ESCAPE},
+    {PY_DQ_LONG_CLOSE1, "\"", PY_DQ_LONG_CLOSE2},
+    {PY_DQ_LONG_CLOSE1, "\\", PY_DQ_LONG_ESCAPE},
+    {PY_DQ_LONG_CLOSE1, NULL, PY_DQ_LONG},
+    {PY_DQ_LONG_CLOSE2, "\"", PY_NORMAL},
+    {PY_DQ_LONG_CLOSE2, "\\", PY_DQ_LONG_ESCAPE},
+    {PY_DQ_LONG_CLOSE2, NULL, PY_DQ_LONG},
+    {PY_DQ_LONG_ESCAPE, NULL, PY_DQ_LONG},
+    {PY_SQ_OPEN1,       "'",  PY_SQ_OPEN2},
+    {PY_SQ_OPEN1,       "\\", PY_SQ_ESCAPE},
+    {PY_SQ_OPEN1,       "\n", PY_NORMAL},
+    {PY_SQ_OPEN1,       NULL, PY_SQ_STRING},
+    {PY_SQ_OPEN2,       "'",  PY_SQ_LONG, 'C'},
+    {PY_SQ_OPEN2,       NULL, PY_NORMAL, 0, RULE_LIKE},
+    {PY_SQ_STRING,      "'",  PY_NORMAL},
+    {PY_SQ_STRING,      "\\", PY_SQ_ESCAPE},
+    {PY_SQ_STRING,      "\n", PY_NORMAL},
+    {PY_SQ_ESCAPE,      NULL, PY_SQ_STRING},
+    {PY_SQ_LONG,        "'",  PY_SQ_LONG_CLOSE1},
+    {PY_SQ_LONG,        "\\", PY_SQ_LONG_ESCAPE},
+    {PY_SQ_LONG_CLOSE1, "'",  PY_SQ_LONG_CLOSE2},
+    {PY_SQ_LONG_CLOSE1, "\\", PY_SQ_LONG_ESCAPE},
+    {PY_SQ_LONG_CLOSE1, NULL, PY_SQ_LONG},
+    {PY_SQ_LONG_CLOSE2, "'",  PY_NORMAL},
+    {PY_SQ_LONG_CLOSE2, "\\", PY_SQ_LONG_ESCAPE},
+    {PY_SQ_LONG_CLOSE2, NULL, PY_SQ_LONG},
+    {PY_SQ_LONG_ESCAPE, NULL, PY_SQ_LONG},
+};
+
+/* Makefiles */
+
+static const char *const s_makeKeywords[] = {
+    "define",
+    "else",
+    "endef",
+    "endif",
+    "export",
+    "ifdef",
+    "ifeq",
+    "ifndef",
+    "ifneq",
+    "include",
+    "override",
+    "sinclude",
+    "unexport",
+    "vpath",
+};
+
+enum
+{
+    MAKE_NORMAL,
+    MAKE_COMMENT,
+    MAKE_DOLLAR,  // just after a '$', which may start a variable reference
+    MAKE_VARIABLE_PAREN,
+    MAKE_VARIABLE_BRACE,
+};
+
+static const struct GrammarStateDef s_makeStates[] = {
+    {'A', true},   // MAKE_NORMAL
+    {'B', false},  // MAKE_COMMENT
+    {'A', true},   // MAKE_DOLLAR
+    {'E', false},  // MAKE_VARIABLE_PAREN
+    {'E', false},  // MAKE_VARIABLE_BRACE
+};
+
+static const struct GrammarRule s_makeRules[] = {
+    {MAKE_NORMAL,         "#",  MAKE_COMMENT, 'B'},
+    {MAKE_NORMAL,         "$",  MAKE_DOLLAR},
+    {MAKE_COMMENT,        "\n", MAKE_NORMAL},
+    {MAKE_DOLLAR,         "(",  MAKE_VARIABLE_PAREN, 'E', RULE_RESTYLE_PREV},
+    {MAKE_DOLLAR,         "{",  MAKE_VARIABLE_BRACE, 'E', RULE_RESTYLE_PREV},
+    {MAKE_DOLLAR,         NULL, MAKE_NORMAL, 0, RULE_LIKE},
+    {MAKE_VARIABLE_PAREN, ")\n", MAKE_NORMAL},
+    {MAKE_VARIABLE_BRACE, "}\n", MAKE_NORMAL},
+};
+
+/* Plain text */
+
+static const struct GrammarStateDef s_plainStates[] = {
+    {'A', false},
+};
+
+#define GRAMMAR(name, pattern, prefix, blockState) \
+    {name, pattern, prefix##States, ARRAY_LENGTH(prefix##States), prefix##Rules, ARRAY_LENGTH(prefix##Rules), \
+    {prefix##Keywords, ARRAY_LENGTH(prefix##Keywords)}, blockState}
+
+static struct Grammar s_grammars[] = {
+    GRAMMAR("C", "*.{c,C,cc,cpp,cxx,c++,h,H,hh,hpp,hxx,h++,inl}", s_c, C_BLOCK_COMMENT_CLEAN),
+    GRAMMAR("Python", "*.{py,pyw}", s_python, PY_DQ_LONG),
+    GRAMMAR("Makefile", "{Makefile,makefile,GNUmakefile,*.mk}", s_make, MAKE_NORMAL),
+};
+
+static struct Grammar s_plainGrammar = {"Plain text", NULL, s_plainStates, ARRAY_LENGTH(s_plainStates)};
+
+static bool s_compiled = false;
+
+static unsigned int keyword_hash(const struct KeywordSet *set, const char *word, unsigned int length)
+{
+    unsigned int h = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < length; i++)
+        h = (h ^ (unsigned char)word[i]) * 16777619u;
+    return (h * set->seed) >> (32 - set->bits);
+}
+
+// Searches for a seed that hashes every keyword to its own slot. C++98 can't do
+// this at compile time, so it is done once, before the first file is lexed.
+static void keyword_set_build(struct KeywordSet *set)
+{
+    unsigned int seed = 1;
+    unsigned int i;
+
+    set->maxLength = 0;
+    for (i = 0; i < set->count; i++)
+        set->maxLength = MAX(set->maxLength, strlen(set->words[i]));
+
+    set->bits = 2;
+    while ((1u << set->bits) < set->count * 2)
+        set->bits++;
+    while (1)
+    {
+        unsigned int size = 1u << set->bits;
+        int tries;
+
+        set->slots = (short *)realloc(set->slots, size * sizeof(*set->slots));
+        for (tries = 0; tries < 1000; tries++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            set->seed = seed | 1;
+            memset(set->slots, -1, size * sizeof(*set->slots));
+            for (i = 0; i < set->count; i++)
+            {
+                unsigned int h = keyword_hash(set, set->words[i], strlen(set->words[i]));
+
+                if (set->slots[h] != -1)
+                    break;
+                set->slots[h] = i;
+            }
+            if (i == set->count)
+                return;
+        }
+        set->bits++;
+    }
+}
+
+static bool keyword_set_contains(const struct KeywordSet *set, const char *word, unsigned int length)
+{
+    int i;
+
+    if (length > set->maxLength)
+        return false;
+    i = set->slots[keyword_hash(set, word, length)];
+    return (i != -1 && strncmp(set->words[i], word, length) == 0 && set->words[i][length] == 0);
+}
+
+// Builds the transition table from the rules. For each state, the first rule
+// that mentions a byte decides what it does, and bytes no rule mentions leave
+// the state alone.
+static void grammar_compile(struct Grammar *g)
+{
+    int s;
+    int b;
+    int i;
+
+    g->states = new GrammarState[g->numStates];
+    g->transitions = new GrammarTransition[g->numStates * 256];
+    for (s = 0; s < g->numStates; s++)
+    {
+        const struct GrammarStateDef *def = &g->stateDefs[s];
+        struct GrammarState *state = &g->states[s];
+        struct GrammarTransition *row = &g->transitions[s * 256];
+        bool matched[256];
+        int numStops = 0;
+
+        memset(matched, 0, sizeof(matched));
+        for (i = 0; i < g->numRules; i++)
+        {
+            const struct GrammarRule *rule = &g->rules[i];
+
+            if (rule->state != s)
+                continue;
+            assert(!(rule->flags & RULE_LIKE) || rule->next < s);
+            for (b = 0; b < 256; b++)
+            {
+                if (matched[b] || (rule->bytes != NULL && (b == 0 || strchr(rule->bytes, b) == NULL)))
+                    continue;
+                if (rule->flags & RULE_LIKE)
+                {
+                    row[b] = g->transitions[rule->next * 256 + b];
+                }
+                else
+                {
+                    row[b].next = rule->next;
+                    row[b].style = (rule->style != 0) ? rule->style : def->style;
+                    row[b].flags = rule->flags;
+                }
+                matched[b] = true;
+            }
+        }
+
+        // Remember which bytes can do anything but continue the state, so runs
+        // of the others can be searched past. Newlines always end the line.
+        state->style = def->style;
+        state->code = def->code;
+        for (b = 0; b < 256; b++)
+        {
+            if (!matched[b])
+            {
+                row[b].next = s;
+                row[b].style = def->style;
+                row[b].flags = 0;
+            }
+            if (b == '\n' || row[b].next != s || row[b].style != def->style || row[b].flags != 0)
+            {
+                if (numStops < MAX_FIND_SET)
+                    state->stops[numStops] = b;
+                numStops++;
+            }
+        }
+        state->numStops = (numStops <= MAX_FIND_SET) ? numStops : 0;
+    }
+    keyword_set_build(&g->keywords);
+}
+
+static void compile_grammars(void)
+{
+    unsigned int i;
+    int c;
+
+    for (c = 0; c < 256; c++)
+        s_charClass[c] = (isalnum(c) || c == '_') ? CHAR_WORD : 0;
+    for (i = 0; i < ARRAY_LENGTH(s_grammars); i++)
+        grammar_compile(&s_grammars[i]);
+    grammar_compile(&s_plainGrammar);
+    s_compiled = true;
+}
+
+// Returns the grammar to highlight a file with, going by its name. Files that
+// haven't been named yet are taken to be C.
+const struct Grammar *grammar_for_file(const char *filename)
+{
+    const char *name;
+    unsigned int i;
+
+    if (!s_compiled)
+        compile_grammars();
+    if (filename == NULL || filename[0] == 0)
+        return &s_grammars[0];
+    name = fl_filename_name(filename);
+    for (i = 0; i < ARRAY_LENGTH(s_grammars); i++)
+    {
+        if (fl_filename_match(name, s_grammars[i].pattern))
+            return &s_grammars[i];
+    }
+    return &s_plainGrammar;
+}
+
+// Returns the state besides GRAMMAR_INITIAL_STATE that a line is most likely to
+// start in, such as inside a block comment, or GRAMMAR_INITIAL_STATE if there
+// is none.
+unsigned char grammar_block_state(const struct Grammar *g)
+{
+    return g->blockState;
+}
+
+// Returns the position of the first byte in text[pos, end) that is one of the
+// 'count' bytes in 'set', or 'end' if there is none.
+static int find_any(const char *text, int pos, int end, const char *set, int count)
+{
+    int i;
+
+#if defined(__AVX2__)
+    __m256i needles[MAX_FIND_SET];
+
+    for (i = 0; i < count; i++)
+        needles[i] = _mm256_set1_epi8(set[i]);
+    while (pos + 32 <= end)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + pos));
+        __m256i match = _mm256_cmpeq_epi8(chunk, needles[0]);
+        unsigned int mask;
+
+        for (i = 1; i < count; i++)
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, needles[i]));
+        mask = _mm256_movemask_epi8(match);
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 32;
+    }
+#elif defined(__SSE2__)
+    __m128i needles[MAX_FIND_SET];
+
+    for (i = 0; i < count; i++)
+        needles[i] = _mm_set1_epi8(set[i]);
+    while (pos + 16 <= end)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(text + pos));
+        __m128i match = _mm_cmpeq_epi8(chunk, needles[0]);
+        unsigned int mask;
+
+        for (i = 1; i < count; i++)
+            match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, needles[i]));
+        mask = _mm_movemask_epi8(match);
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif
+    for (; pos < end; pos++)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (text[pos] == set[i])
+                return pos;
+        }
+    }
+    return end;
+}
+
+// Ends the word from 'wordStart' to 'pos', styling it if it is a keyword.
+static void end_word(const struct Grammar *g, const char *text, char *style, int wordStart, int pos)
+{
+    if (keyword_set_contains(&g->keywords, text + wordStart, pos - wordStart))
+        memset(style + wordStart, 'D', pos - wordStart);
+}
+
+// Highlights one line of 'text', which has 'length' bytes left in it, starting
+// in the state '*lineState'. Returns the length of the line, including its
+// newline, and leaves the state the next line starts in in '*lineState'. A word
+// still going at the very end of the text is not checked for being a keyword.
+int grammar_highlight_line(const struct Grammar *g, const char *text, int length, char *style, unsigned char *lineState)
+{
+    unsigned char state = *lineState;
+    int wordStart = -1;
+    int pos;
+
+    for (pos = 0; pos < length; pos++)
+    {
+        const struct GrammarState *s = &g->states[state];
+        const struct GrammarTransition *t;
+        unsigned char c;
+
+        // Bytes that leave the state as it is are skipped over in bulk, though
+        // in code they still need looking at one by one for keywords.
+        if (s->numStops > 0)
+        {
+            int end = find_any(text, pos, length, s->stops, s->numStops);
+
+            if (end > pos)
+            {
+                memset(style + pos, s->style, end - pos);
+                if (s->code)
+                {
+                    for (; pos < end; pos++)
+                    {
+                        if (s_charClass[(unsigned char)text[pos]] & CHAR_WORD)
+                        {
+                            if (wordStart == -1)
+                                wordStart = pos;
+                        }
+                        else if (wordStart != -1)
+                        {
+                            end_word(g, text, style, wordStart, pos);
+                            wordStart = -1;
+                        }
+                    }
+                }
+                pos = end;
+                if (pos == length)
+                    break;
+            }
+        }
+
+        c = text[pos];
+        t = &g->transitions[state * 256 + c];
+        style[pos] = t->style;
+        if ((t->flags & RULE_RESTYLE_PREV) && pos > 0)
+            style[pos - 1] = t->style;
+
+        // Words are only looked at while in code, and end at the first byte
+        // that isn't part of one, unless that byte leaves the code.
+        if (!g->states[t->next].code)
+        {
+            wordStart = -1;
+        }
+        else if (s_charClass[c] & CHAR_WORD)
+        {
+            if (wordStart == -1)
+                wordStart = pos;
+        }
+        else if (wordStart != -1)
+        {
+            end_word(g, text, style, wordStart, pos);
+            wordStart = -1;
+        }
+
+        state = t->next;
+        if (c == '\n')
+        {
+            pos++;
+            break;
+        }
+    }
+
+    *lineState = state;
+    return pos;
+}
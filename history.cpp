@@ -1,174 +1,1047 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <FL/Fl.H>
 #include <FL/Fl_Text_Buffer.H>
+#include <FL/filename.H>
 
 #include "fledit.hpp"
 
-enum HistoryCommandAction {ACTION_ADD, ACTION_DELETE};
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// Runs of a repeated byte, such as indentation, are kept in the arena as
+// RUN_MARK, a count, and the byte. RUN_MARK never appears in UTF-8 text, and
+// if it turns up anyway it's kept as a run of one.
+#define RUN_MARK 0xFF
+#define RUN_MIN 4  // shorter runs are kept as they are
+#define RUN_MAX 255
+
+#define JOURNAL_MAGIC "fledit undo journal 1\n"
+#define JOURNAL_BATCH_SIZE 4096  // records are handed to the worker once this much is waiting
+#define JOURNAL_MAX_PROBES 4  // how many names to try when another file's journal has the first
+
+enum HistoryCommandAction {ACTION_ADD, ACTION_DELETE, ACTION_BACKSPACE};
+enum JournalRecordType {RECORD_CMD, RECORD_MARK};
+
+// A command's text is kept in the history's text arena, right after the text of
+// the command before it. Backspacing grows a deletion at the front, so the text
+// of a run of backspaces is kept backwards, letting it grow at the end instead.
+// Commands are never dropped when something is undone, so every branch stays.
 struct HistoryCommand
 {
-    struct HistoryCommand *prev;
-    struct HistoryCommand *next;
-    enum HistoryCommandAction action;
+    unsigned char action;
+    bool joined;  // undone and redone together with its parent
+    bool onPath;  // it's between the root and the current state
     unsigned int pos;
-    char *text;
+    unsigned int length;
+    int parent;  // the state it was made in
+    int redoChild;  // the state redo goes to from the one it makes, or 0
+    unsigned int time;  // when it was last changed, in seconds since the epoch
+    size_t offset;  // where its text starts in the arena
+};
+
+// One move along the tree: from 'state' to its parent when undoing, and from
+// the parent to 'state' otherwise.
+struct HistoryStep
+{
+    int state;
+    bool undo;
+};
+
+// A file's journal is named after a hash of its absolute path, and starts with
+// JOURNAL_MAGIC and the path itself, nul terminated. It is kept locked while
+// the file is open, so no two tabs or instances write to the same one. Then there's a record for every command, in the order they
+// were made, so the nth one makes state n, and a mark whenever the file is
+// saved saying which state its text is in.
+struct JournalRecord
+{
+    unsigned char type;
+    unsigned char action;
+    bool joined;
+    unsigned char unused;
+    unsigned int time;
+    int state;  // the state a command was made in, or the one a mark is for
+    unsigned int pos;
+    unsigned int length;
+    unsigned int size;  // how many bytes of arena text follow a command
+    unsigned int hash;  // hash of the text a mark is for
+};
+
+// Records to be added to a journal by the worker thread
+struct JournalWrite
+{
+    int fd;
+    char *data;
+    size_t length;
+    bool create;  // start the journal over
+    bool close;  // close it afterwards, which unlocks it
 };
 
-// Adds a new command to the current point in history, deleting the old redo path.
-static struct HistoryCommand *history_new_cmd(struct History *h)
+static void reverse_text(char *text, unsigned int length)
 {
-    struct HistoryCommand *cmd = new struct HistoryCommand;
-    cmd->prev = NULL;
-    cmd->next = NULL;
+    unsigned int i;
 
-    // Delete the old redo path
-    struct HistoryCommand *redo = h->redoCmd;
-    while (redo != NULL)
+    for (i = 0; i < length / 2; i++)
     {
-        struct HistoryCommand *next = redo->next;
-        free(redo->text);
-        delete redo;
-        redo = next;
+        char c = text[i];
+
+        text[i] = text[length - 1 - i];
+        text[length - 1 - i] = c;
     }
+}
 
-    // Append the new command to the end of the list as the current undo command.
-    if (h->undoCmd != NULL)
+// Returns the command that makes 'state'.
+static struct HistoryCommand *history_cmd(struct History *h, int state)
+{
+    return &h->cmds[state - 1 - h->cmdsBase];
+}
+
+// Returns whether the command that makes 'state' hasn't been evicted.
+static bool history_alive(struct History *h, int state)
+{
+    return state > h->cmdsStart && state <= h->cmdsEnd;
+}
+
+// Returns whether 'state' can be got to from the root. Evicting a command cuts
+// off any branch that grew from it, unless the current state is on it.
+static bool history_reachable(struct History *h, int state)
+{
+    while (state != h->root)
     {
-        h->undoCmd->next = cmd;
-        cmd->prev = h->undoCmd;
+        if (!history_alive(h, state))
+            return false;
+        state = history_cmd(h, state)->parent;
     }
-    h->undoCmd = cmd;
-    h->redoCmd = cmd->next;
-    return cmd;
+    return true;
 }
 
-void history_record_text_insert(struct History *h, unsigned int pos, unsigned int nInserted)
+// Returns where the state redo goes to from 'state' is kept.
+static int *history_redo_slot(struct History *h, int state)
+{
+    return (state == h->root) ? &h->rootRedo : &history_cmd(h, state)->redoChild;
+}
+
+static size_t history_text_start(struct History *h)
+{
+    return (h->cmdsStart < h->cmdsEnd) ? history_cmd(h, h->cmdsStart + 1)->offset : h->textEnd;
+}
+
+// Returns where the text of the command that makes 'state' ends in the arena.
+static size_t history_text_end(struct History *h, int state)
 {
-    struct HistoryCommand *cmd = h->undoCmd;
-    char *newText = h->textbuf->text_range(pos, pos + nInserted);
+    return (state < h->cmdsEnd) ? history_cmd(h, state + 1)->offset : h->textEnd;
+}
+
+// Returns the command's text the right way round. The caller must free it.
+static char *history_cmd_text(struct History *h, int state)
+{
+    const struct HistoryCommand *cmd = history_cmd(h, state);
+    const unsigned char *src = (const unsigned char *)h->text + (cmd->offset - h->textBase);
+    char *text = (char *)malloc(cmd->length + 1);
+    unsigned int i = 0;
+
+    while (i < cmd->length)
+    {
+        if (src[0] == RUN_MARK)
+        {
+            memset(text + i, src[2], src[1]);
+            i += src[1];
+            src += 3;
+        }
+        else
+        {
+            text[i++] = *src++;
+        }
+    }
+    text[cmd->length] = 0;
+    if (cmd->action == ACTION_BACKSPACE)
+        reverse_text(text, cmd->length);
+    return text;
+}
 
-    // Add this to the current command if the insert was immediately after it.
-    if (cmd != NULL && cmd->action == ACTION_ADD
-     && pos == cmd->pos + strlen(cmd->text))
+// Makes room for 'length' more bytes at the end of the arena and returns where
+// they go. Space freed by evicted commands is reclaimed first.
+static char *history_reserve_text(struct History *h, size_t length)
+{
+    if (h->textEnd - h->textBase + length > h->textCapacity)
     {
-        int newSize = strlen(cmd->text) + nInserted + 1;
+        size_t start = history_text_start(h);
+        size_t used = h->textEnd - start;
 
-        cmd->text = (char *)realloc(cmd->text, newSize);
-        strcat(cmd->text, newText);
-        free(newText);
+        if (start > h->textBase)
+        {
+            memmove(h->text, h->text + (start - h->textBase), used);
+            h->textBase = start;
+        }
+        if (h->textCapacity < 2 * (used + length))
+        {
+            h->textCapacity = MAX(2 * (used + length), 4096);
+            h->text = (char *)realloc(h->text, h->textCapacity);
+        }
     }
-    // Otherwise, make a new command.
-    else
+    return h->text + (h->textEnd - h->textBase);
+}
+
+// Adds text to the end of the last command, carrying on the run it ends with.
+static void history_append_text(struct History *h, const char *text, unsigned int length)
+{
+    size_t extra = 0;
+    unsigned int i;
+
+    for (i = 0; i < length; i++)
     {
-        cmd = history_new_cmd(h);
-        cmd->action = ACTION_ADD;
-        cmd->text = newText;
-        cmd->pos = pos;
+        if ((unsigned char)text[i] == RUN_MARK)
+            extra += 2;
+    }
+    history_reserve_text(h, length + extra);
+
+    for (i = 0; i < length; i++)
+    {
+        unsigned char c = text[i];
+        unsigned char *end = (unsigned char *)h->text + (h->textEnd - h->textBase);
+
+        if (h->runLength > 0 && c == h->runByte && h->runLength < RUN_MAX)
+        {
+            h->runLength++;
+            if (h->runLength > RUN_MIN || c == RUN_MARK)
+            {
+                end[-2] = h->runLength;
+            }
+            else if (h->runLength == RUN_MIN)
+            {
+                // Turn the bytes so far into a run. It takes the same space.
+                end[-(RUN_MIN - 1)] = RUN_MARK;
+                end[-(RUN_MIN - 2)] = RUN_MIN;
+                end[-(RUN_MIN - 3)] = c;
+                h->textEnd += 3 - (RUN_MIN - 1);
+            }
+            else
+            {
+                *end = c;
+                h->textEnd++;
+            }
+        }
+        else
+        {
+            h->runByte = c;
+            h->runLength = 1;
+            if (c == RUN_MARK)
+            {
+                end[0] = RUN_MARK;
+                end[1] = 1;
+                end[2] = RUN_MARK;
+                h->textEnd += 3;
+            }
+            else
+            {
+                *end = c;
+                h->textEnd++;
+            }
+        }
+    }
+}
+
+// Adds the buffer's text from 'pos' to 'pos + length' to the end of the last
+// command, backwards if 'reversed' is set.
+static void history_append_range(struct History *h, unsigned int pos, unsigned int length, bool reversed)
+{
+    const char *text;
+    char *range = NULL;
+
+    if (length == 0)
+        return;
+
+    // The text is usually in one piece, unless the buffer's gap is inside it.
+    text = h->textbuf->address(pos);
+    if (reversed || h->textbuf->address(pos + length - 1) != text + length - 1)
+    {
+        range = h->textbuf->text_range(pos, pos + length);
+        if (reversed)
+            reverse_text(range, length);
+        text = range;
+    }
+    history_append_text(h, text, length);
+    free(range);
+}
+
+// FNV-1a
+static unsigned int hash_bytes(unsigned int hash, const char *bytes, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Hashes the text, as what a journal's marks are checked against.
+unsigned int history_hash_text(const char *text, size_t length)
+{
+    return hash_bytes(2166136261u, text, length);
+}
+
+// Hashes the buffer's memory where it is, either side of its gap, rather than
+// copying it all out.
+static unsigned int hash_textbuf(Fl_Text_Buffer *textbuf)
+{
+    struct RegexText runs;
+
+    textbuf_runs(textbuf, &runs);
+    return hash_bytes(hash_bytes(2166136261u, runs.runs[0], runs.lengths[0]), runs.runs[1], runs.lengths[1]);
+}
+
+static void journal_write_work(void *data)
+{
+    struct JournalWrite *w = (struct JournalWrite *)data;
+    size_t done = 0;
+
+    if (w->create && ftruncate(w->fd, 0) != 0)
+        perror("could not truncate undo journal");
+    while (done < w->length)
+    {
+        ssize_t n = write(w->fd, w->data + done, w->length - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("could not write undo journal");
+            break;
+        }
+        done += n;
+    }
+    if (w->close)
+        close(w->fd);
+}
+
+static void journal_write_done(void *data)
+{
+    struct JournalWrite *w = (struct JournalWrite *)data;
+
+    free(w->data);
+    delete w;
+}
+
+// Hands the waiting records to the worker thread to be written.
+static void history_submit_journal(struct History *h, bool create, bool close)
+{
+    struct JournalWrite *w;
+
+    if (h->journalLength == 0 && !create && !close)
+        return;
+    w = new JournalWrite;
+    w->fd = h->journalFd;
+    w->data = h->journalBuf;
+    w->length = h->journalLength;
+    w->create = create;
+    w->close = close;
+    worker_submit(journal_write_work, journal_write_done, w);
+    h->journalBuf = NULL;
+    h->journalLength = 0;
+    h->journalCapacity = 0;
+}
+
+static void history_queue_bytes(struct History *h, const void *bytes, size_t length)
+{
+    if (h->journalLength + length > h->journalCapacity)
+    {
+        h->journalCapacity = MAX(2 * (h->journalLength + length), JOURNAL_BATCH_SIZE * 2);
+        h->journalBuf = (char *)realloc(h->journalBuf, h->journalCapacity);
+    }
+    memcpy(h->journalBuf + h->journalLength, bytes, length);
+    h->journalLength += length;
+}
+
+// Queues records for the commands up to the one that makes 'state', which
+// must not change any more, and hands them to the worker if there are enough.
+static void history_queue_cmds(struct History *h, int state)
+{
+    for (; h->journalNext <= state; h->journalNext++)
+    {
+        const struct HistoryCommand *cmd = history_cmd(h, h->journalNext);
+        struct JournalRecord rec;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.type = RECORD_CMD;
+        rec.action = cmd->action;
+        rec.joined = cmd->joined;
+        rec.time = cmd->time;
+        rec.state = cmd->parent;
+        rec.pos = cmd->pos;
+        rec.length = cmd->length;
+        rec.size = history_text_end(h, h->journalNext) - cmd->offset;
+        history_queue_bytes(h, &rec, sizeof(rec));
+        history_queue_bytes(h, h->text + (cmd->offset - h->textBase), rec.size);
+    }
+    if (h->journalLength >= JOURNAL_BATCH_SIZE)
+        history_submit_journal(h, false, false);
+}
+
+static void history_queue_mark(struct History *h, unsigned int hash)
+{
+    struct JournalRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = RECORD_MARK;
+    rec.time = time(NULL);
+    rec.state = h->current;
+    rec.hash = hash;
+    history_queue_bytes(h, &rec, sizeof(rec));
+}
+
+// Adds a new, empty command to the end of the journal, branching off from the
+// current state, and makes the state it leads to current.
+static struct HistoryCommand *history_new_cmd(struct History *h, enum HistoryCommandAction action, unsigned int pos)
+{
+    struct HistoryCommand *cmd;
+
+    // The last command can't grow any more, so it can go in the journal.
+    if (h->journalPath != NULL)
+        history_queue_cmds(h, h->cmdsEnd);
+
+    if (h->cmdsEnd - h->cmdsBase == h->cmdsCapacity)
+    {
+        int used = h->cmdsEnd - h->cmdsStart;
+
+        if (h->cmdsStart > h->cmdsBase)
+        {
+            memmove(h->cmds, h->cmds + (h->cmdsStart - h->cmdsBase), used * sizeof(*h->cmds));
+            h->cmdsBase = h->cmdsStart;
+        }
+        if (h->cmdsCapacity < 2 * (used + 1))
+        {
+            h->cmdsCapacity = MAX(2 * (used + 1), 256);
+            h->cmds = (struct HistoryCommand *)realloc(h->cmds, h->cmdsCapacity * sizeof(*h->cmds));
+        }
+    }
+    if (h->cmdsEnd == 0)
+        h->rootTime = time(NULL);
+
+    cmd = &h->cmds[h->cmdsEnd - h->cmdsBase];
+    h->cmdsEnd++;
+    cmd->action = action;
+    cmd->pos = pos;
+    cmd->length = 0;
+    cmd->offset = h->textEnd;
+    cmd->joined = (h->groupDepth > 0 && !h->groupEmpty);
+    cmd->onPath = true;
+    cmd->parent = h->current;
+    cmd->redoChild = 0;
+    *history_redo_slot(h, h->current) = h->cmdsEnd;
+    h->current = h->cmdsEnd;
+    h->runLength = 0;
+    h->groupEmpty = false;
+    h->breakNext = false;
+    return cmd;
+}
+
+// Returns the command that the next edit may be merged into, or NULL if it
+// must start a new one. Only the newest command can grow, and only while its
+// state is current. Edits are never merged across the edge of a group.
+static struct HistoryCommand *history_merge_cmd(struct History *h)
+{
+    if (h->breakNext || h->current != h->cmdsEnd || !history_alive(h, h->current))
+        return NULL;
+    return history_cmd(h, h->current);
+}
+
+// Forgets the oldest commands while the history is over its memory budget,
+// always keeping the one that was just recorded. Groups go all at once. If an
+// evicted command is on the way to the current state, the state it made
+// becomes the root, and the branches that grew from the old root are lost.
+static void history_trim(struct History *h)
+{
+    size_t budget = (size_t)g_settings.undoBudgetKB * 1024;
+
+    if (budget == 0)
+        return;
+    while (h->textEnd - history_text_start(h) + (h->cmdsEnd - h->cmdsStart) * sizeof(*h->cmds) > budget)
+    {
+        int last = h->cmdsStart + 1;
+        struct HistoryCommand *cmd;
+
+        while (last < h->cmdsEnd && history_cmd(h, last + 1)->joined)
+            last++;
+        if (last >= h->current)
+            break;
+
+        cmd = history_cmd(h, last);
+        if (cmd->onPath)
+        {
+            h->root = last;
+            h->rootRedo = cmd->redoChild;
+            h->rootTime = cmd->time;
+        }
+        h->cmdsStart = last;
     }
-    
-    //printf("history: added '%s' at %i\n", cmd->text, pos);
+}
+
+void history_record_text_insert(struct History *h, unsigned int pos, unsigned int nInserted)
+{
+    struct HistoryCommand *cmd = history_merge_cmd(h);
+
+    // Make a new command unless the insert was immediately after the current one.
+    if (cmd == NULL || cmd->action != ACTION_ADD || pos != cmd->pos + cmd->length)
+        cmd = history_new_cmd(h, ACTION_ADD, pos);
+    history_append_range(h, pos, nInserted, false);
+    cmd->length += nInserted;
+    cmd->time = time(NULL);
+    history_trim(h);
 }
 
 void history_record_text_delete(struct History *h, unsigned int pos, unsigned int nDeleted)
 {
-    struct HistoryCommand *cmd = h->undoCmd;
-    char *deletedText = h->textbuf->text_range(pos, pos + nDeleted);
+    struct HistoryCommand *cmd = history_merge_cmd(h);
 
     // Add this to the current command if the delete was immediately before it. (backspacing multiple characters)
-    if (cmd != NULL && cmd->action == ACTION_DELETE
-     && pos + strlen(deletedText) == cmd->pos)
+    if (cmd != NULL && cmd->action != ACTION_ADD && pos + nDeleted == cmd->pos)
     {
-        int newSize = strlen(cmd->text) + nDeleted + 1;
+        if (cmd->action == ACTION_DELETE)
+        {
+            char *text = history_cmd_text(h, h->current);
 
-        char *buf = (char *)malloc(newSize);
-        strcpy(buf, deletedText);
-        strcat(buf, cmd->text);
-        free(deletedText);
-        free(cmd->text);
-        cmd->text = buf;
+            // Store what's there so far backwards.
+            reverse_text(text, cmd->length);
+            h->textEnd = cmd->offset;
+            h->runLength = 0;
+            history_append_text(h, text, cmd->length);
+            free(text);
+            cmd->action = ACTION_BACKSPACE;
+        }
+        history_append_range(h, pos, nDeleted, true);
         cmd->pos = pos;
     }
     // Add this to the current command if the position is the same. (using the delete key on multiple characters)
-    else if (cmd != NULL && cmd->action == ACTION_DELETE
-     && pos == cmd->pos)
+    else if (cmd != NULL && cmd->action == ACTION_DELETE && pos == cmd->pos)
     {
-        int newSize = strlen(cmd->text) + nDeleted + 1;
-
-        cmd->text = (char *)realloc(cmd->text, newSize);
-        strcat(cmd->text, deletedText);
-        free(deletedText);
+        history_append_range(h, pos, nDeleted, false);
     }
     // Otherwise, make a new command.
     else
     {
-        cmd = history_new_cmd(h);
-        cmd->action = ACTION_DELETE;
-        cmd->text = deletedText;
-        cmd->pos = pos;
+        cmd = history_new_cmd(h, ACTION_DELETE, pos);
+        history_append_range(h, pos, nDeleted, false);
+    }
+    cmd->length += nDeleted;
+    cmd->time = time(NULL);
+    history_trim(h);
+}
+
+// Starts a group of edits that are undone and redone as one. Groups may nest,
+// in which case the outermost one counts.
+void history_begin_group(struct History *h)
+{
+    if (h->groupDepth++ == 0)
+    {
+        h->groupEmpty = true;
+        h->breakNext = true;
     }
+}
 
-    //printf("history: deleted '%s' at %i\n", cmd->text, pos);
+void history_end_group(struct History *h)
+{
+    if (--h->groupDepth == 0)
+        h->breakNext = true;
 }
 
-void history_undo(struct History *h)
+// Makes the edits in 'steps' to the text. A single edit is made directly.
+// Otherwise they are made to a copy of just the text they touch, which then
+// replaces it in one go, so the text buffer's callbacks only run once.
+static void history_apply(struct History *h, const struct HistoryStep *steps, int count)
 {
-    struct HistoryCommand *cmd = h->undoCmd;
+    Fl_Text_Buffer scratch;
+    int length = h->textbuf->length();
+    int currLength = length;
+    int start = length;  // nothing before this is touched
+    int tail = length;   // nor is this much at the end
+    char *text;
+    int i;
 
-    if (cmd == NULL)
+    if (count == 1)
+    {
+        const struct HistoryCommand *cmd = history_cmd(h, steps[0].state);
+
+        if ((cmd->action == ACTION_ADD) != steps[0].undo)
+        {
+            text = history_cmd_text(h, steps[0].state);
+            h->textbuf->insert(cmd->pos, text);
+            free(text);
+        }
+        else
+        {
+            h->textbuf->remove(cmd->pos, cmd->pos + cmd->length);
+        }
         return;
+    }
 
-    switch (cmd->action)
+    for (i = 0; i < count; i++)
     {
-    case ACTION_ADD:
-        h->textbuf->remove(cmd->pos, cmd->pos + strlen(cmd->text));
-        break;
-    case ACTION_DELETE:
-        h->textbuf->insert(cmd->pos, cmd->text);
-        break;
+        const struct HistoryCommand *cmd = history_cmd(h, steps[i].state);
+
+        start = MIN(start, (int)cmd->pos);
+        if ((cmd->action == ACTION_ADD) != steps[i].undo)
+        {
+            tail = MIN(tail, currLength - (int)cmd->pos);
+            currLength += cmd->length;
+        }
+        else
+        {
+            tail = MIN(tail, currLength - (int)(cmd->pos + cmd->length));
+            currLength -= cmd->length;
+        }
     }
 
-    h->redoCmd = h->undoCmd;
-    h->undoCmd = h->undoCmd->prev;
+    scratch.canUndo(0);
+    text = h->textbuf->text_range(start, length - tail);
+    scratch.text(text);
+    free(text);
+    for (i = 0; i < count; i++)
+    {
+        const struct HistoryCommand *cmd = history_cmd(h, steps[i].state);
+
+        if ((cmd->action == ACTION_ADD) != steps[i].undo)
+        {
+            text = history_cmd_text(h, steps[i].state);
+            scratch.insert(cmd->pos - start, text);
+            free(text);
+        }
+        else
+        {
+            scratch.remove(cmd->pos - start, cmd->pos - start + cmd->length);
+        }
+    }
+    text = scratch.text();
+    h->textbuf->replace(start, length - tail, text);
+    free(text);
 }
 
-void history_redo(struct History *h)
+// Moves the text to 'state', which must be reachable, by undoing back to where
+// its branch meets the current one and redoing from there. Parents are always
+// older than their children, so stepping back from whichever of the two is
+// newer finds where they meet.
+static void history_goto(struct History *h, int state)
 {
-    struct HistoryCommand *cmd = h->redoCmd;
+    struct HistoryStep *steps;
+    int from = h->current;
+    int to = state;
+    int count = 0;
+    int undone;
+    int redone;
+    int i;
 
-    if (cmd == NULL)
+    while (from != to)
+    {
+        if (from > to)
+            from = history_cmd(h, from)->parent;
+        else
+            to = history_cmd(h, to)->parent;
+        count++;
+    }
+    if (count == 0)
         return;
 
-    switch (cmd->action)
+    // Undoing goes from the front, and redoing, which is found backwards, from the back.
+    steps = (struct HistoryStep *)malloc(count * sizeof(*steps));
+    from = h->current;
+    to = state;
+    undone = 0;
+    redone = count;
+    while (from != to)
     {
-    case ACTION_ADD:
-        h->textbuf->insert(cmd->pos, cmd->text);
-        break;
-    case ACTION_DELETE:
-        h->textbuf->remove(cmd->pos, cmd->pos + strlen(cmd->text));
-        break;
+        if (from > to)
+        {
+            steps[undone].state = from;
+            steps[undone++].undo = true;
+            from = history_cmd(h, from)->parent;
+        }
+        else
+        {
+            steps[--redone].state = to;
+            steps[redone].undo = false;
+            to = history_cmd(h, to)->parent;
+        }
     }
 
-    h->undoCmd = h->redoCmd;
-    h->redoCmd = h->redoCmd->next;
+    history_apply(h, steps, count);
+
+    // Redo goes back the way we came, or on along the branch we took.
+    for (i = 0; i < count; i++)
+    {
+        struct HistoryCommand *cmd = history_cmd(h, steps[i].state);
+
+        cmd->onPath = !steps[i].undo;
+        *history_redo_slot(h, cmd->parent) = steps[i].state;
+    }
+    h->current = state;
+    h->breakNext = true;
+    free(steps);
 }
 
-void history_free(struct History *h)
+// Returns the last state of the group 'state' is in.
+static int history_group_end(struct History *h, int state)
 {
-    struct HistoryCommand *cmd;
+    while (state < h->cmdsEnd && history_cmd(h, state + 1)->joined)
+        state++;
+    return state;
+}
+
+// Maps the journal open as 'fd' into memory and returns where its records
+// start, or NULL if it isn't a journal, or isn't the one for 'filename' if given.
+static const char *journal_map(int fd, const char *filename, char **map, size_t *size)
+{
+    struct stat st;
+    size_t magicSize = strlen(JOURNAL_MAGIC);
+    const char *name;
+    const char *nameEnd;
+
+    *map = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > magicSize)
+    {
+        *size = st.st_size;
+        *map = (char *)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*map == MAP_FAILED)
+            *map = NULL;
+    }
+    if (*map == NULL)
+        return NULL;
+
+    name = *map + magicSize;
+    nameEnd = (const char *)memchr(name, 0, *size - magicSize);
+    if (memcmp(*map, JOURNAL_MAGIC, magicSize) != 0 || nameEnd == NULL
+     || (filename != NULL && strcmp(name, filename) != 0))
+    {
+        munmap(*map, *size);
+        *map = NULL;
+        return NULL;
+    }
+    return nameEnd + 1;
+}
 
-    cmd = h->undoCmd;
-    while (cmd != NULL)
+// Reads the record at 'p', returning the one after it, or NULL if it's cut off
+// or doesn't make sense. 'numStates' is how many commands came before it.
+static const char *journal_read(const char *p, const char *end, int numStates, struct JournalRecord *rec)
+{
+    if ((size_t)(end - p) < sizeof(*rec))
+        return NULL;
+    memcpy(rec, p, sizeof(*rec));
+    p += sizeof(*rec);
+    if (rec->state < 0 || rec->state > numStates)
+        return NULL;
+    if (rec->type == RECORD_CMD)
     {
-        struct HistoryCommand *prev = cmd->prev;
-        delete cmd;
-        cmd = prev;
+        if (rec->size > (size_t)(end - p) || rec->action > ACTION_BACKSPACE)
+            return NULL;
+        p += rec->size;
     }
+    return p;
+}
+
+// Returns whether the journal open as 'fd' belongs to a file other than
+// 'filename'. One that is empty or isn't a journal belongs to no file yet.
+static bool journal_for_other_file(int fd, const char *filename)
+{
+    size_t magicSize = strlen(JOURNAL_MAGIC);
+    char header[sizeof(JOURNAL_MAGIC) + FL_PATH_MAX];
+    ssize_t n = pread(fd, header, sizeof(header) - 1, 0);
 
-    cmd = h->redoCmd;
-    while (cmd != NULL)
+    if (n < (ssize_t)magicSize || memcmp(header, JOURNAL_MAGIC, magicSize) != 0)
+        return false;
+    header[n] = 0;
+    return strcmp(header + magicSize, filename) != 0;
+}
+
+// Opens and locks the journal for 'filename', an absolute path, leaving its
+// path in 'path'. Another file's journal may have the name already, so a few
+// others are tried after it. Returns -1 if the file's journal is locked by
+// another tab or instance, or there is no name free.
+static int journal_lock(const char *dir, const char *filename, char *path, size_t pathSize)
+{
+    unsigned int hash = hash_bytes(2166136261u, filename, strlen(filename));
+    int i;
+
+    for (i = 0; i < JOURNAL_MAX_PROBES; i++)
+    {
+        int fd;
+        bool other;
+
+        if (i == 0)
+            snprintf(path, pathSize, "%s/%08x.journal", dir, hash);
+        else
+            snprintf(path, pathSize, "%s/%08x-%d.journal", dir, hash, i);
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+        if (fd < 0)
+        {
+            perror("could not open undo journal");
+            return -1;
+        }
+        other = journal_for_other_file(fd, filename);
+        if (!other && flock(fd, LOCK_EX | LOCK_NB) == 0)
+            return fd;
+        close(fd);
+        if (!other)
+            return -1;
+    }
+    return -1;
+}
+
+// Sets up a journal for the file just loaded into the text buffer. If the
+// journal has a mark for the same text, the history carries on from there,
+// and its earlier commands are read in when something is undone past it.
+// Otherwise the journal is started over. A file already open in another tab
+// or instance gets no journal here.
+void history_open_journal(struct History *h, const char *filename)
+{
+    const char *homeDir = getenv("HOME");
+    char absPath[FL_PATH_MAX];
+    char dir[FL_PATH_MAX];
+    char path[FL_PATH_MAX];
+    unsigned int hash;
+    int fd;
+    char *map;
+    size_t size;
+    const char *p;
+    int numStates = 0;
+    bool found = false;
+
+    if (!g_settings.persistentUndo || homeDir == NULL || homeDir[0] == 0)
+        return;
+
+    fl_filename_absolute(absPath, sizeof(absPath), filename);
+    snprintf(dir, sizeof(dir), "%s/.cache", homeDir);
+    mkdir(dir, 0700);
+    snprintf(dir, sizeof(dir), "%s/.cache/fledit", homeDir);
+    mkdir(dir, 0700);
+    fd = journal_lock(dir, absPath, path, sizeof(path));
+    if (fd < 0)
+        return;
+    h->journalPath = strdup(path);
+    h->journalFd = fd;
+    hash = hash_textbuf(h->textbuf);
+
+    p = journal_map(fd, absPath, &map, &size);
+    if (p != NULL)
+    {
+        struct JournalRecord rec;
+
+        while ((p = journal_read(p, map + size, numStates, &rec)) != NULL)
+        {
+            if (rec.type == RECORD_CMD)
+            {
+                numStates++;
+            }
+            else if (rec.hash == hash)
+            {
+                h->root = h->current = rec.state;
+                h->rootTime = rec.time;
+                found = true;
+            }
+        }
+        munmap(map, size);
+    }
+
+    if (found)
+    {
+        h->cmdsBase = h->cmdsStart = h->cmdsEnd = numStates;
+        h->journalStates = numStates;
+        h->journalNext = numStates + 1;
+        return;
+    }
+    h->root = h->current = 0;
+    h->journalNext = 1;
+    history_queue_bytes(h, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+    history_queue_bytes(h, absPath, strlen(absPath) + 1);
+    history_queue_mark(h, hash);
+    history_submit_journal(h, true, false);
+}
+
+// Records that the text was just saved, so the history can be picked up again
+// when the file is next opened. 'hash' is history_hash_text() of what was
+// saved.
+void history_mark_journal(struct History *h, unsigned int hash)
+{
+    if (h->journalPath == NULL)
+        return;
+    h->breakNext = true;
+    history_queue_cmds(h, h->cmdsEnd);
+    history_queue_mark(h, hash);
+    history_submit_journal(h, false, false);
+}
+
+// Reads in the commands from earlier sessions, ahead of this session's ones,
+// when something is first undone past where it started.
+static void history_load_journal(struct History *h)
+{
+    struct HistoryCommand *cmds;
+    struct JournalRecord rec;
+    char *text;
+    char *map;
+    size_t size;
+    size_t textSize = 0;
+    size_t offset = 0;
+    size_t start = history_text_start(h);
+    const char *records;
+    const char *p;
+    int used = h->cmdsEnd - h->cmdsStart;
+    int numStates = 0;
+    int state;
+    int i;
+
+    if (h->journalStates == 0 || h->journalLoaded)
+        return;
+    if (h->current != h->root || h->cmdsStart != h->journalStates)
+        return;
+    h->journalLoaded = true;
+
+    records = journal_map(h->journalFd, NULL, &map, &size);
+    if (records == NULL)
+        return;
+    for (p = records; numStates < h->journalStates && (p = journal_read(p, map + size, numStates, &rec)) != NULL; )
+    {
+        if (rec.type == RECORD_CMD)
+        {
+            numStates++;
+            textSize += rec.size;
+        }
+    }
+    if (numStates < h->journalStates)
+    {
+        munmap(map, size);
+        return;
+    }
+
+    // Put the journal's commands and text in front of this session's.
+    h->cmdsCapacity = MAX(2 * (numStates + used), 256);
+    cmds = (struct HistoryCommand *)malloc(h->cmdsCapacity * sizeof(*cmds));
+    h->textCapacity = MAX(2 * (textSize + h->textEnd - start), 4096);
+    text = (char *)malloc(h->textCapacity);
+    numStates = 0;
+    for (p = records; numStates < h->journalStates; )
+    {
+        p = journal_read(p, map + size, numStates, &rec);
+        if (rec.type == RECORD_CMD)
+        {
+            struct HistoryCommand *cmd = &cmds[numStates++];
+
+            cmd->action = rec.action;
+            cmd->joined = rec.joined;
+            cmd->onPath = false;
+            cmd->pos = rec.pos;
+            cmd->length = rec.length;
+            cmd->parent = rec.state;
+            cmd->redoChild = 0;
+            cmd->time = rec.time;
+            cmd->offset = offset;
+            memcpy(text + offset, p - rec.size, rec.size);
+            offset += rec.size;
+            if (rec.state > 0)
+                cmds[rec.state - 1].redoChild = numStates;
+        }
+    }
+    munmap(map, size);
+
+    for (i = 0; i < used; i++)
+    {
+        cmds[numStates + i] = *history_cmd(h, h->cmdsStart + 1 + i);
+        cmds[numStates + i].offset += offset - start;
+    }
+    if (h->textEnd > start)
+        memcpy(text + offset, h->text + (start - h->textBase), h->textEnd - start);
+    free(h->cmds);
+    free(h->text);
+    h->cmds = cmds;
+    h->text = text;
+    h->textEnd += offset - start;
+    h->textBase = 0;
+    h->cmdsBase = 0;
+    h->cmdsStart = 0;
+
+    // The text is in the state this session started in, so that's the way back.
+    state = h->root;
+    h->root = 0;
+    if (state != 0)
+        history_cmd(h, state)->redoChild = h->rootRedo;
+    for (; state != 0; state = history_cmd(h, state)->parent)
+    {
+        history_cmd(h, state)->onPath = true;
+        *history_redo_slot(h, history_cmd(h, state)->parent) = state;
+    }
+}
+
+void history_undo(struct History *h)
+{
+    int first = h->current;
+
+    // Going back past where this session started brings in the journal.
+    if (h->current == h->root)
+        history_load_journal(h);
+    if (h->current == h->root)
+        return;
+    while (history_cmd(h, first)->joined)
+        first = history_cmd(h, first)->parent;
+    history_goto(h, history_cmd(h, first)->parent);
+}
+
+// Redoes the branch that was last undone or redone from the current state.
+void history_redo(struct History *h)
+{
+    int next = *history_redo_slot(h, h->current);
+
+    if (!history_alive(h, next) || history_cmd(h, next)->parent != h->current)
+        return;
+    history_goto(h, history_group_end(h, next));
+}
+
+// Returns when the current state was made, in seconds since the epoch.
+unsigned int history_time(struct History *h)
+{
+    return (h->current == h->root) ? h->rootTime : history_cmd(h, h->current)->time;
+}
+
+// Moves the text to how it was at 'when', in seconds since the epoch. That's
+// the newest state made by then, whichever branch it's on, or the root if
+// they're all newer.
+void history_goto_time(struct History *h, unsigned int when)
+{
+    int lo = h->cmdsStart;
+    int hi = h->cmdsEnd;
+    int state;
+
+    // Commands are in the order they were made, so find the last one made by then.
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo + 1) / 2;
+
+        if (history_cmd(h, mid)->time <= when)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    state = lo;
+    while (state > h->cmdsStart && !history_reachable(h, state))
+        state--;
+    if (state == h->cmdsStart)
+        state = h->root;
+    else
+        state = history_group_end(h, state);
+    history_goto(h, state);
+}
+
+void history_free(struct History *h)
+{
+    if (h->journalPath != NULL)
     {
-        struct HistoryCommand *next = cmd->next;
-        delete cmd;
-        cmd = next;
+        history_queue_cmds(h, h->cmdsEnd);
+        history_submit_journal(h, false, true);
+        free(h->journalPath);
     }
+    free(h->cmds);
+    free(h->text);
 }
@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <FL/Fl.H>
+
+#include "fledit.hpp"
+
+// Files are read in pieces of this size
+#define LOAD_CHUNK_SIZE (1024 * 1024)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// How many pieces may be read ahead of the UI thread adding them to a buffer
+#define MAX_PENDING_CHUNKS 4
+
+#define MAX_READ_THREADS 16
+
+// A file being read on its own thread, so one slow or huge file doesn't hold
+// up the worker thread or any other file.
+struct FileLoader
+{
+    char *filename;
+    LoaderChunkFunc chunk;
+    LoaderDoneFunc done;
+    void *data;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int pending;  // pieces handed to the UI thread that it hasn't taken yet
+    bool canceled;
+};
+
+// A piece of the file, or the end of it, on its way to the UI thread
+struct LoadMessage
+{
+    struct FileLoader *loader;
+    int error;
+    double progress;
+    char *text;
+};
+
+// Files being read all at once by a pool of threads
+struct ReadBatch
+{
+    char **filenames;
+    char **texts;
+    bool *ready;  // the text has arrived on the UI thread
+    int count;
+    int next;  // the next file to read, claimed atomically
+    int delivered;  // files handed over so far, which is done in order
+    int refs;  // the threads still running, plus one for the UI thread
+    size_t maxSize;
+    LoaderFileFunc func;
+    void *data;
+};
+
+struct ReadMessage
+{
+    struct ReadBatch *batch;
+    int index;
+    char *text;
+};
+
+// Returns the length of the UTF-8 sequence at 's', or 0 if it isn't valid.
+static int utf8_sequence_length(const unsigned char *s, const unsigned char *end)
+{
+    int length;
+    int i;
+
+    if (s[0] < 0x80)
+        return 1;
+    else if (s[0] >= 0xC2 && s[0] <= 0xDF)
+        length = 2;
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF)
+        length = 3;
+    else if (s[0] >= 0xF0 && s[0] <= 0xF4)
+        length = 4;
+    else
+        return 0;
+
+    if (end - s < length)
+        return 0;
+    for (i = 1; i < length; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+    }
+    // overlong forms, surrogates, and past U+10FFFF
+    if ((s[0] == 0xE0 && s[1] < 0xA0) || (s[0] == 0xED && s[1] > 0x9F)
+     || (s[0] == 0xF0 && s[1] < 0x90) || (s[0] == 0xF4 && s[1] > 0x8F))
+        return 0;
+    return length;
+}
+
+// Turns any bytes that aren't valid UTF-8 into the Latin-1 characters they'd
+// be, as FLTK does when it loads a file. Returns the text, reallocated if it
+// had to change.
+static char *fix_encoding(char *text, size_t length)
+{
+    const unsigned char *s = (const unsigned char *)text;
+    const unsigned char *end = s + length;
+    size_t bad = 0;
+    unsigned char *fixed;
+    unsigned char *d;
+
+    while (s < end)
+    {
+        int n = utf8_sequence_length(s, end);
+
+        if (n == 0)
+        {
+            bad++;
+            n = 1;
+        }
+        s += n;
+    }
+    if (bad == 0)
+        return text;
+
+    fixed = (unsigned char *)malloc(length + bad + 1);
+    d = fixed;
+    for (s = (const unsigned char *)text; s < end; )
+    {
+        int n = utf8_sequence_length(s, end);
+
+        if (n == 0)
+        {
+            *d++ = 0xC0 | (*s >> 6);
+            *d++ = 0x80 | (*s & 0x3F);
+            s++;
+        }
+        else
+        {
+            memcpy(d, s, n);
+            d += n;
+            s += n;
+        }
+    }
+    *d = 0;
+    free(text);
+    return (char *)fixed;
+}
+
+// Returns how many bytes at the end of 'text' are the start of a character
+// that was cut off.
+static size_t incomplete_tail(const char *text, size_t length)
+{
+    size_t i;
+
+    for (i = 1; i <= 3 && i <= length; i++)
+    {
+        unsigned char c = text[length - i];
+        size_t needed = 1;
+
+        if ((c & 0xC0) == 0x80)
+            continue;
+        if (c >= 0xC2 && c <= 0xDF)
+            needed = 2;
+        else if (c >= 0xE0 && c <= 0xEF)
+            needed = 3;
+        else if (c >= 0xF0 && c <= 0xF4)
+            needed = 4;
+        return (needed > i) ? i : 0;
+    }
+    return 0;
+}
+
+static void cb_chunk(void *data)
+{
+    struct LoadMessage *msg = (struct LoadMessage *)data;
+    struct FileLoader *ld = msg->loader;
+
+    pthread_mutex_lock(&ld->mutex);
+    ld->pending--;
+    pthread_cond_signal(&ld->cond);
+    pthread_mutex_unlock(&ld->mutex);
+
+    if (!ld->canceled)
+        ld->chunk(ld->data, msg->text, msg->progress);
+    free(msg->text);
+    free(msg);
+}
+
+// The reader thread sends this last and is done with the loader by then.
+static void cb_done(void *data)
+{
+    struct LoadMessage *msg = (struct LoadMessage *)data;
+    struct FileLoader *ld = msg->loader;
+
+    if (!ld->canceled)
+        ld->done(ld->data, msg->error);
+    pthread_mutex_destroy(&ld->mutex);
+    pthread_cond_destroy(&ld->cond);
+    free(ld->filename);
+    delete ld;
+    free(msg);
+}
+
+static void *loader_main(void *arg)
+{
+    struct FileLoader *ld = (struct FileLoader *)arg;
+    struct LoadMessage *msg;
+    struct stat st;
+    char carried[4];  // the start of a character cut off at the end of a piece
+    size_t carry = 0;
+    off_t total = 0;
+    off_t loaded = 0;
+    int error = 0;
+    int fd;
+
+    fd = open(ld->filename, O_RDONLY);
+    if (fd < 0)
+        error = errno;
+    else if (fstat(fd, &st) == 0)
+        total = st.st_size;
+
+    while (fd >= 0)
+    {
+        bool canceled;
+        char *text;
+        size_t length;
+        ssize_t n;
+
+        // Don't get too far ahead of the UI thread.
+        pthread_mutex_lock(&ld->mutex);
+        while (ld->pending >= MAX_PENDING_CHUNKS && !ld->canceled)
+            pthread_cond_wait(&ld->cond, &ld->mutex);
+        canceled = ld->canceled;
+        pthread_mutex_unlock(&ld->mutex);
+        if (canceled)
+            break;
+
+        text = (char *)malloc(carry + LOAD_CHUNK_SIZE + 1);
+        memcpy(text, carried, carry);
+        do
+            n = read(fd, text + carry, LOAD_CHUNK_SIZE);
+        while (n < 0 && errno == EINTR);
+        if (n < 0 || (n == 0 && carry == 0))
+        {
+            if (n < 0)
+                error = errno;
+            free(text);
+            break;
+        }
+        loaded += n;
+
+        // The text is fixed up a piece at a time, the same as a small file is
+        // all at once, so a character split between pieces waits for the rest.
+        length = carry + n;
+        carry = (n > 0) ? incomplete_tail(text, length) : 0;
+        length -= carry;
+        memcpy(carried, text + length, carry);
+        text[length] = 0;
+
+        msg = (struct LoadMessage *)malloc(sizeof(*msg));
+        msg->loader = ld;
+        msg->error = 0;
+        msg->progress = (total > loaded) ? (double)loaded / total : 1.0;
+        msg->text = fix_encoding(text, length);
+
+        pthread_mutex_lock(&ld->mutex);
+        ld->pending++;
+        pthread_mutex_unlock(&ld->mutex);
+        worker_awake(cb_chunk, msg);
+        if (n == 0)
+            break;  // that was what was left over at the end
+    }
+    if (fd >= 0)
+        close(fd);
+
+    msg = (struct LoadMessage *)malloc(sizeof(*msg));
+    msg->loader = ld;
+    msg->error = error;
+    msg->progress = 1.0;
+    msg->text = NULL;
+    worker_awake(cb_done, msg);
+    return NULL;
+}
+
+// Starts reading a file in the background. chunk(data, text, progress) is
+// called on the UI thread with each piece as it's read, then done(data, error)
+// once it's all read, where error is 0 or an errno value. Returns NULL if the
+// reader thread couldn't be started.
+struct FileLoader *loader_start(const char *filename, LoaderChunkFunc chunk, LoaderDoneFunc done, void *data)
+{
+    struct FileLoader *ld = new FileLoader;
+    pthread_t thread;
+
+    ld->filename = strdup(filename);
+    ld->chunk = chunk;
+    ld->done = done;
+    ld->data = data;
+    pthread_mutex_init(&ld->mutex, NULL);
+    pthread_cond_init(&ld->cond, NULL);
+    ld->pending = 0;
+    ld->canceled = false;
+
+    if (pthread_create(&thread, NULL, loader_main, ld) != 0)
+    {
+        perror("could not start loader thread");
+        pthread_mutex_destroy(&ld->mutex);
+        pthread_cond_destroy(&ld->cond);
+        free(ld->filename);
+        delete ld;
+        return NULL;
+    }
+    pthread_detach(thread);
+    return ld;
+}
+
+// Stops reading the file. Neither callback is called after this, and the
+// loader frees itself once the reader thread notices.
+void loader_cancel(struct FileLoader *ld)
+{
+    pthread_mutex_lock(&ld->mutex);
+    ld->canceled = true;
+    pthread_cond_signal(&ld->cond);
+    pthread_mutex_unlock(&ld->mutex);
+}
+
+// Reads a whole file if it's smaller than 'maxSize', fixing its encoding as
+// FLTK would. Returns NULL if it isn't or it can't be read.
+char *loader_read_file(const char *filename, size_t maxSize)
+{
+    struct stat st;
+    char *text = NULL;
+    size_t length = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size < maxSize)
+    {
+        text = (char *)malloc(st.st_size + 1);
+        while (length < (size_t)st.st_size)
+        {
+            ssize_t n = read(fd, text + length, st.st_size - length);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                free(text);
+                text = NULL;
+                break;
+            }
+            if (n == 0)
+                break;
+            length += n;
+        }
+    }
+    close(fd);
+    if (text == NULL)
+        return NULL;
+    text[length] = 0;
+    return fix_encoding(text, length);
+}
+
+static void release_batch(struct ReadBatch *b)
+{
+    int i;
+
+    if (__sync_sub_and_fetch(&b->refs, 1) != 0)
+        return;
+    for (i = 0; i < b->count; i++)
+        free(b->filenames[i]);
+    free(b->filenames);
+    free(b->texts);
+    free(b->ready);
+    delete b;
+}
+
+// Hands over every file that has been read and has none before it still
+// being read, so they come out in the order they were asked for.
+static void cb_file_read(void *data)
+{
+    struct ReadMessage *msg = (struct ReadMessage *)data;
+    struct ReadBatch *b = msg->batch;
+
+    b->texts[msg->index] = msg->text;
+    b->ready[msg->index] = true;
+    free(msg);
+
+    while (b->delivered < b->count && b->ready[b->delivered])
+    {
+        int i = b->delivered++;
+
+        b->func(b->data, i, b->filenames[i], b->texts[i]);
+        free(b->texts[i]);
+        b->texts[i] = NULL;
+    }
+    if (b->delivered == b->count)
+        release_batch(b);
+}
+
+static void *read_batch_main(void *arg)
+{
+    struct ReadBatch *b = (struct ReadBatch *)arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&b->next, 1)) < b->count)
+    {
+        struct ReadMessage *msg = (struct ReadMessage *)malloc(sizeof(*msg));
+
+        msg->batch = b;
+        msg->index = i;
+        msg->text = loader_read_file(b->filenames[i], b->maxSize);
+        worker_awake(cb_file_read, msg);
+    }
+    release_batch(b);
+    return NULL;
+}
+
+// Reads many files at once on a pool of threads. func(data, i, filename, text)
+// is called on the UI thread for each one, in order, as soon as it and every
+// one before it have been read. 'text' is NULL for files at least 'maxSize'
+// long or that couldn't be read, which are left for the caller to open some
+// other way.
+void loader_read_files(const char *const *filenames, int count, size_t maxSize, LoaderFileFunc func, void *data)
+{
+    struct ReadBatch *b = new ReadBatch;
+    int numThreads = MIN(MIN(worker_cpu_count(), MAX_READ_THREADS), count);
+    int i;
+
+    if (count == 0)
+    {
+        delete b;
+        return;
+    }
+
+    b->filenames = (char **)malloc(count * sizeof(*b->filenames));
+    for (i = 0; i < count; i++)
+        b->filenames[i] = strdup(filenames[i]);
+    b->texts = (char **)calloc(count, sizeof(*b->texts));
+    b->ready = (bool *)calloc(count, sizeof(*b->ready));
+    b->count = count;
+    b->next = 0;
+    b->delivered = 0;
+    b->refs = 1;
+    b->maxSize = maxSize;
+    b->func = func;
+    b->data = data;
+
+    for (i = 0; i < numThreads; i++)
+    {
+        pthread_t thread;
+
+        __sync_fetch_and_add(&b->refs, 1);
+        if (pthread_create(&thread, NULL, read_batch_main, b) != 0)
+        {
+            __sync_fetch_and_sub(&b->refs, 1);
+            break;
+        }
+        pthread_detach(thread);
+    }
+    if (i == 0)
+    {
+        // No threads, so the files will all be opened the usual way.
+        for (i = 0; i < count; i++)
+            func(data, i, b->filenames[i], NULL);
+        b->delivered = count;
+        release_batch(b);
+    }
+}
@@ -0,0 +1,571 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <FL/Fl.H>
+#include <FL/Fl_Text_Buffer.H>
+#include <FL/filename.H>
+
+#include "fledit.hpp"
+
+#define RECOVERY_MAGIC "fledit recovery 1\n"
+#define COMMIT_INTERVAL_MS 200  // how long edits are gathered before they're written together
+#define SNAPSHOT_MIN_SIZE (1024 * 1024)  // logs smaller than this aren't compacted
+
+enum RecoveryRecordType {RECORD_EDIT, RECORD_SNAPSHOT, RECORD_CLOSE, RECORD_BASE};
+
+// How a record is stored in a log. An edit replaces 'deleted' bytes at 'pos'
+// with the 'length' bytes that follow. A snapshot is followed by the file's
+// name, nul terminated, and then the whole text, 'length' bytes in all. Its
+// 'pos' is set if the text has edits that weren't saved.
+struct RecoveryEntry
+{
+    unsigned int type;
+    unsigned int pos;
+    unsigned int deleted;
+    unsigned int length;
+};
+
+// A record waiting to be written. The UI thread pushes these onto a list
+// without locking, and the writer thread takes the whole list at once. A
+// base asks the writer to start the log with the file as it is on disk.
+struct RecoveryRecord
+{
+    struct RecoveryRecord *next;
+    struct RecoveryLog *log;
+    struct RecoveryEntry entry;
+    char *snapshot;  // a snapshot's text, which comes after the name in 'text'
+    size_t snapshotLength;  // or for a base, how long the file's text should be
+    char text[1];
+};
+
+// The log of one text buffer's edits since it was last saved. The UI thread
+// only creates it; everything in it belongs to the writer.
+struct RecoveryLog
+{
+    char path[FL_PATH_MAX];
+    int fd;
+    size_t length;  // of the text, after the last record
+    size_t logged;  // bytes logged since the last snapshot
+    char *buffer;  // entries to be written at the next commit
+    size_t bufferLength;
+    size_t bufferCapacity;
+    bool dirty;
+    bool closed;
+    bool dead;  // it couldn't be written, so it's no use for recovery
+    struct RecoveryLog *nextDirty;
+};
+
+static char s_recoveryDir[FL_PATH_MAX];
+static bool s_running = false;
+static volatile bool s_stopping = false;
+static pthread_t s_writerThread;
+static struct RecoveryRecord *volatile s_pending = NULL;
+static int s_nextLogNum = 0;
+
+static bool replay_log(const char *path, char *filename, size_t filenameSize, char **text, bool *edited);
+
+static void recovery_enqueue(struct RecoveryRecord *rec)
+{
+    struct RecoveryRecord *head;
+
+    do
+    {
+        head = s_pending;
+        rec->next = head;
+    } while (!__sync_bool_compare_and_swap(&s_pending, head, rec));
+}
+
+static struct RecoveryRecord *new_record(struct RecoveryLog *log, enum RecoveryRecordType type, size_t length)
+{
+    struct RecoveryRecord *rec = (struct RecoveryRecord *)malloc(sizeof(*rec) + length);
+
+    rec->log = log;
+    rec->entry.type = type;
+    rec->entry.pos = 0;
+    rec->entry.deleted = 0;
+    rec->entry.length = length;
+    rec->snapshot = NULL;
+    rec->snapshotLength = 0;
+    return rec;
+}
+
+// Writer thread
+
+static bool write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Replaces the log with one holding just a snapshot of the text, so that a
+// crash partway through leaves either the old log or the new one. A log that
+// has no file yet is given up on if this fails.
+static void write_snapshot(struct RecoveryLog *log, const char *filename, const char *text, size_t length, bool edited)
+{
+    char tempPath[FL_PATH_MAX + 4];
+    struct RecoveryEntry entry;
+    size_t nameLength = strlen(filename) + 1;
+    int fd;
+
+    entry.type = RECORD_SNAPSHOT;
+    entry.pos = edited;
+    entry.deleted = 0;
+    entry.length = nameLength + length;
+
+    log->logged = 0;  // don't try again straight away if it fails
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", log->path);
+    fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror("could not write recovery log");
+        log->dead = (log->fd < 0);
+        return;
+    }
+    if (!write_all(fd, RECOVERY_MAGIC, strlen(RECOVERY_MAGIC))
+     || !write_all(fd, (const char *)&entry, sizeof(entry))
+     || !write_all(fd, filename, nameLength)
+     || !write_all(fd, text, length)
+     || fdatasync(fd) != 0
+     || rename(tempPath, log->path) != 0)
+    {
+        perror("could not write recovery log");
+        close(fd);
+        unlink(tempPath);
+        log->dead = (log->fd < 0);
+        return;
+    }
+    close(fd);
+
+    if (log->fd >= 0)
+        close(log->fd);
+    log->fd = open(log->path, O_WRONLY | O_APPEND);
+    log->dead = (log->fd < 0);
+    log->length = length;
+    log->bufferLength = 0;  // everything before the snapshot is in it
+}
+
+// Starts the log with the file as it was opened. This is read from disk here
+// rather than copied on the UI thread, and checked against the length the text
+// had in case the file was changed since.
+static void write_base(struct RecoveryLog *log, const struct RecoveryRecord *rec)
+{
+    char *text = (rec->text[0] != 0) ? loader_read_file(rec->text, (size_t)-1) : strdup("");
+
+    if (text == NULL || strlen(text) != rec->snapshotLength)
+    {
+        fprintf(stderr, "could not start recovery log: '%s' has changed on disk\n", rec->text);
+        log->dead = true;
+    }
+    else
+    {
+        write_snapshot(log, rec->text, text, rec->snapshotLength, false);
+    }
+    free(text);
+}
+
+// Replaces a log that has grown too long with a snapshot of the text it ends
+// up with.
+static void compact_log(struct RecoveryLog *log)
+{
+    char filename[FL_PATH_MAX];
+    char *text;
+    bool edited;
+
+    if (replay_log(log->path, filename, sizeof(filename), &text, &edited))
+    {
+        write_snapshot(log, filename, text, strlen(text), edited);
+        free(text);
+    }
+    else
+    {
+        log->logged = 0;
+    }
+}
+
+static void buffer_entry(struct RecoveryLog *log, const struct RecoveryRecord *rec)
+{
+    size_t size = sizeof(rec->entry) + rec->entry.length;
+
+    // Without a file to go in, edits would only pile up.
+    if (log->dead)
+        return;
+    if (log->bufferLength + size > log->bufferCapacity)
+    {
+        log->bufferCapacity = 2 * (log->bufferLength + size);
+        log->buffer = (char *)realloc(log->buffer, log->bufferCapacity);
+    }
+    memcpy(log->buffer + log->bufferLength, &rec->entry, sizeof(rec->entry));
+    memcpy(log->buffer + log->bufferLength + sizeof(rec->entry), rec->text, rec->entry.length);
+    log->bufferLength += size;
+    log->length += rec->entry.length - rec->entry.deleted;
+    log->logged += size;
+}
+
+// Writes out every record waiting, with one write and one sync per log.
+static void commit(void)
+{
+    struct RecoveryRecord *rec = __sync_lock_test_and_set(&s_pending, NULL);
+    struct RecoveryRecord *ordered = NULL;
+    struct RecoveryLog *dirty = NULL;
+
+    // The list is newest first.
+    while (rec != NULL)
+    {
+        struct RecoveryRecord *next = rec->next;
+
+        rec->next = ordered;
+        ordered = rec;
+        rec = next;
+    }
+
+    for (rec = ordered; rec != NULL; rec = ordered)
+    {
+        struct RecoveryLog *log = rec->log;
+
+        switch (rec->entry.type)
+        {
+        case RECORD_EDIT:
+            buffer_entry(log, rec);
+            break;
+        case RECORD_SNAPSHOT:
+            write_snapshot(log, rec->text, rec->snapshot, rec->snapshotLength, false);
+            break;
+        case RECORD_BASE:
+            write_base(log, rec);
+            break;
+        case RECORD_CLOSE:
+            log->closed = true;
+            break;
+        }
+        if (!log->dirty)
+        {
+            log->dirty = true;
+            log->nextDirty = dirty;
+            dirty = log;
+        }
+        ordered = rec->next;
+        free(rec->snapshot);
+        free(rec);
+    }
+
+    while (dirty != NULL)
+    {
+        struct RecoveryLog *log = dirty;
+
+        dirty = log->nextDirty;
+        log->dirty = false;
+        if (log->closed)
+        {
+            if (log->fd >= 0)
+                close(log->fd);
+            unlink(log->path);
+            free(log->buffer);
+            delete log;
+            continue;
+        }
+        if (log->bufferLength > 0 && !log->dead)
+        {
+            // A torn write would leave the entries after it out of step.
+            if (!write_all(log->fd, log->buffer, log->bufferLength) || fdatasync(log->fd) != 0)
+            {
+                perror("could not write recovery log");
+                log->dead = true;
+            }
+        }
+        log->bufferLength = 0;
+        if (!log->dead && log->logged > SNAPSHOT_MIN_SIZE && log->logged > log->length)
+            compact_log(log);
+    }
+}
+
+static void *writer_main(void *)
+{
+    while (1)
+    {
+        bool stopping = s_stopping;
+
+        commit();
+        if (stopping)
+            break;
+        usleep(COMMIT_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+// UI thread
+
+// Starts the thread that writes the recovery logs.
+void recovery_init(void)
+{
+    const char *homeDir = getenv("HOME");
+
+    if (!g_settings.crashRecovery || homeDir == NULL || homeDir[0] == 0)
+        return;
+    snprintf(s_recoveryDir, sizeof(s_recoveryDir), "%s/.cache", homeDir);
+    mkdir(s_recoveryDir, 0700);
+    snprintf(s_recoveryDir, sizeof(s_recoveryDir), "%s/.cache/fledit", homeDir);
+    mkdir(s_recoveryDir, 0700);
+    snprintf(s_recoveryDir, sizeof(s_recoveryDir), "%s/.cache/fledit/recovery", homeDir);
+    mkdir(s_recoveryDir, 0700);
+
+    if (pthread_create(&s_writerThread, NULL, writer_main, NULL) != 0)
+    {
+        perror("could not start recovery log thread");
+        return;
+    }
+    s_running = true;
+}
+
+// Writes out what's left of the logs and stops the writer thread.
+void recovery_shutdown(void)
+{
+    if (!s_running)
+        return;
+    __sync_synchronize();
+    s_stopping = true;
+    pthread_join(s_writerThread, NULL);
+    s_running = false;
+}
+
+static struct RecoveryLog *new_log(void)
+{
+    struct RecoveryLog *log = new RecoveryLog;
+
+    snprintf(log->path, sizeof(log->path), "%s/%d-%d.log", s_recoveryDir, (int)getpid(), s_nextLogNum++);
+    log->fd = -1;
+    log->length = 0;
+    log->logged = 0;
+    log->buffer = NULL;
+    log->bufferLength = 0;
+    log->bufferCapacity = 0;
+    log->dirty = false;
+    log->closed = false;
+    log->dead = false;
+    return log;
+}
+
+// Copies text out of the buffer's memory, either side of its gap.
+static void copy_text(Fl_Text_Buffer *textbuf, int pos, int length, char *dest)
+{
+    struct RegexText runs;
+    int gap;
+
+    textbuf_runs(textbuf, &runs);
+    gap = runs.lengths[0];
+    if (pos < gap)
+    {
+        int n = (length < gap - pos) ? length : gap - pos;
+
+        memcpy(dest, runs.runs[0] + pos, n);
+        dest += n;
+        pos += n;
+        length -= n;
+    }
+    if (length > 0)
+        memcpy(dest, runs.runs[1] + pos - gap, length);
+}
+
+// Logs an edit that was just made to the text buffer. The first edit since
+// the file was opened has the writer start the log with the file as it is on
+// disk.
+void recovery_log_edit(struct RecoveryLog **logp, Fl_Text_Buffer *textbuf, const char *filename,
+    int pos, int nInserted, int nDeleted)
+{
+    struct RecoveryLog *log = *logp;
+    struct RecoveryRecord *rec;
+
+    if (!s_running)
+        return;
+
+    if (log == NULL)
+    {
+        size_t nameLength = strlen(filename) + 1;
+
+        log = new_log();
+        rec = new_record(log, RECORD_BASE, nameLength);
+        memcpy(rec->text, filename, nameLength);
+        rec->snapshotLength = textbuf->length() - nInserted + nDeleted;
+        recovery_enqueue(rec);
+        *logp = log;
+    }
+
+    rec = new_record(log, RECORD_EDIT, nInserted);
+    rec->entry.pos = pos;
+    rec->entry.deleted = nDeleted;
+    copy_text(textbuf, pos, nInserted, rec->text);
+    recovery_enqueue(rec);
+}
+
+// Starts a new log with the text that was just saved as 'filename', taking
+// over 'text'.
+void recovery_saved(struct RecoveryLog **logp, const char *filename, char *text, size_t length)
+{
+    size_t nameLength = strlen(filename) + 1;
+    struct RecoveryRecord *rec;
+
+    recovery_close(logp);
+    if (!s_running)
+    {
+        free(text);
+        return;
+    }
+    *logp = new_log();
+    rec = new_record(*logp, RECORD_SNAPSHOT, nameLength);
+    memcpy(rec->text, filename, nameLength);
+    rec->snapshot = text;
+    rec->snapshotLength = length;
+    recovery_enqueue(rec);
+}
+
+// Deletes the log, since the text has been saved or thrown away.
+void recovery_close(struct RecoveryLog **logp)
+{
+    if (*logp == NULL)
+        return;
+    recovery_enqueue(new_record(*logp, RECORD_CLOSE, 0));
+    *logp = NULL;
+}
+
+// Rebuilds the text from a log. 'edited' is set if it's different from what
+// was last saved. Returns false if the log has no text.
+static bool replay_log(const char *path, char *filename, size_t filenameSize, char **text, bool *edited)
+{
+    Fl_Text_Buffer scratch;
+    FILE *file = fopen(path, "rb");
+    char *buffer = NULL;
+    const char *p;
+    const char *end;
+    long size;
+    bool ok = false;
+
+    if (file == NULL)
+        return false;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size > 0)
+    {
+        buffer = (char *)malloc(size);
+        if (fread(buffer, size, 1, file) != 1)
+            size = 0;
+    }
+    fclose(file);
+    if (size < (long)strlen(RECOVERY_MAGIC) || memcmp(buffer, RECOVERY_MAGIC, strlen(RECOVERY_MAGIC)) != 0)
+    {
+        free(buffer);
+        return false;
+    }
+
+    *edited = false;
+    scratch.canUndo(0);
+    p = buffer + strlen(RECOVERY_MAGIC);
+    end = buffer + size;
+    // A crash may have cut off the last entries. Everything before them is good.
+    while ((size_t)(end - p) >= sizeof(struct RecoveryEntry))
+    {
+        struct RecoveryEntry entry;
+        char *chunk;
+
+        memcpy(&entry, p, sizeof(entry));
+        p += sizeof(entry);
+        if (entry.length > (size_t)(end - p))
+            break;
+        chunk = (char *)malloc(entry.length + 1);
+        memcpy(chunk, p, entry.length);
+        chunk[entry.length] = 0;
+        p += entry.length;
+
+        if (entry.type == RECORD_SNAPSHOT)
+        {
+            size_t nameLength = strlen(chunk) + 1;
+
+            if (nameLength > entry.length)
+            {
+                free(chunk);
+                break;
+            }
+            snprintf(filename, filenameSize, "%s", chunk);
+            scratch.text(chunk + nameLength);
+            *edited = (entry.pos != 0);
+            ok = true;
+        }
+        else if (entry.type == RECORD_EDIT && ok
+         && entry.pos + entry.deleted <= (unsigned int)scratch.length())
+        {
+            scratch.replace(entry.pos, entry.pos + entry.deleted, chunk);
+            *edited = true;
+        }
+        else
+        {
+            free(chunk);
+            break;
+        }
+        free(chunk);
+    }
+    free(buffer);
+    if (ok)
+        *text = scratch.text();
+    return ok;
+}
+
+// Calls func() with the file name and recovered text of every log left behind
+// by a session that didn't exit cleanly, unless nothing was changed since the
+// file was saved, then deletes the log.
+void recovery_find(RecoveryFunc func)
+{
+    DIR *dir;
+    struct dirent *ent;
+
+    if (!s_running || (dir = opendir(s_recoveryDir)) == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char path[FL_PATH_MAX];
+        char filename[FL_PATH_MAX];
+        char *text;
+        bool edited;
+        int pid;
+        int num;
+
+        if (sscanf(ent->d_name, "%d-%d.log", &pid, &num) != 2)
+            continue;
+        // Leave the logs of other editors that are still running alone.
+        if (pid == getpid() || kill(pid, 0) == 0 || errno == EPERM)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", s_recoveryDir, ent->d_name);
+        // A snapshot that a crash kept from being renamed into place is no use.
+        if (fl_filename_match(ent->d_name, "*.log.tmp"))
+        {
+            unlink(path);
+            continue;
+        }
+        if (!fl_filename_match(ent->d_name, "*.log"))
+            continue;
+        if (replay_log(path, filename, sizeof(filename), &text, &edited))
+        {
+            if (edited)
+                func(filename, text);
+            free(text);
+        }
+        unlink(path);
+    }
+    closedir(dir);
+}
@@ -0,0 +1,1384 @@
+#include <stdlib.h>
+#include <string.h>
+#include <FL/Fl.H>
+#include <FL/Fl_Text_Buffer.H>
+
+#include "fledit.hpp"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define MAX_NFA_STATES 100000
+#define MAX_REPEAT 1000
+
+// The DFA is built as it's needed. Once it has this many states, they are all
+// thrown away and it starts again from wherever the search has got to.
+#define MAX_DFA_STATES 2048
+
+// Patterns are compiled to a Thompson NFA, then searched with a DFA whose
+// states are sets of NFA states, built as the text is read. Nothing ever
+// backtracks, so searching takes time linear in the text.
+
+enum
+{
+    NFA_BYTES,  // a byte from a set
+    NFA_SPLIT,  // goes both ways
+    NFA_EMPTY,
+    NFA_LINE_START,
+    NFA_LINE_END,
+    NFA_MATCH,
+};
+
+struct NfaState
+{
+    unsigned char type;
+    int out;
+    int out1;
+    int set;  // which byte set, for NFA_BYTES
+};
+
+struct ByteSet
+{
+    unsigned char bits[32];
+};
+
+struct Nfa
+{
+    struct NfaState *states;
+    int count;
+    int capacity;
+    struct ByteSet *sets;
+    int setCount;
+    int setCapacity;
+    int start;
+};
+
+// A piece of NFA under construction. Its unconnected exits are kept as a
+// list threaded through the exits themselves.
+struct Fragment
+{
+    int start;
+    int exits;
+};
+
+struct Compiler
+{
+    const char *p;
+    bool matchCase;
+    bool reverse;  // build the NFA for the pattern backwards
+    const char *error;
+    struct Nfa *nfa;
+};
+
+// Separates groups of NFA states in a DFA state. Each group began at a
+// different place in the text, earliest first.
+#define GROUP_MARK -1
+
+// Transitions hold the state they go to, or one of these. Those going to
+// states where a match ends are stored as DFA_MATCH_TO(state), so the search
+// loop only has to check for negative values.
+#define DFA_UNKNOWN -1
+#define DFA_DEAD -2
+#define DFA_MATCH_TO(state) (-3 - (state))
+
+enum
+{
+    DFA_LINE_START = 1 << 0,  // it's at the start of a line
+    DFA_NO_STARTS = 1 << 1,  // no new matches will be started from it
+    DFA_MATCH = 1 << 2,  // a match ends here
+    DFA_MATCH_AT_EOL = 1 << 3,  // a match ends here if it's the end of a line
+};
+
+struct DfaState
+{
+    int *insts;  // NFA states waiting on a byte, a match, or an end of line
+    int count;
+    unsigned char flags;
+};
+
+struct Dfa
+{
+    const struct Nfa *nfa;
+    bool anchored;
+    struct DfaState *states;
+    int *next;  // 256 transitions for each state, by the byte read
+    int count;
+    int *hash;  // indices of states + 1, 0 for empty slots
+    unsigned int flushes;
+
+    // scratch space for building states
+    int *list;
+    int listCount;
+    int *stack;
+    int *pending;
+    int pendingCount;
+    unsigned int *mark;
+    unsigned int markGen;
+    unsigned int *eolMark;  // for states reached before a newline is read
+    unsigned int eolMarkGen;
+};
+
+struct Regex
+{
+    struct Nfa forward;
+    struct Nfa reverse;
+    struct Dfa forwardDfa;
+    struct Dfa reverseDfa;
+    int maxLength;  // the longest a match can be, or -1 for no limit
+    bool matchesNewline;
+};
+
+#define HASH_SIZE (MAX_DFA_STATES * 2)
+
+/* Building the NFA */
+
+static int new_state(struct Compiler *c, unsigned char type)
+{
+    struct Nfa *nfa = c->nfa;
+    struct NfaState *s;
+
+    if (nfa->count == MAX_NFA_STATES)
+    {
+        c->error = "the pattern is too big";
+        return 0;
+    }
+    if (nfa->count == nfa->capacity)
+    {
+        nfa->capacity = MAX(nfa->capacity * 2, 64);
+        nfa->states = (struct NfaState *)realloc(nfa->states, nfa->capacity * sizeof(*nfa->states));
+    }
+    s = &nfa->states[nfa->count];
+    s->type = type;
+    s->out = -1;
+    s->out1 = -1;
+    s->set = -1;
+    return nfa->count++;
+}
+
+static int *exit_slot(struct Nfa *nfa, int exit)
+{
+    struct NfaState *s = &nfa->states[exit >> 1];
+
+    return (exit & 1) ? &s->out1 : &s->out;
+}
+
+static void connect(struct Nfa *nfa, int exits, int target)
+{
+    while (exits != -1)
+    {
+        int *slot = exit_slot(nfa, exits);
+
+        exits = *slot;
+        *slot = target;
+    }
+}
+
+static int join_exits(struct Nfa *nfa, int a, int b)
+{
+    int last = a;
+
+    if (a == -1)
+        return b;
+    while (*exit_slot(nfa, last) != -1)
+        last = *exit_slot(nfa, last);
+    *exit_slot(nfa, last) = b;
+    return a;
+}
+
+static struct Fragment frag_state(struct Compiler *c, unsigned char type)
+{
+    struct Fragment f;
+
+    f.start = new_state(c, type);
+    f.exits = f.start << 1;
+    return f;
+}
+
+static struct Fragment frag_set(struct Compiler *c, const struct ByteSet *set)
+{
+    struct Nfa *nfa = c->nfa;
+    struct Fragment f = frag_state(c, NFA_BYTES);
+
+    if (c->error != NULL)
+        return f;
+    if (nfa->setCount == nfa->setCapacity)
+    {
+        nfa->setCapacity = MAX(nfa->setCapacity * 2, 16);
+        nfa->sets = (struct ByteSet *)realloc(nfa->sets, nfa->setCapacity * sizeof(*nfa->sets));
+    }
+    nfa->sets[nfa->setCount] = *set;
+    nfa->states[f.start].set = nfa->setCount++;
+    return f;
+}
+
+static struct Fragment frag_concat(struct Compiler *c, struct Fragment a, struct Fragment b)
+{
+    struct Fragment f;
+
+    if (c->error != NULL)
+        return a;
+    if (c->reverse)
+    {
+        struct Fragment t = a;
+
+        a = b;
+        b = t;
+    }
+    connect(c->nfa, a.exits, b.start);
+    f.start = a.start;
+    f.exits = b.exits;
+    return f;
+}
+
+static struct Fragment frag_alt(struct Compiler *c, struct Fragment a, struct Fragment b)
+{
+    struct Fragment f = frag_state(c, NFA_SPLIT);
+
+    if (c->error != NULL)
+        return f;
+    c->nfa->states[f.start].out = a.start;
+    c->nfa->states[f.start].out1 = b.start;
+    f.exits = join_exits(c->nfa, a.exits, b.exits);
+    return f;
+}
+
+static struct Fragment frag_star(struct Compiler *c, struct Fragment a)
+{
+    int split = new_state(c, NFA_SPLIT);
+    struct Fragment f;
+
+    f.start = split;
+    f.exits = (split << 1) | 1;
+    if (c->error != NULL)
+        return f;
+    c->nfa->states[split].out = a.start;
+    connect(c->nfa, a.exits, split);
+    return f;
+}
+
+static struct Fragment frag_plus(struct Compiler *c, struct Fragment a)
+{
+    struct Fragment f = frag_star(c, a);
+
+    f.start = a.start;
+    return f;
+}
+
+static struct Fragment frag_quest(struct Compiler *c, struct Fragment a)
+{
+    int split = new_state(c, NFA_SPLIT);
+    struct Fragment f;
+
+    f.start = split;
+    f.exits = -1;
+    if (c->error != NULL)
+        return f;
+    c->nfa->states[split].out = a.start;
+    f.exits = join_exits(c->nfa, a.exits, (split << 1) | 1);
+    return f;
+}
+
+/* Parsing */
+
+static void set_add(struct ByteSet *set, int lo, int hi)
+{
+    int i;
+
+    for (i = lo; i <= hi; i++)
+        set->bits[i >> 3] |= 1 << (i & 7);
+}
+
+static bool set_has(const struct ByteSet *set, int b)
+{
+    return (set->bits[b >> 3] >> (b & 7)) & 1;
+}
+
+// Adds the other case of every ASCII letter in the set.
+static void set_fold(struct ByteSet *set)
+{
+    int i;
+
+    for (i = 'a'; i <= 'z'; i++)
+    {
+        if (set_has(set, i) || set_has(set, i - 'a' + 'A'))
+        {
+            set_add(set, i, i);
+            set_add(set, i - 'a' + 'A', i - 'a' + 'A');
+        }
+    }
+}
+
+static struct Fragment frag_byte_range(struct Compiler *c, int lo, int hi)
+{
+    struct ByteSet set;
+
+    memset(&set, 0, sizeof(set));
+    set_add(&set, lo, hi);
+    return frag_set(c, &set);
+}
+
+// Matches any whole UTF-8 character of more than one byte.
+static struct Fragment frag_any_multibyte(struct Compiler *c)
+{
+    struct Fragment two = frag_concat(c, frag_byte_range(c, 0xC2, 0xDF), frag_byte_range(c, 0x80, 0xBF));
+    struct Fragment three = frag_byte_range(c, 0xE0, 0xEF);
+    struct Fragment four = frag_byte_range(c, 0xF0, 0xF4);
+    int i;
+
+    for (i = 0; i < 2; i++)
+        three = frag_concat(c, three, frag_byte_range(c, 0x80, 0xBF));
+    for (i = 0; i < 3; i++)
+        four = frag_concat(c, four, frag_byte_range(c, 0x80, 0xBF));
+    return frag_alt(c, two, frag_alt(c, three, four));
+}
+
+// Matches an ASCII byte from the set, or if 'multibyte' is true, any character
+// of more than one byte too.
+static struct Fragment frag_class(struct Compiler *c, struct ByteSet *set, bool multibyte)
+{
+    if (!c->matchCase)
+        set_fold(set);
+    if (multibyte)
+        return frag_alt(c, frag_set(c, set), frag_any_multibyte(c));
+    return frag_set(c, set);
+}
+
+// Matches one character, which may be several bytes long.
+static struct Fragment frag_literal(struct Compiler *c, const unsigned char *s, int length)
+{
+    struct ByteSet set;
+    struct Fragment f;
+    int i;
+
+    for (i = 0; i < length; i++)
+    {
+        struct Fragment b;
+
+        memset(&set, 0, sizeof(set));
+        set_add(&set, s[i], s[i]);
+        if (!c->matchCase)
+            set_fold(&set);
+        b = frag_set(c, &set);
+        f = (i == 0) ? b : frag_concat(c, f, b);
+    }
+    return f;
+}
+
+static int utf8_length(unsigned char lead)
+{
+    if (lead >= 0xF0)
+        return 4;
+    if (lead >= 0xE0)
+        return 3;
+    if (lead >= 0xC0)
+        return 2;
+    return 1;
+}
+
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// Parses a backslash escape for a single byte or a class of them into 'set'.
+// Returns true if the class it stands for also has every multibyte character.
+static bool parse_escape(struct Compiler *c, struct ByteSet *set)
+{
+    char ch = *c->p++;
+    bool negate = false;
+
+    switch (ch)
+    {
+    case 'D':
+        negate = true;
+        // fall through
+    case 'd':
+        set_add(set, '0', '9');
+        break;
+    case 'W':
+        negate = true;
+        // fall through
+    case 'w':
+        set_add(set, 'a', 'z');
+        set_add(set, 'A', 'Z');
+        set_add(set, '0', '9');
+        set_add(set, '_', '_');
+        break;
+    case 'S':
+        negate = true;
+        // fall through
+    case 's':
+        set_add(set, ' ', ' ');
+        set_add(set, '\t', '\r');
+        break;
+    case 'n':
+        set_add(set, '\n', '\n');
+        break;
+    case 't':
+        set_add(set, '\t', '\t');
+        break;
+    case 'r':
+        set_add(set, '\r', '\r');
+        break;
+    case 'f':
+        set_add(set, '\f', '\f');
+        break;
+    case 'v':
+        set_add(set, '\v', '\v');
+        break;
+    case 'x':
+        if (hex_value(c->p[0]) < 0 || hex_value(c->p[1]) < 0)
+        {
+            c->error = "\\x needs two hex digits";
+            return false;
+        }
+        set_add(set, hex_value(c->p[0]) * 16 + hex_value(c->p[1]), hex_value(c->p[0]) * 16 + hex_value(c->p[1]));
+        c->p += 2;
+        break;
+    case 'b':
+    case 'B':
+    case '<':
+    case '>':
+        c->error = "word boundaries aren't supported";
+        return false;
+    case 0:
+        c->p--;
+        c->error = "trailing backslash";
+        return false;
+    default:
+        if (ch >= '1' && ch <= '9')
+        {
+            c->error = "backreferences aren't supported";
+            return false;
+        }
+        if ((unsigned char)ch >= 0x80 || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'))
+        {
+            c->error = "unknown escape";
+            return false;
+        }
+        set_add(set, (unsigned char)ch, (unsigned char)ch);
+        break;
+    }
+    if (negate)
+    {
+        int i;
+
+        // Only ASCII goes in the set. Multibyte characters are added whole.
+        for (i = 0; i < 16; i++)
+            set->bits[i] = ~set->bits[i];
+        memset(set->bits + 16, 0, 16);
+        return true;
+    }
+    return false;
+}
+
+static struct Fragment parse_class(struct Compiler *c)
+{
+    struct ByteSet set;
+    struct Fragment others = {-1, -1};
+    bool negate = false;
+    bool multibyte = false;
+    bool haveOthers = false;
+    bool first = true;
+
+    memset(&set, 0, sizeof(set));
+    if (*c->p == '^')
+    {
+        negate = true;
+        c->p++;
+    }
+    while (first || *c->p != ']')
+    {
+        unsigned char ch = *c->p;
+        int lo;
+        int hi;
+
+        first = false;
+        if (ch == 0)
+        {
+            c->error = "missing ]";
+            return others;
+        }
+        if (ch == '\\')
+        {
+            struct ByteSet escaped;
+            int i;
+
+            c->p++;
+            memset(&escaped, 0, sizeof(escaped));
+            multibyte |= parse_escape(c, &escaped);
+            if (c->error != NULL)
+                return others;
+            for (i = 0; i < 32; i++)
+                set.bits[i] |= escaped.bits[i];
+            continue;
+        }
+        if (ch >= 0x80)
+        {
+            // Characters outside ASCII are matched as alternatives.
+            int length = utf8_length(ch);
+            struct Fragment f;
+
+            if (negate)
+            {
+                c->error = "non-ASCII characters can't be excluded from a class";
+                return others;
+            }
+            if ((int)strnlen(c->p, length) < length)
+            {
+                c->error = "bad UTF-8 in the pattern";
+                return others;
+            }
+            if (c->p[length] == '-' && c->p[length + 1] != ']' && c->p[length + 1] != 0)
+            {
+                c->error = "ranges of non-ASCII characters aren't supported";
+                return others;
+            }
+            f = frag_literal(c, (const unsigned char *)c->p, length);
+            others = haveOthers ? frag_alt(c, others, f) : f;
+            haveOthers = true;
+            c->p += length;
+            continue;
+        }
+
+        lo = hi = ch;
+        c->p++;
+        if (c->p[0] == '-' && c->p[1] != ']' && c->p[1] != 0)
+        {
+            hi = (unsigned char)c->p[1];
+            if (hi == '\\' || hi >= 0x80 || hi < lo)
+            {
+                c->error = "bad range in class";
+                return others;
+            }
+            c->p += 2;
+        }
+        set_add(&set, lo, hi);
+    }
+    c->p++;
+
+    if (negate)
+    {
+        int i;
+
+        if (!c->matchCase)
+            set_fold(&set);
+        for (i = 0; i < 16; i++)
+            set.bits[i] = ~set.bits[i];
+        memset(set.bits + 16, 0, 16);
+        return frag_class(c, &set, true);
+    }
+    if (haveOthers)
+        return frag_alt(c, frag_class(c, &set, multibyte), others);
+    return frag_class(c, &set, multibyte);
+}
+
+static struct Fragment parse_alternation(struct Compiler *c);
+
+static struct Fragment parse_atom(struct Compiler *c)
+{
+    struct Fragment f = {-1, -1};
+    struct ByteSet set;
+    unsigned char ch = *c->p;
+
+    memset(&set, 0, sizeof(set));
+    switch (ch)
+    {
+    case '(':
+        c->p++;
+        if (c->p[0] == '?' && c->p[1] == ':')
+            c->p += 2;
+        f = parse_alternation(c);
+        if (c->error == NULL && *c->p != ')')
+            c->error = "missing )";
+        c->p++;
+        return f;
+    case '*':
+    case '+':
+    case '?':
+        c->error = "nothing to repeat";
+        return f;
+    case '.':
+        c->p++;
+        set_add(&set, 0x00, 0x7F);
+        set.bits['\n' >> 3] &= ~(1 << ('\n' & 7));
+        return frag_class(c, &set, true);
+    case '[':
+        c->p++;
+        return parse_class(c);
+    case '^':
+        c->p++;
+        return frag_state(c, c->reverse ? NFA_LINE_END : NFA_LINE_START);
+    case '$':
+        c->p++;
+        return frag_state(c, c->reverse ? NFA_LINE_START : NFA_LINE_END);
+    case '\\':
+    {
+        bool multibyte;
+
+        c->p++;
+        multibyte = parse_escape(c, &set);
+        if (c->error != NULL)
+            return f;
+        return frag_class(c, &set, multibyte);
+    }
+    default:
+    {
+        int length = utf8_length(ch);
+
+        if ((int)strnlen(c->p, length) < length)
+        {
+            c->error = "bad UTF-8 in the pattern";
+            return f;
+        }
+        f = frag_literal(c, (const unsigned char *)c->p, length);
+        c->p += length;
+        return f;
+    }
+    }
+}
+
+static bool parse_count(struct Compiler *c, int *count)
+{
+    if (*c->p < '0' || *c->p > '9')
+        return false;
+    *count = 0;
+    while (*c->p >= '0' && *c->p <= '9')
+    {
+        *count = *count * 10 + *c->p++ - '0';
+        if (*count > MAX_REPEAT)
+        {
+            c->error = "repeat count is too big";
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct Fragment parse_repeat(struct Compiler *c)
+{
+    const char *atomStart = c->p;
+    struct Fragment f = parse_atom(c);
+    bool repeated = false;
+
+    while (c->error == NULL)
+    {
+        char ch = *c->p;
+
+        if (ch == '*' || ch == '+' || ch == '?')
+        {
+            c->p++;
+            // Lazy and greedy are the same here, as the longest match is
+            // always taken.
+            if (*c->p == '?')
+                c->p++;
+            if (ch == '*')
+                f = frag_star(c, f);
+            else if (ch == '+')
+                f = frag_plus(c, f);
+            else
+                f = frag_quest(c, f);
+            repeated = true;
+        }
+        else if (ch == '{' && c->p[1] >= '0' && c->p[1] <= '9')
+        {
+            // Otherwise the brace is just a character.
+            const char *after;
+            struct Fragment result = {-1, -1};
+            bool haveResult = false;
+            int min;
+            int max;
+            int i;
+
+            c->p++;
+            if (repeated)
+            {
+                c->error = "can't repeat a repetition";
+                break;
+            }
+            if (!parse_count(c, &min))
+            {
+                if (c->error == NULL)
+                    c->error = "bad repeat count";
+                break;
+            }
+            max = min;
+            if (*c->p == ',')
+            {
+                c->p++;
+                if (*c->p == '}')
+                    max = -1;
+                else if (!parse_count(c, &max) || max < min)
+                {
+                    if (c->error == NULL)
+                        c->error = "bad repeat count";
+                    break;
+                }
+            }
+            if (*c->p != '}')
+            {
+                c->error = "missing }";
+                break;
+            }
+            c->p++;
+            after = c->p;
+
+            // Each copy of the atom is parsed again from the pattern.
+            for (i = 0; i < MAX(min, max) || (max < 0 && i <= min); i++)
+            {
+                struct Fragment copy;
+
+                if (i == 0)
+                {
+                    copy = f;
+                }
+                else
+                {
+                    c->p = atomStart;
+                    copy = parse_atom(c);
+                }
+                if (c->error != NULL)
+                    break;
+                if (max < 0 && i == min)
+                    copy = frag_star(c, copy);
+                else if (i >= min)
+                    copy = frag_quest(c, copy);
+                result = haveResult ? frag_concat(c, result, copy) : copy;
+                haveResult = true;
+            }
+            c->p = after;
+            f = haveResult ? result : frag_state(c, NFA_EMPTY);
+            repeated = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return f;
+}
+
+static struct Fragment parse_concatenation(struct Compiler *c)
+{
+    struct Fragment f = frag_state(c, NFA_EMPTY);
+
+    while (c->error == NULL && *c->p != 0 && *c->p != '|' && *c->p != ')')
+        f = frag_concat(c, f, parse_repeat(c));
+    return f;
+}
+
+static struct Fragment parse_alternation(struct Compiler *c)
+{
+    struct Fragment f = parse_concatenation(c);
+
+    while (c->error == NULL && *c->p == '|')
+    {
+        c->p++;
+        f = frag_alt(c, f, parse_concatenation(c));
+    }
+    return f;
+}
+
+static const char *compile_nfa(struct Nfa *nfa, const char *pattern, bool matchCase, bool reverse)
+{
+    struct Compiler c;
+    struct Fragment f;
+    int match;
+
+    memset(nfa, 0, sizeof(*nfa));
+    c.p = pattern;
+    c.matchCase = matchCase;
+    c.reverse = reverse;
+    c.error = NULL;
+    c.nfa = nfa;
+
+    f = parse_alternation(&c);
+    if (c.error == NULL && *c.p == ')')
+        c.error = "unmatched )";
+    match = new_state(&c, NFA_MATCH);
+    if (c.error != NULL)
+        return c.error;
+    connect(nfa, f.exits, match);
+    nfa->start = f.start;
+    return NULL;
+}
+
+// Works out the most bytes a match can be, by the longest path through the
+// NFA. Returns -1 if it loops, as then there's no limit.
+static int longest_path(const struct Nfa *nfa)
+{
+    // Lengths from each state to the match. NOT_DONE is for states being
+    // worked out, which, if they're reached again, are in a loop.
+    enum { UNKNOWN = -2, NOT_DONE = -3 };
+    int *lengths = (int *)malloc(nfa->count * sizeof(int));
+    int *stack = (int *)malloc(nfa->count * sizeof(int));
+    int depth = 0;
+    int result;
+    int i;
+
+    for (i = 0; i < nfa->count; i++)
+        lengths[i] = UNKNOWN;
+    stack[depth++] = nfa->start;
+    lengths[nfa->start] = NOT_DONE;
+    while (depth > 0)
+    {
+        const struct NfaState *s = &nfa->states[stack[depth - 1]];
+        int outs[2] = {s->out, (s->type == NFA_SPLIT) ? s->out1 : -1};
+        bool waiting = false;
+        int length = 0;
+
+        if (s->type == NFA_MATCH)
+            outs[0] = -1;
+        for (i = 0; i < 2; i++)
+        {
+            if (outs[i] < 0)
+                continue;
+            if (lengths[outs[i]] == UNKNOWN)
+            {
+                lengths[outs[i]] = NOT_DONE;
+                stack[depth++] = outs[i];
+                waiting = true;
+                break;
+            }
+            if (lengths[outs[i]] == NOT_DONE || lengths[outs[i]] == -1)
+                length = -1;
+            else if (length >= 0)
+                length = MAX(length, lengths[outs[i]]);
+        }
+        if (waiting)
+            continue;
+        if (length >= 0 && s->type == NFA_BYTES)
+            length++;
+        lengths[stack[--depth]] = length;
+    }
+    result = lengths[nfa->start];
+    free(lengths);
+    free(stack);
+    return result;
+}
+
+/* The DFA */
+
+static void dfa_init(struct Dfa *dfa, const struct Nfa *nfa, bool anchored)
+{
+    memset(dfa, 0, sizeof(*dfa));
+    dfa->nfa = nfa;
+    dfa->anchored = anchored;
+    dfa->states = (struct DfaState *)malloc(MAX_DFA_STATES * sizeof(*dfa->states));
+    dfa->next = (int *)malloc(MAX_DFA_STATES * 256 * sizeof(*dfa->next));
+    dfa->hash = (int *)calloc(HASH_SIZE, sizeof(*dfa->hash));
+    // Each NFA state goes in a list at most once per group, and groups are
+    // never empty, so lists are at most twice as long as the NFA.
+    dfa->list = (int *)malloc(2 * (nfa->count + 1) * sizeof(*dfa->list));
+    dfa->stack = (int *)malloc(2 * (nfa->count + 1) * sizeof(*dfa->stack));
+    dfa->pending = (int *)malloc((nfa->count + 1) * sizeof(*dfa->pending));
+    dfa->mark = (unsigned int *)calloc(nfa->count, sizeof(*dfa->mark));
+    dfa->eolMark = (unsigned int *)calloc(nfa->count, sizeof(*dfa->eolMark));
+}
+
+static void dfa_flush(struct Dfa *dfa)
+{
+    int i;
+
+    for (i = 0; i < dfa->count; i++)
+        free(dfa->states[i].insts);
+    dfa->count = 0;
+    memset(dfa->hash, 0, HASH_SIZE * sizeof(*dfa->hash));
+    dfa->flushes++;
+}
+
+static void dfa_free(struct Dfa *dfa)
+{
+    dfa_flush(dfa);
+    free(dfa->states);
+    free(dfa->next);
+    free(dfa->hash);
+    free(dfa->list);
+    free(dfa->stack);
+    free(dfa->pending);
+    free(dfa->mark);
+    free(dfa->eolMark);
+}
+
+static unsigned int hash_list(const int *list, int count, unsigned char flags)
+{
+    unsigned int hash = 2166136261u ^ flags;
+    int i;
+
+    for (i = 0; i < count; i++)
+        hash = (hash ^ (unsigned int)list[i]) * 16777619u;
+    return hash;
+}
+
+// Returns the state with the list in 'dfa->list' and these flags, adding it
+// if it's new.
+static int dfa_add_state(struct Dfa *dfa, unsigned char flags)
+{
+    unsigned int hash = hash_list(dfa->list, dfa->listCount, flags);
+    unsigned int slot = hash % HASH_SIZE;
+    struct DfaState *s;
+
+    while (dfa->hash[slot] != 0)
+    {
+        s = &dfa->states[dfa->hash[slot] - 1];
+        if (s->flags == flags && s->count == dfa->listCount
+         && memcmp(s->insts, dfa->list, dfa->listCount * sizeof(int)) == 0)
+            return dfa->hash[slot] - 1;
+        slot = (slot + 1) % HASH_SIZE;
+    }
+
+    if (dfa->count == MAX_DFA_STATES)
+    {
+        dfa_flush(dfa);
+        slot = hash % HASH_SIZE;
+    }
+    s = &dfa->states[dfa->count];
+    s->insts = (int *)malloc(MAX(dfa->listCount, 1) * sizeof(int));
+    memcpy(s->insts, dfa->list, dfa->listCount * sizeof(int));
+    s->count = dfa->listCount;
+    s->flags = flags;
+    memset(&dfa->next[dfa->count * 256], 0xFF, 256 * sizeof(*dfa->next));  // DFA_UNKNOWN
+    dfa->hash[slot] = ++dfa->count;
+    return dfa->count - 1;
+}
+
+// Adds the NFA states that can be reached from 'start' without reading a
+// byte to the list, skipping any already added. With 'eol' set, it's known to
+// be the end of a line; otherwise, ends of lines are added to be decided
+// later. Returns true if a match is reached.
+static bool add_closure(struct Dfa *dfa, int *out, int *outCount, int start, bool lineStart, bool eol)
+{
+    const struct NfaState *states = dfa->nfa->states;
+    unsigned int *mark = eol ? dfa->eolMark : dfa->mark;
+    unsigned int gen = eol ? dfa->eolMarkGen : dfa->markGen;
+    int depth = 0;
+    bool matched = false;
+
+    dfa->stack[depth++] = start;
+    while (depth > 0)
+    {
+        int i = dfa->stack[--depth];
+        const struct NfaState *s;
+
+        if (i < 0 || mark[i] == gen)
+            continue;
+        mark[i] = gen;
+        s = &states[i];
+        switch (s->type)
+        {
+        case NFA_SPLIT:
+            dfa->stack[depth++] = s->out1;
+            dfa->stack[depth++] = s->out;
+            break;
+        case NFA_EMPTY:
+            dfa->stack[depth++] = s->out;
+            break;
+        case NFA_LINE_START:
+            if (lineStart)
+                dfa->stack[depth++] = s->out;
+            break;
+        case NFA_LINE_END:
+            if (eol)
+                dfa->stack[depth++] = s->out;
+            else
+                out[(*outCount)++] = i;
+            break;
+        case NFA_MATCH:
+            matched = true;
+            out[(*outCount)++] = i;
+            break;
+        default:
+            out[(*outCount)++] = i;
+            break;
+        }
+    }
+    return matched;
+}
+
+static void begin_group(struct Dfa *dfa)
+{
+    if (dfa->listCount > 0 && dfa->list[dfa->listCount - 1] != GROUP_MARK)
+        dfa->list[dfa->listCount++] = GROUP_MARK;
+}
+
+// Works out the flags of the list being built, dropping every group after the
+// first one that has a match, since those started later.
+static unsigned char finish_list(struct Dfa *dfa, unsigned char flags, bool lineStart)
+{
+    const struct NfaState *states = dfa->nfa->states;
+    int i;
+
+    if (dfa->listCount > 0 && dfa->list[dfa->listCount - 1] == GROUP_MARK)
+        dfa->listCount--;
+    for (i = 0; i < dfa->listCount; i++)
+    {
+        if (dfa->list[i] != GROUP_MARK && states[dfa->list[i]].type == NFA_MATCH)
+        {
+            while (i < dfa->listCount && dfa->list[i] != GROUP_MARK)
+                i++;
+            dfa->listCount = i;
+            flags |= DFA_NO_STARTS | DFA_MATCH;
+            break;
+        }
+    }
+
+    // See whether it would match if the next byte ended the line.
+    dfa->eolMarkGen++;
+    for (i = 0; i < dfa->listCount; i++)
+    {
+        int n = 0;
+
+        if (dfa->list[i] != GROUP_MARK && states[dfa->list[i]].type == NFA_LINE_END
+         && add_closure(dfa, dfa->pending, &n, states[dfa->list[i]].out, lineStart, true))
+        {
+            flags |= DFA_MATCH_AT_EOL;
+            break;
+        }
+    }
+    if (flags & DFA_MATCH)
+        flags |= DFA_MATCH_AT_EOL;
+    if (lineStart)
+        flags |= DFA_LINE_START;
+    return flags;
+}
+
+static int dfa_start_state(struct Dfa *dfa, bool lineStart)
+{
+    unsigned char flags = dfa->anchored ? DFA_NO_STARTS : 0;
+
+    dfa->listCount = 0;
+    dfa->markGen++;
+    add_closure(dfa, dfa->list, &dfa->listCount, dfa->nfa->start, lineStart, false);
+    return dfa_add_state(dfa, finish_list(dfa, flags, lineStart));
+}
+
+// Returns the state after reading 'c' in state 'from', or DFA_DEAD if no
+// match can come of it.
+static int dfa_step(struct Dfa *dfa, int from, unsigned char c)
+{
+    const struct NfaState *states = dfa->nfa->states;
+    const struct ByteSet *sets = dfa->nfa->sets;
+    const struct DfaState *s = &dfa->states[from];
+    unsigned char flags = s->flags & DFA_NO_STARTS;
+    bool lineStart = (c == '\n');
+    int i;
+
+    dfa->listCount = 0;
+    dfa->markGen++;
+    dfa->eolMarkGen++;
+    for (i = 0; i < s->count; i++)
+    {
+        bool matchedHere = false;
+
+        begin_group(dfa);
+        for (; i < s->count && s->insts[i] != GROUP_MARK; i++)
+        {
+            const struct NfaState *inst = &states[s->insts[i]];
+
+            if (inst->type == NFA_BYTES)
+            {
+                if (set_has(&sets[inst->set], c))
+                    add_closure(dfa, dfa->list, &dfa->listCount, inst->out, lineStart, false);
+            }
+            else if (inst->type == NFA_LINE_END && c == '\n')
+            {
+                // It's the end of a line, so follow on from here before
+                // reading the newline.
+                int j;
+
+                dfa->pendingCount = 0;
+                matchedHere |= add_closure(dfa, dfa->pending, &dfa->pendingCount, inst->out,
+                    (s->flags & DFA_LINE_START) != 0, true);
+                for (j = 0; j < dfa->pendingCount; j++)
+                {
+                    const struct NfaState *p = &states[dfa->pending[j]];
+
+                    if (p->type == NFA_BYTES && set_has(&sets[p->set], c))
+                        add_closure(dfa, dfa->list, &dfa->listCount, p->out, lineStart, false);
+                }
+            }
+        }
+        if (matchedHere)
+        {
+            // A match started in this group ended before the newline, so the
+            // groups that started later don't matter any more.
+            flags |= DFA_NO_STARTS;
+            break;
+        }
+    }
+
+    if (!(flags & DFA_NO_STARTS))
+    {
+        begin_group(dfa);
+        add_closure(dfa, dfa->list, &dfa->listCount, dfa->nfa->start, lineStart, false);
+    }
+    flags = finish_list(dfa, flags, lineStart);
+    if (dfa->listCount == 0 && (flags & DFA_NO_STARTS))
+        return DFA_DEAD;
+    return dfa_add_state(dfa, flags);
+}
+
+// Returns the same state, but starting no more matches.
+static int dfa_stop_starts(struct Dfa *dfa, int from)
+{
+    const struct DfaState *s = &dfa->states[from];
+
+    if (s->flags & DFA_NO_STARTS)
+        return from;
+    if (s->count == 0)
+        return DFA_DEAD;
+    memcpy(dfa->list, s->insts, s->count * sizeof(int));
+    dfa->listCount = s->count;
+    return dfa_add_state(dfa, s->flags | DFA_NO_STARTS);
+}
+
+static inline int dfa_next(struct Dfa *dfa, int from, unsigned char c)
+{
+    int next = dfa->next[from * 256 + c];
+
+    if (next == DFA_UNKNOWN)
+    {
+        unsigned int flushes = dfa->flushes;
+
+        next = dfa_step(dfa, from, c);
+        if (dfa->flushes == flushes)
+        {
+            if (next >= 0 && (dfa->states[next].flags & (DFA_MATCH | DFA_MATCH_AT_EOL)))
+                dfa->next[from * 256 + c] = DFA_MATCH_TO(next);
+            else
+                dfa->next[from * 256 + c] = next;
+        }
+        return next;
+    }
+    if (next <= DFA_MATCH_TO(0))
+        return DFA_MATCH_TO(next);  // the encoding is its own inverse
+    return next;
+}
+
+/* Searching */
+
+// Gets at the text buffer's memory in place, as the runs either side of its
+// gap. Fl_Text_Buffer doesn't say where the gap is, but the text is contiguous
+// on either side of it, so it is found by a binary search.
+void textbuf_runs(Fl_Text_Buffer *textbuf, struct RegexText *text)
+{
+    const char *base = textbuf->address(0);
+    int lo = 0;
+    int hi = textbuf->length();
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (textbuf->address(mid) == base + mid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    text->runs[0] = base;
+    text->lengths[0] = lo;
+    text->runs[1] = textbuf->address(lo);
+    text->lengths[1] = textbuf->length() - lo;
+}
+
+static unsigned char text_byte(const struct RegexText *text, int pos)
+{
+    if (pos < text->lengths[0])
+        return text->runs[0][pos];
+    return text->runs[1][pos - text->lengths[0]];
+}
+
+static bool dfa_matches_at(const struct Dfa *dfa, int state, bool eol)
+{
+    unsigned char flags = dfa->states[state].flags;
+
+    return (flags & DFA_MATCH) || ((flags & DFA_MATCH_AT_EOL) && eol);
+}
+
+// Scans forward from 'pos' for the end of the leftmost longest match that
+// starts no later than 'lastStart'. Returns -1 if there isn't one.
+static int find_end(struct Dfa *dfa, const struct RegexText *text, int pos, int lastStart)
+{
+    int length = text->lengths[0] + text->lengths[1];
+    int state = dfa_start_state(dfa, pos == 0 || text_byte(text, pos - 1) == '\n');
+    int end = -1;
+    int run;
+
+    if (pos >= lastStart)
+        state = dfa_stop_starts(dfa, state);
+    if (state == DFA_DEAD)
+        return -1;
+    if (dfa_matches_at(dfa, state, pos == length || text_byte(text, pos) == '\n'))
+        end = pos;
+
+    for (run = 0; run < 2; run++)
+    {
+        const unsigned char *s = (const unsigned char *)text->runs[run];
+        int base = (run == 0) ? 0 : text->lengths[0];
+        int runEnd = base + text->lengths[run];
+        int p;
+
+        for (p = MAX(pos, base); p < runEnd; p++)
+        {
+            int fastEnd = MIN(runEnd, lastStart - 1);
+
+            // Most of the time is spent here, following transitions already
+            // made that don't end a match.
+            while (p < fastEnd)
+            {
+                int next = dfa->next[state * 256 + s[p - base]];
+
+                if (next < 0)
+                    break;
+                state = next;
+                p++;
+            }
+            if (p == runEnd)
+                break;
+
+            state = dfa_next(dfa, state, s[p - base]);
+            if (state >= 0 && p + 1 >= lastStart)
+                state = dfa_stop_starts(dfa, state);
+            if (state == DFA_DEAD)
+                return end;
+            if ((dfa->states[state].flags & (DFA_MATCH | DFA_MATCH_AT_EOL))
+             && dfa_matches_at(dfa, state, p + 1 == length || text_byte(text, p + 1) == '\n'))
+                end = p + 1;
+        }
+    }
+    return end;
+}
+
+// Scans back from 'end' to find where the longest match ending there starts,
+// no earlier than 'pos'.
+static int find_start(struct Dfa *dfa, const struct RegexText *text, int pos, int end)
+{
+    int length = text->lengths[0] + text->lengths[1];
+    int state = dfa_start_state(dfa, end == length || text_byte(text, end) == '\n');
+    int start = -1;
+    int p;
+
+    if (dfa_matches_at(dfa, state, end == 0 || text_byte(text, end - 1) == '\n'))
+        start = end;
+    for (p = end; p > pos; p--)
+    {
+        state = dfa_next(dfa, state, text_byte(text, p - 1));
+        if (state == DFA_DEAD)
+            break;
+        if (dfa_matches_at(dfa, state, p - 1 == 0 || text_byte(text, p - 2) == '\n'))
+            start = p - 1;
+    }
+    return start;
+}
+
+static bool search(struct Regex *re, const struct RegexText *text, int pos, int lastStart,
+    int *matchStart, int *matchEnd)
+{
+    int end = find_end(&re->forwardDfa, text, pos, lastStart);
+
+    if (end < 0)
+        return false;
+    *matchStart = find_start(&re->reverseDfa, text, pos, end);
+    *matchEnd = end;
+    return *matchStart >= 0;
+}
+
+// Compiles a regular expression. Returns NULL and sets 'error' if it isn't
+// valid.
+struct Regex *regex_compile(const char *pattern, bool matchCase, const char **error)
+{
+    struct Regex *re = new Regex;
+    int i;
+
+    memset(re, 0, sizeof(*re));
+    *error = compile_nfa(&re->forward, pattern, matchCase, false);
+    if (*error == NULL)
+        *error = compile_nfa(&re->reverse, pattern, matchCase, true);
+    if (*error != NULL)
+    {
+        free(re->forward.states);
+        free(re->forward.sets);
+        free(re->reverse.states);
+        free(re->reverse.sets);
+        delete re;
+        return NULL;
+    }
+    dfa_init(&re->forwardDfa, &re->forward, false);
+    dfa_init(&re->reverseDfa, &re->reverse, true);
+    re->maxLength = longest_path(&re->forward);
+    re->matchesNewline = false;
+    for (i = 0; i < re->forward.setCount; i++)
+        re->matchesNewline |= set_has(&re->forward.sets[i], '\n');
+    return re;
+}
+
+void regex_free(struct Regex *re)
+{
+    if (re == NULL)
+        return;
+    dfa_free(&re->forwardDfa);
+    dfa_free(&re->reverseDfa);
+    free(re->forward.states);
+    free(re->forward.sets);
+    free(re->reverse.states);
+    free(re->reverse.sets);
+    delete re;
+}
+
+// Finds the leftmost longest match starting from 'pos' to 'lastStart'.
+bool regex_search(struct Regex *re, const struct RegexText *text, int pos, int lastStart,
+    int *matchStart, int *matchEnd)
+{
+    return search(re, text, pos, lastStart, matchStart, matchEnd);
+}
+
+// Finds the last match starting at or before 'pos', looking back through
+// ever bigger windows of the text until one turns up.
+bool regex_search_backward(struct Regex *re, const struct RegexText *text, int pos,
+    int *matchStart, int *matchEnd)
+{
+    int length = text->lengths[0] + text->lengths[1];
+    int window = 4096;
+
+    if (pos < 0)
+        return false;
+    pos = MIN(pos, length);
+    while (1)
+    {
+        int from = MAX(pos - window, 0);
+        bool found = false;
+        int start;
+        int end;
+
+        while (from <= pos && search(re, text, from, pos, &start, &end))
+        {
+            *matchStart = start;
+            *matchEnd = end;
+            found = true;
+            from = (end > start) ? end : start + 1;
+        }
+        if (found)
+            return true;
+        if (pos - window <= 0)
+            return false;
+        window *= 2;
+    }
+}
+
+// Returns the most bytes a match can be, or -1 if there's no limit.
+int regex_max_length(const struct Regex *re)
+{
+    return re->maxLength;
+}
+
+// Returns whether a match may have a newline in it.
+bool regex_matches_newline(const struct Regex *re)
+{
+    return re->matchesNewline;
+}
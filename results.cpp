@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <FL/Fl.H>
+#include <FL/Fl_Window.H>
+#include <FL/Fl_Box.H>
+#include <FL/Fl_Hold_Browser.H>
+
+#include "fledit.hpp"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Lines longer than this are cut short in the list
+#define MAX_SHOWN_LINE 200
+
+// At most this much of a line is shown before a match
+#define MAX_SHOWN_BEFORE 80
+
+// Where a result in the list is
+struct Result
+{
+    unsigned int fileId;  // the open file it's in, or 0
+    char *filename;  // the file it's in otherwise
+    int lineNumber;
+    int start;
+    int end;
+};
+
+static Fl_Window *s_resultsWindow;
+static Fl_Hold_Browser *s_resultsList;
+static Fl_Box *s_statusBox;
+static char s_statusText[128];
+static struct Result *s_results;  // one for each line of the list
+static int s_resultCount;
+static int s_resultCapacity;
+static unsigned int s_generation;  // which search the list belongs to
+static ResultsPickFunc s_pickCallback;
+
+static void cb_on_pick(Fl_Widget *, void *)
+{
+    int i = s_resultsList->value() - 1;
+
+    if (i >= 0 && i < s_resultCount)
+    {
+        s_pickCallback(s_results[i].fileId, s_results[i].filename, s_results[i].lineNumber,
+            s_results[i].start, s_results[i].end);
+    }
+}
+
+// 'pickCallback' is called with where a result is when it's clicked. Results
+// in files that weren't open have their start and end counted from the start
+// of their line.
+void results_init(ResultsPickFunc pickCallback)
+{
+    s_pickCallback = pickCallback;
+    s_resultsWindow = new Fl_Window(500, 300, "Search Results");
+    {
+        s_resultsList = new Fl_Hold_Browser(5, 5, 490, 265);
+        s_resultsList->format_char(0);  // lines of text aren't formatting
+        s_resultsList->callback(cb_on_pick);
+
+        s_statusBox = new Fl_Box(5, 275, 490, 20);
+        s_statusBox->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
+    }
+    s_resultsWindow->end();
+    s_resultsWindow->resizable(s_resultsList);
+}
+
+static void set_status(const char *text)
+{
+    snprintf(s_statusText, sizeof(s_statusText), "%s", text);
+    s_statusBox->label(s_statusText);
+    s_statusBox->redraw();
+}
+
+// Empties the list and shows it, ready for a new search. Returns the number
+// the search passes back when adding results, so that ones from any earlier
+// search still running are left out.
+unsigned int results_clear(void)
+{
+    int i;
+
+    s_resultsList->clear();
+    for (i = 0; i < s_resultCount; i++)
+        free(s_results[i].filename);
+    free(s_results);
+    s_results = NULL;
+    s_resultCount = 0;
+    s_resultCapacity = 0;
+    set_status("Searching...");
+    s_resultsWindow->show();
+    return ++s_generation;
+}
+
+// Writes the label for a match at 'start' in 'text', on the line numbered
+// 'lineNumber', into 'label'. This may be called from any thread.
+void results_format(char *label, size_t size, const char *name, const char *text, int length, int lineNumber, int start)
+{
+    const char *lineEnd;
+    int lineStart = start;
+
+    // Only look so far either side, in case the line is huge.
+    while (lineStart > 0 && start - lineStart < MAX_SHOWN_BEFORE && text[lineStart - 1] != '\n')
+        lineStart--;
+    lineEnd = (const char *)memchr(text + lineStart, '\n', MIN(length - lineStart, MAX_SHOWN_LINE));
+    if (lineEnd == NULL)
+        lineEnd = text + MIN(length, lineStart + MAX_SHOWN_LINE);
+
+    snprintf(label, size, "%s:%i: %.*s", name, lineNumber, (int)(lineEnd - text - lineStart), text + lineStart);
+}
+
+// Adds a match to the list. It's either in the open file numbered 'fileId',
+// or else in 'filename'.
+void results_add(unsigned int generation, const char *label, unsigned int fileId, const char *filename,
+    int lineNumber, int start, int end)
+{
+    struct Result *r;
+
+    if (generation != s_generation)
+        return;
+    if (s_resultCount == s_resultCapacity)
+    {
+        s_resultCapacity = (s_resultCapacity == 0) ? 256 : s_resultCapacity * 2;
+        s_results = (struct Result *)realloc(s_results, s_resultCapacity * sizeof(*s_results));
+    }
+    r = &s_results[s_resultCount++];
+    r->fileId = fileId;
+    r->filename = (filename != NULL) ? strdup(filename) : NULL;
+    r->lineNumber = lineNumber;
+    r->start = start;
+    r->end = end;
+    s_resultsList->add(label);
+}
+
+// Shows 'text' under the list, if it's still showing that search's results.
+void results_status(unsigned int generation, const char *text)
+{
+    if (generation == s_generation)
+        set_status(text);
+}
@@ -26,6 +26,10 @@ static const struct ConfigOption s_configOptions[] =
     {"theme",                    TYPE_UINT, &g_settings.theme},
     {"syntax_highlighting",      TYPE_BOOL, &g_settings.syntaxHighlighting},
     {"mark_double_clicked_word", TYPE_BOOL, &g_settings.markDoubleClickedWord},
+    {"undo_budget_kb",           TYPE_UINT, &g_settings.undoBudgetKB},
+    {"persistent_undo",          TYPE_BOOL, &g_settings.persistentUndo},
+    {"crash_recovery",           TYPE_BOOL, &g_settings.crashRecovery},
+    {"viewer_threshold_mb",      TYPE_UINT, &g_settings.viewerThresholdMB},
 };
 
 static char *s_configFileName = NULL;
@@ -38,6 +42,10 @@ static void load_defaults(void)
     g_settings.theme = 0;
     g_settings.syntaxHighlighting = true;
     g_settings.markDoubleClickedWord = false;
+    g_settings.undoBudgetKB = 64 * 1024;  // 0 for no limit
+    g_settings.persistentUndo = false;
+    g_settings.crashRecovery = true;
+    g_settings.viewerThresholdMB = 64;  // 0 to always edit without asking
 }
 
 static char *choose_config_file_path(void)
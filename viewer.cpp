@@ -0,0 +1,653 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <FL/Fl.H>
+#include <FL/Fl_Group.H>
+#include <FL/Fl_Scrollbar.H>
+#include <FL/fl_draw.H>
+
+#include "fledit.hpp"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define SCROLLBAR_WIDTH 16
+#define TEXT_MARGIN 4
+#define TAB_WIDTH 8
+
+// Only this much of each line is read and drawn. The rest is cut off.
+#define MAX_DRAWN_LINE 1024
+
+// Searching reads the file in pieces of this size
+#define SEARCH_CHUNK (1024 * 1024)
+
+// How many newlines come before every block of this size is kept, so counting
+// them between any two positions only scans part of a block.
+#define LINE_BLOCK_SIZE 65536
+
+// The worker counts the newlines in this many blocks at a time
+#define INDEX_JOB_BLOCKS 1024
+
+// Draws the lines of a ViewedFile that are on screen, reading nothing else.
+class ViewerWidget : public Fl_Group
+{
+public:
+    ViewerWidget(int x, int y, int w, int h);
+    void draw();
+    int handle(int event);
+    void resize(int x, int y, int w, int h);
+
+    struct ViewedFile *file;
+    Fl_Scrollbar *scrollbar;
+};
+
+static ViewerWidget *s_viewer;
+
+/* The mapped file */
+
+static size_t count_newlines(const char *text, size_t length)
+{
+    const char *end = text + length;
+    size_t count = 0;
+
+    if (length == 0)
+        return 0;
+    while ((text = (const char *)memchr(text, '\n', end - text)) != NULL)
+    {
+        count++;
+        text++;
+    }
+    return count;
+}
+
+// Works out how many lines there are from the blocks counted so far. Until
+// they all are, the lines after them are left out.
+static void update_line_count(struct MappedText *mt)
+{
+    size_t last = mt->indexedBlocks - 1;
+
+    mt->lineCount = mt->lineIndex[last] + 1;
+    if (mt->indexedBlocks == mt->numBlocks)
+        mt->lineCount += count_newlines(mt->data + last * LINE_BLOCK_SIZE, mt->length - last * LINE_BLOCK_SIZE);
+}
+
+// Maps a file read-only rather than reading it in. Only the newlines before
+// the first block are known; mapped_index counts the rest. Returns false if
+// it can't be opened.
+static bool mapped_open(struct MappedText *mt, const char *filename)
+{
+    struct stat st;
+    int fd;
+
+    memset(mt, 0, sizeof(*mt));
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        mt->data = (const char *)map;
+        mt->length = st.st_size;
+    }
+    close(fd);
+
+    mt->numBlocks = mt->length / LINE_BLOCK_SIZE + 1;
+    mt->lineIndex = (size_t *)malloc(mt->numBlocks * sizeof(*mt->lineIndex));
+    mt->lineIndex[0] = 0;
+    mt->indexedBlocks = 1;
+    update_line_count(mt);
+    return true;
+}
+
+// Counts the newlines before blocks 'from' up to 'to'. The ones before the
+// block ahead of 'from' must be counted already.
+static void mapped_index(const struct MappedText *mt, size_t from, size_t to)
+{
+    void *start = (char *)mt->data + (from - 1) * LINE_BLOCK_SIZE;
+    size_t length = (to - from) * LINE_BLOCK_SIZE;
+    size_t i;
+
+    // This reads the blocks once. Let the kernel drop those pages afterwards,
+    // so only what's looked at later stays in memory.
+    madvise(start, length, MADV_SEQUENTIAL);
+    for (i = from; i < to; i++)
+        mt->lineIndex[i] = mt->lineIndex[i - 1] + count_newlines(mt->data + (i - 1) * LINE_BLOCK_SIZE, LINE_BLOCK_SIZE);
+    madvise(start, length, MADV_DONTNEED);
+}
+
+static void mapped_free(struct MappedText *mt)
+{
+    if (mt->data != NULL)
+        munmap((void *)mt->data, mt->length);
+    free(mt->lineIndex);
+    memset(mt, 0, sizeof(*mt));
+}
+
+// Returns which line 'pos' is on, counting from 0. Past the blocks counted so
+// far, the newlines are counted from the last of them.
+static size_t mapped_line_of(const struct MappedText *mt, size_t pos)
+{
+    size_t block;
+
+    pos = MIN(pos, mt->length);
+    block = MIN(pos / LINE_BLOCK_SIZE, mt->indexedBlocks - 1);
+    return mt->lineIndex[block] + count_newlines(mt->data + block * LINE_BLOCK_SIZE, pos - block * LINE_BLOCK_SIZE);
+}
+
+// Returns where line 'line', counting from 0, starts, or the length of the
+// text if there aren't that many lines.
+static size_t mapped_line_start(const struct MappedText *mt, size_t line)
+{
+    size_t lo = 0;
+    size_t hi = mt->indexedBlocks - 1;
+    size_t n;
+    const char *p;
+
+    if (line == 0)
+        return 0;
+    if (line >= mt->lineCount && mt->indexedBlocks == mt->numBlocks)
+        return mt->length;
+
+    // Find the last block with fewer newlines before it than the line.
+    n = line - 1;  // the newline just before it
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo + 1) / 2;
+
+        if (mt->lineIndex[mid] <= n)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    n -= mt->lineIndex[lo];
+    p = mt->data + lo * LINE_BLOCK_SIZE;
+    while (1)
+    {
+        p = (const char *)memchr(p, '\n', mt->data + mt->length - p);
+        if (p == NULL)
+            return mt->length;  // past the lines counted so far
+        if (n-- == 0)
+            return p - mt->data + 1;
+        p++;
+    }
+}
+
+// Lets the kernel drop the mapped pages wholly under 'start' to 'end' from
+// memory. They are read back in from the file if they're looked at again.
+static void mapped_release(struct MappedText *mt, size_t start, size_t end)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t first = (start + pageSize - 1) / pageSize * pageSize;
+    size_t last = MIN(end, mt->length) / pageSize * pageSize;
+
+    if (last > first)
+        madvise((char *)mt->data + first, last - first, MADV_DONTNEED);
+}
+
+/* The widget */
+
+static size_t visible_rows(void)
+{
+    fl_font(g_settings.fontFace, g_settings.fontSize);
+    return MAX(s_viewer->h() / fl_height(), 1);
+}
+
+// Lets the pages under 'start' to 'end' go, except for any on screen.
+static void release_unshown(struct ViewedFile *vf, size_t start, size_t end)
+{
+    mapped_release(&vf->text, start, MIN(end, vf->shownStart));
+    mapped_release(&vf->text, MAX(start, vf->shownEnd), end);
+}
+
+static void update_scrollbar(struct ViewedFile *vf)
+{
+    // The scrollbar only counts to INT_MAX. Lines past that are still reached
+    // with the keyboard or Go to Line.
+    int total = MIN(vf->text.lineCount, (size_t)INT_MAX);
+    int top = MIN(vf->topLine, (size_t)total);
+
+    s_viewer->scrollbar->value(top, visible_rows(), 0, total);
+}
+
+static void scroll_to(struct ViewedFile *vf, size_t line)
+{
+    size_t lineCount = vf->text.lineCount;
+    size_t rows = visible_rows();
+
+    // Don't scroll past the point where the last line is at the bottom.
+    if (line + rows > lineCount)
+        line = (lineCount > rows) ? lineCount - rows : 0;
+    vf->topLine = line;
+    if (s_viewer->file == vf)
+    {
+        update_scrollbar(vf);
+        s_viewer->redraw();
+    }
+}
+
+static void scroll_by(struct ViewedFile *vf, long lines)
+{
+    if (lines < 0 && (size_t)-lines > vf->topLine)
+        scroll_to(vf, 0);
+    else
+        scroll_to(vf, vf->topLine + lines);
+}
+
+// Scrolls so that the text at 'pos' is on screen, if it isn't already.
+static void reveal(struct ViewedFile *vf, size_t pos)
+{
+    size_t line = mapped_line_of(&vf->text, pos);
+    size_t rows = visible_rows();
+
+    if (line < vf->topLine || line >= vf->topLine + rows)
+        scroll_to(vf, (line > rows / 3) ? line - rows / 3 : 0);
+    else if (s_viewer->file == vf)
+        s_viewer->redraw();
+}
+
+static void draw_lines(ViewerWidget *v, struct ViewedFile *vf)
+{
+    size_t total = vf->text.length;
+    size_t pos = mapped_line_start(&vf->text, vf->topLine);
+    size_t prevStart = vf->shownStart;
+    size_t prevEnd = vf->shownEnd;
+    int lineHeight;
+    int textX = v->x() + TEXT_MARGIN;
+    int rowY = v->y();
+    size_t row;
+
+    fl_font(g_settings.fontFace, g_settings.fontSize);
+    lineHeight = fl_height();
+
+    vf->shownStart = pos;
+    for (row = 0; rowY < v->y() + v->h() && pos < total; row++)
+    {
+        char line[MAX_DRAWN_LINE];
+        char shown[MAX_DRAWN_LINE * TAB_WIDTH];
+        size_t n = MIN((size_t)MAX_DRAWN_LINE, total - pos);
+        const char *newline;
+        size_t length;
+        size_t next;
+        size_t hlStart = MAX(vf->matchStart, pos);
+        size_t hlEnd;
+        int hlFrom = 0;
+        int hlTo = 0;
+        int col = 0;
+        size_t i;
+
+        memcpy(line, vf->text.data + pos, n);
+        newline = (const char *)memchr(line, '\n', n);
+        if (newline != NULL)
+        {
+            length = newline - line;
+            next = pos + length + 1;
+        }
+        else
+        {
+            length = n;
+            next = mapped_line_start(&vf->text, vf->topLine + row + 1);
+        }
+        hlEnd = MIN(vf->matchEnd, pos + length);
+
+        for (i = 0; i < length; i++)
+        {
+            if (pos + i == hlStart)
+                hlFrom = col;
+            if (pos + i == hlEnd)
+                hlTo = col;
+            if (line[i] == '\t')
+            {
+                do
+                    shown[col++] = ' ';
+                while (col % TAB_WIDTH != 0);
+            }
+            else
+            {
+                shown[col++] = line[i];
+            }
+        }
+        if (hlEnd == pos + length)
+            hlTo = col;
+
+        if (hlStart < hlEnd)
+        {
+            int hlX = textX + (int)fl_width(shown, hlFrom);
+
+            fl_color(FL_SELECTION_COLOR);
+            fl_rectf(hlX, rowY, (int)fl_width(shown + hlFrom, hlTo - hlFrom), lineHeight);
+        }
+        fl_color(FL_FOREGROUND_COLOR);
+        fl_draw(shown, col, textX, rowY + lineHeight - fl_descent());
+
+        rowY += lineHeight;
+        pos = next;
+    }
+    vf->shownEnd = pos;
+
+    // Drop what scrolled off, so only what's on screen stays in memory.
+    release_unshown(vf, prevStart, prevEnd);
+}
+
+ViewerWidget::ViewerWidget(int x, int y, int w, int h) : Fl_Group(x, y, w, h)
+{
+    file = NULL;
+    scrollbar = new Fl_Scrollbar(x + w - SCROLLBAR_WIDTH, y, SCROLLBAR_WIDTH, h);
+    end();
+}
+
+void ViewerWidget::draw()
+{
+    int textW = w() - SCROLLBAR_WIDTH;
+
+    fl_color(FL_BACKGROUND2_COLOR);
+    fl_rectf(x(), y(), textW, h());
+    if (file != NULL)
+    {
+        fl_push_clip(x(), y(), textW, h());
+        draw_lines(this, file);
+        if (file->indexJob != NULL)
+        {
+            char note[64];
+            int noteW;
+            int noteH;
+
+            // Until all of the lines are counted, the scrollbar doesn't reach
+            // the end.
+            snprintf(note, sizeof(note), "Counting lines... %d%%",
+              (int)(file->text.indexedBlocks * 100 / file->text.numBlocks));
+            noteW = (int)fl_width(note) + 2 * TEXT_MARGIN;
+            noteH = fl_height();
+            fl_color(FL_BACKGROUND_COLOR);
+            fl_rectf(x() + textW - noteW, y() + h() - noteH, noteW, noteH);
+            fl_color(FL_FOREGROUND_COLOR);
+            fl_draw(note, x() + textW - noteW + TEXT_MARGIN, y() + h() - fl_descent());
+        }
+        fl_pop_clip();
+    }
+    draw_child(*scrollbar);
+}
+
+int ViewerWidget::handle(int event)
+{
+    if (file == NULL)
+        return Fl_Group::handle(event);
+
+    switch (event)
+    {
+    case FL_PUSH:
+        if (Fl_Group::handle(event))
+            return 1;
+        take_focus();
+        return 1;
+    case FL_FOCUS:
+    case FL_UNFOCUS:
+        return 1;
+    case FL_MOUSEWHEEL:
+        scroll_by(file, 3 * Fl::event_dy());
+        return 1;
+    case FL_KEYBOARD:
+        switch (Fl::event_key())
+        {
+        case FL_Up:
+            scroll_by(file, -1);
+            return 1;
+        case FL_Down:
+            scroll_by(file, 1);
+            return 1;
+        case FL_Page_Up:
+            scroll_by(file, -(long)visible_rows() + 1);
+            return 1;
+        case FL_Page_Down:
+            scroll_by(file, visible_rows() - 1);
+            return 1;
+        case FL_Home:
+            scroll_to(file, 0);
+            return 1;
+        case FL_End:
+            scroll_to(file, file->text.lineCount);
+            return 1;
+        }
+        break;
+    }
+    return Fl_Group::handle(event);
+}
+
+void ViewerWidget::resize(int x, int y, int w, int h)
+{
+    Fl_Widget::resize(x, y, w, h);
+    scrollbar->resize(x + w - SCROLLBAR_WIDTH, y, SCROLLBAR_WIDTH, h);
+    if (file != NULL)
+        update_scrollbar(file);
+}
+
+static void cb_scroll(Fl_Widget *, void *)
+{
+    if (s_viewer->file != NULL)
+        scroll_to(s_viewer->file, s_viewer->scrollbar->value());
+}
+
+/* Counting lines */
+
+// Counts the newlines in a stretch of a viewed file on the worker thread, so
+// opening a big one doesn't wait for all of it to be read.
+struct IndexJob
+{
+    struct ViewedFile *vf;  // NULL if the file was closed
+    struct MappedText text;  // freed here if the file was closed
+    size_t from;
+    size_t to;
+};
+
+static void start_index_job(struct ViewedFile *vf);
+
+static void index_job_work(void *data)
+{
+    struct IndexJob *job = (struct IndexJob *)data;
+
+    mapped_index(&job->text, job->from, job->to);
+}
+
+static void index_job_done(void *data)
+{
+    struct IndexJob *job = (struct IndexJob *)data;
+    struct ViewedFile *vf = job->vf;
+
+    if (vf == NULL)
+    {
+        mapped_free(&job->text);
+        delete job;
+        return;
+    }
+    vf->indexJob = NULL;
+    vf->text.indexedBlocks = job->to;
+    update_line_count(&vf->text);
+    delete job;
+    if (vf->text.indexedBlocks < vf->text.numBlocks)
+        start_index_job(vf);
+    if (s_viewer->file == vf)
+    {
+        update_scrollbar(vf);
+        s_viewer->redraw();
+    }
+}
+
+static void start_index_job(struct ViewedFile *vf)
+{
+    struct IndexJob *job = new IndexJob;
+
+    job->vf = vf;
+    job->text = vf->text;
+    job->from = vf->text.indexedBlocks;
+    job->to = MIN(job->from + INDEX_JOB_BLOCKS, vf->text.numBlocks);
+    vf->indexJob = job;
+    worker_submit(index_job_work, index_job_done, job);
+}
+
+/* The viewer */
+
+// Creates the widget that shows viewed files, which starts out hidden.
+Fl_Widget *viewer_init(int x, int y, int w, int h)
+{
+    s_viewer = new ViewerWidget(x, y, w, h);
+    s_viewer->scrollbar->callback(cb_scroll);
+    s_viewer->hide();
+    return s_viewer;
+}
+
+// Maps a file to be viewed, and starts counting its lines. Returns false if
+// it can't be opened.
+bool viewer_open(struct ViewedFile *vf, const char *filename)
+{
+    memset(vf, 0, sizeof(*vf));
+    if (!mapped_open(&vf->text, filename))
+        return false;
+    if (vf->text.indexedBlocks < vf->text.numBlocks)
+        start_index_job(vf);
+    return true;
+}
+
+void viewer_close(struct ViewedFile *vf)
+{
+    if (s_viewer->file == vf)
+        viewer_show(NULL);
+    if (vf->indexJob != NULL)
+    {
+        // The job is still counting, so it frees the mapping once it's done.
+        vf->indexJob->vf = NULL;
+        vf->indexJob = NULL;
+        memset(&vf->text, 0, sizeof(vf->text));
+    }
+    else
+        mapped_free(&vf->text);
+}
+
+// Shows a file in the viewer, or hides the viewer if 'vf' is NULL.
+void viewer_show(struct ViewedFile *vf)
+{
+    s_viewer->file = vf;
+    if (vf != NULL)
+    {
+        update_scrollbar(vf);
+        s_viewer->show();
+        s_viewer->redraw();
+        s_viewer->take_focus();
+    }
+    else
+    {
+        s_viewer->hide();
+    }
+}
+
+// Scrolls so that 'line', counting from 0, is at the top.
+void viewer_goto_line(struct ViewedFile *vf, size_t line)
+{
+    scroll_to(vf, line);
+}
+
+// Looks for 'text' after the last match, or before it if 'forward' is false,
+// and highlights it. Returns false if it isn't there.
+bool viewer_find(struct ViewedFile *vf, const char *text, bool forward, bool matchCase)
+{
+    size_t length = strlen(text);
+    size_t total = vf->text.length;
+    size_t from;
+    char *needle;
+    char *chunk;
+    bool found = false;
+    size_t i;
+
+    if (length == 0 || length > total)
+        return false;
+    if (vf->matchEnd > vf->matchStart)
+        from = forward ? vf->matchEnd : vf->matchStart;
+    else
+        from = mapped_line_start(&vf->text, vf->topLine);
+
+    needle = (char *)malloc(length);
+    chunk = (char *)malloc(SEARCH_CHUNK + length);
+    for (i = 0; i < length; i++)
+        needle[i] = matchCase ? text[i] : tolower((unsigned char)text[i]);
+
+    // Each piece overlaps the next by one less than the length of the text, so
+    // matches that cross between them are still found.
+    if (forward)
+    {
+        size_t pos;
+
+        for (pos = from; pos + length <= total && !found; pos += SEARCH_CHUNK)
+        {
+            size_t n = MIN((size_t)SEARCH_CHUNK + length - 1, total - pos);
+            const char *p;
+
+            memcpy(chunk, vf->text.data + pos, n);
+            if (!matchCase)
+            {
+                for (i = 0; i < n; i++)
+                    chunk[i] = tolower((unsigned char)chunk[i]);
+            }
+            p = (const char *)memmem(chunk, n, needle, length);
+            release_unshown(vf, pos, pos + n);
+            if (p != NULL)
+            {
+                vf->matchStart = pos + (p - chunk);
+                found = true;
+            }
+        }
+    }
+    else
+    {
+        size_t end = MIN(from + length - 1, total);  // matches must start before 'from'
+
+        while (end >= length && !found)
+        {
+            size_t start = (end > SEARCH_CHUNK + length - 1) ? end - (SEARCH_CHUNK + length - 1) : 0;
+            size_t n = end - start;
+            const char *p = NULL;
+            const char *q = chunk;
+
+            memcpy(chunk, vf->text.data + start, n);
+            if (!matchCase)
+            {
+                for (i = 0; i < n; i++)
+                    chunk[i] = tolower((unsigned char)chunk[i]);
+            }
+            while ((q = (const char *)memmem(q, chunk + n - q, needle, length)) != NULL)
+                p = q++;
+            release_unshown(vf, start, end);
+            if (p != NULL)
+            {
+                vf->matchStart = start + (p - chunk);
+                found = true;
+            }
+            if (start == 0)
+                break;
+            end = start + length - 1;
+        }
+    }
+
+    free(needle);
+    free(chunk);
+    if (found)
+    {
+        vf->matchEnd = vf->matchStart + length;
+        reveal(vf, vf->matchStart);
+    }
+    return found;
+}
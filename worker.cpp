@@ -0,0 +1,172 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <FL/Fl.H>
+
+#include "fledit.hpp"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define MAX_PARALLEL_THREADS 64
+
+struct WorkerJob
+{
+    struct WorkerJob *next;
+    WorkerFunc work;
+    WorkerFunc done;
+    void *data;
+};
+
+struct ParallelFor
+{
+    ParallelFunc func;
+    void *data;
+    int count;
+    int next;  // the next index to run, claimed atomically
+};
+
+static pthread_mutex_t s_queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_queueCond = PTHREAD_COND_INITIALIZER;
+static struct WorkerJob *s_queueHead = NULL;
+static struct WorkerJob *s_queueTail = NULL;
+static bool s_running = false;
+static volatile bool s_stopping = false;
+static pthread_t s_thread;
+
+static void cb_job_done(void *data)
+{
+    struct WorkerJob *job = (struct WorkerJob *)data;
+
+    job->done(job->data);
+    delete job;
+}
+
+static void *worker_main(void *)
+{
+    while (1)
+    {
+        struct WorkerJob *job;
+
+        pthread_mutex_lock(&s_queueMutex);
+        while (s_queueHead == NULL && !s_stopping)
+            pthread_cond_wait(&s_queueCond, &s_queueMutex);
+        if (s_queueHead == NULL)
+        {
+            pthread_mutex_unlock(&s_queueMutex);
+            break;
+        }
+        job = s_queueHead;
+        s_queueHead = job->next;
+        if (s_queueHead == NULL)
+            s_queueTail = NULL;
+        pthread_mutex_unlock(&s_queueMutex);
+
+        job->work(job->data);
+
+        // Nothing is left to hand the results to once the program is exiting.
+        if (s_stopping)
+            delete job;
+        else
+            worker_awake(cb_job_done, job);
+    }
+    return NULL;
+}
+
+// Calls func(data) on the UI thread, from any other thread. FLTK's awake
+// queue is small, so this waits for room if it's full, unless the program is
+// exiting and it will never be emptied.
+void worker_awake(WorkerFunc func, void *data)
+{
+    while (Fl::awake(func, data) != 0 && !s_stopping)
+        usleep(1000);
+}
+
+// Starts the worker thread. Fl::lock() must have been called first so that
+// finished jobs can be handed back with Fl::awake().
+void worker_init(void)
+{
+    if (pthread_create(&s_thread, NULL, worker_main, NULL) != 0)
+    {
+        perror("could not start worker thread");
+        return;
+    }
+    s_running = true;
+}
+
+// Runs whatever jobs are still queued, such as the last writes to the undo
+// journals, and stops the worker thread. Their done functions aren't called.
+void worker_shutdown(void)
+{
+    if (!s_running)
+        return;
+    pthread_mutex_lock(&s_queueMutex);
+    s_stopping = true;
+    pthread_cond_signal(&s_queueCond);
+    pthread_mutex_unlock(&s_queueMutex);
+    pthread_join(s_thread, NULL);
+    s_running = false;
+}
+
+// Runs work(data) on the worker thread, then done(data) on the UI thread.
+void worker_submit(WorkerFunc work, WorkerFunc done, void *data)
+{
+    struct WorkerJob *job = new WorkerJob;
+
+    job->next = NULL;
+    job->work = work;
+    job->done = done;
+    job->data = data;
+
+    pthread_mutex_lock(&s_queueMutex);
+    if (s_queueTail != NULL)
+        s_queueTail->next = job;
+    else
+        s_queueHead = job;
+    s_queueTail = job;
+    pthread_cond_signal(&s_queueCond);
+    pthread_mutex_unlock(&s_queueMutex);
+}
+
+// Returns the number of processors available.
+int worker_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? count : 1;
+}
+
+static void *parallel_for_main(void *arg)
+{
+    struct ParallelFor *pf = (struct ParallelFor *)arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&pf->next, 1)) < pf->count)
+        pf->func(pf->data, i);
+    return NULL;
+}
+
+// Runs func(data, i) for every i from 0 to count - 1, spread across all
+// processors, and returns once they are all done. The calling thread does its
+// share of the work too.
+void worker_parallel_for(int count, ParallelFunc func, void *data)
+{
+    struct ParallelFor pf;
+    int numThreads = MIN(worker_cpu_count(), MAX_PARALLEL_THREADS) - 1;
+    pthread_t threads[MAX_PARALLEL_THREADS];
+    int started = 0;
+    int i;
+
+    pf.func = func;
+    pf.data = data;
+    pf.count = count;
+    pf.next = 0;
+
+    for (i = 0; i < numThreads && i < count - 1; i++)
+    {
+        if (pthread_create(&threads[started], NULL, parallel_for_main, &pf) == 0)
+            started++;
+    }
+    parallel_for_main(&pf);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}